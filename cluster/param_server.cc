@@ -0,0 +1,317 @@
+/*
+Copyright (c) by respective owners including Yahoo!, Microsoft, and
+individual contributors. All rights reserved.  Released under a BSD (revised)
+license as described in the file LICENSE.
+
+This serves one shard of the weights of a vw job trained with --ps_servers.  Workers pull the
+current value of the weights an example uses and push what they changed them by, and each worker
+advances a clock every --ps_batch examples.  A pull is held back until every worker's clock is
+within the job's staleness of the puller's, so no worker runs more than that many batches ahead of
+the slowest one.
+
+ */
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <iostream>
+#include <fstream>
+#include <map>
+#include <vector>
+
+using namespace std;
+
+typedef int socket_t;
+
+const size_t done_clock = (size_t)-1;
+
+//weights are stored by weight number; ones no worker has pulled yet aren't stored at all.
+map<uint32_t, float> weights;
+size_t total = 0; //workers in the job, 0 between jobs.
+size_t staleness = 0;
+vector<size_t> clocks; //each worker's, done_clock once it finished.
+size_t connected = 0;
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t clock_moved = PTHREAD_COND_INITIALIZER;
+
+size_t min_clock()
+{
+  size_t m = done_clock;
+  for (size_t i = 0; i < clocks.size(); i++)
+    if (clocks[i] < m)
+      m = clocks[i];
+  return m;
+}
+
+bool recv_all(socket_t sock, void* buf, size_t len)
+{
+  for (size_t got = 0; got < len; )
+    {
+      ssize_t r = recv(sock, (char*)buf + got, len - got, 0);
+      if (r <= 0)
+	{
+	  if (r < 0 && errno == EINTR)
+	    continue;
+	  return false;
+	}
+      got += r;
+    }
+  return true;
+}
+
+bool send_all(socket_t sock, const void* buf, size_t len)
+{
+  for (size_t sent = 0; sent < len; )
+    {
+      ssize_t r = send(sock, (const char*)buf + sent, len - sent, 0);
+      if (r <= 0)
+	{
+	  if (r < 0 && errno == EINTR)
+	    continue;
+	  return false;
+	}
+      sent += r;
+    }
+  return true;
+}
+
+struct pull_entry {
+  uint32_t index;
+  float value; //the worker's own, used if the weight isn't stored yet.
+};
+
+struct push_entry {
+  uint32_t index;
+  float delta;
+};
+
+/* Serves one worker's requests in order until it disconnects:
+   'p' count {index, value}*  pull; answered with count floats
+   'u' count {index, delta}*  push
+   'c'                        advance the clock
+   'd'                        done; the clock no longer holds anybody back
+   'a'                        once all are done, answered with a count and every stored {index, value}
+   's'                        the same right away, as the workers' pushes have made it so far */
+void* serve(void* arg)
+{
+  socket_t sock = (socket_t)(intptr_t)arg;
+  size_t node = 0, job_total = 0, job_staleness = 0;
+  if (!recv_all(sock, &node, sizeof(node)) || !recv_all(sock, &job_total, sizeof(job_total))
+      || !recv_all(sock, &job_staleness, sizeof(job_staleness)))
+    {
+      close(sock);
+      return NULL;
+    }
+
+  int ok = true;
+  pthread_mutex_lock(&lock);
+  if (total == 0)
+    {
+      total = job_total;
+      staleness = job_staleness;
+      clocks.assign(total, 0);
+      weights.clear();
+      cerr << "new job of " << total << " workers, staleness " << staleness << endl;
+    }
+  if (job_total != total || node >= total)
+    {
+      cerr << "worker " << node << " of " << job_total << " doesn't belong to the job of " << total << endl;
+      ok = false;
+    }
+  else
+    connected++;
+  pthread_mutex_unlock(&lock);
+  send_all(sock, &ok, sizeof(ok));
+  if (!ok)
+    {
+      close(sock);
+      return NULL;
+    }
+
+  vector<pull_entry> pulls;
+  vector<push_entry> pushes;
+  vector<float> values;
+  size_t clock = 0;
+  char op;
+  while (recv_all(sock, &op, 1))
+    {
+      uint32_t count = 0;
+      if ((op == 'p' || op == 'u') && !recv_all(sock, &count, sizeof(count)))
+	break;
+      if (op == 'p')
+	{
+	  pulls.resize(count);
+	  values.resize(count);
+	  if (count > 0 && !recv_all(sock, &pulls[0], count*sizeof(pull_entry)))
+	    break;
+	  pthread_mutex_lock(&lock);
+	  while (clock > staleness && min_clock() < clock - staleness)
+	    pthread_cond_wait(&clock_moved, &lock);
+	  for (size_t i = 0; i < count; i++)
+	    {
+	      map<uint32_t, float>::iterator w = weights.find(pulls[i].index);
+	      if (w == weights.end())
+		w = weights.insert(make_pair(pulls[i].index, pulls[i].value)).first;
+	      values[i] = w->second;
+	    }
+	  pthread_mutex_unlock(&lock);
+	  if (count > 0 && !send_all(sock, &values[0], count*sizeof(float)))
+	    break;
+	}
+      else if (op == 'u')
+	{
+	  pushes.resize(count);
+	  if (count > 0 && !recv_all(sock, &pushes[0], count*sizeof(push_entry)))
+	    break;
+	  pthread_mutex_lock(&lock);
+	  for (size_t i = 0; i < count; i++)
+	    weights[pushes[i].index] += pushes[i].delta;
+	  pthread_mutex_unlock(&lock);
+	}
+      else if (op == 'c' || op == 'd')
+	{
+	  pthread_mutex_lock(&lock);
+	  clock = op == 'c' ? clock + 1 : done_clock;
+	  clocks[node] = clock;
+	  pthread_cond_broadcast(&clock_moved);
+	  pthread_mutex_unlock(&lock);
+	}
+      else if (op == 'a' || op == 's')
+	{
+	  pthread_mutex_lock(&lock);
+	  while (op == 'a' && min_clock() != done_clock)
+	    pthread_cond_wait(&clock_moved, &lock);
+	  uint64_t stored = weights.size();
+	  vector<pull_entry> all;
+	  all.reserve(weights.size());
+	  for (map<uint32_t, float>::iterator w = weights.begin(); w != weights.end(); w++)
+	    {
+	      pull_entry e = {w->first, w->second};
+	      all.push_back(e);
+	    }
+	  pthread_mutex_unlock(&lock);
+	  if (!send_all(sock, &stored, sizeof(stored))
+	      || (stored > 0 && !send_all(sock, &all[0], stored*sizeof(pull_entry))))
+	    break;
+	}
+      else
+	{
+	  cerr << "worker " << node << " sent an unknown request" << endl;
+	  break;
+	}
+    }
+  close(sock);
+
+  pthread_mutex_lock(&lock);
+  if (clocks[node] != done_clock)
+    {
+      cerr << "worker " << node << " left before it was done" << endl;
+      clocks[node] = done_clock; //so it holds nobody back
+      pthread_cond_broadcast(&clock_moved);
+    }
+  if (--connected == 0 && min_clock() == done_clock)
+    {
+      cerr << "job done, " << weights.size() << " weights stored" << endl;
+      total = 0;
+      clocks.clear();
+    }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+void usage()
+{
+  cerr << "usage: param_server [--nondaemon] [--port <p>] [pid_file]" << endl;
+  exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+  bool nondaemon = false;
+  const char* pid_file_name = NULL;
+  short unsigned int port = 26545;
+  for (int i = 1; i < argc; i++)
+    {
+      if (strcmp("--nondaemon",argv[i])==0)
+	nondaemon = true;
+      else if (strcmp("--port",argv[i])==0 && i+1 < argc)
+	port = atoi(argv[++i]);
+      else if (argv[i][0] != '-' && pid_file_name == NULL)
+	pid_file_name = argv[i];
+      else
+	usage();
+    }
+
+  signal(SIGPIPE, SIG_IGN); //workers may die at any time
+
+  socket_t sock = socket(PF_INET, SOCK_STREAM, 0);
+  if (sock < 0)
+    {
+      cerr << "can't open socket! " << errno << endl;
+      exit(1);
+    }
+  int on = 1;
+  if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char*)&on, sizeof(on)) < 0)
+    perror("setsockopt SO_REUSEADDR");
+
+  sockaddr_in address;
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(port);
+  if (bind(sock,(sockaddr*)&address, sizeof(address)) < 0)
+    {
+      cerr << "failure to bind!" << endl;
+      exit(1);
+    }
+
+  if (!nondaemon)
+    if (daemon(1,1))
+      {
+	cerr << "failure to background!" << endl;
+	exit(1);
+      }
+
+  if (pid_file_name != NULL)
+    {
+      ofstream pid_file;
+      pid_file.open(pid_file_name);
+      if (!pid_file.is_open())
+	{
+	  cerr << "error writing pid file" << endl;
+	  exit(1);
+	}
+      pid_file << getpid() << endl;
+      pid_file.close();
+    }
+
+  listen(sock, 1024);
+  while (true)
+    {
+      sockaddr_in client_address;
+      socklen_t size = sizeof(client_address);
+      socket_t f = accept(sock,(sockaddr*)&client_address,&size);
+      if (f < 0)
+	{
+	  if (errno != EINTR)
+	    perror("accept failed");
+	  continue;
+	}
+      setsockopt(f, IPPROTO_TCP, TCP_NODELAY, (char*)&on, sizeof(on));
+      pthread_t thread;
+      if (pthread_create(&thread, NULL, serve, (void*)(intptr_t)f) != 0)
+	{
+	  cerr << "can't start a thread for a worker" << endl;
+	  close(f);
+	  continue;
+	}
+      pthread_detach(thread);
+    }
+}
@@ -3,7 +3,8 @@ Copyright (c) 2011 Yahoo! Inc.  All rights reserved.  The copyrights
 embodied in the content of this file are licensed under the BSD
 (revised) open source license
 
-This creates a binary tree topology over a set of n nodes that connect.
+This creates a binary tree topology over a set of n nodes that connect,
+for any number of jobs at once.
 
  */
 #ifdef _WIN32
@@ -14,6 +15,7 @@ This creates a binary tree topology over a set of n nodes that connect.
 #include <io.h>
 
 #define CLOSESOCK closesocket
+#define poll WSAPoll
 
 typedef unsigned int uint32_t;
 typedef unsigned short uint16_t;
@@ -37,6 +39,8 @@ int getpid()
 #include <netinet/tcp.h>
 #include <netdb.h>
 #include <strings.h>
+#include <fcntl.h>
+#include <poll.h>
 
 #define CLOSESOCK close
 
@@ -53,24 +57,62 @@ typedef int socket_t;
 #include <fstream>
 #include <cmath>
 #include <map>
+#include <vector>
+#include <time.h>
+#include <signal.h>
 
 using namespace std;
 
+const size_t max_rack = 255;
+
 struct client {
   uint32_t client_ip;
   socket_t socket;
+  size_t id;
+  char rack[max_rack+1];
+  bool local; //reduces with the other such nodes on its machine first.
+  size_t local_rank; //among them; only rank 0 is in the tree.
+  size_t local_size;
+  uint16_t port;
+  size_t port_read; //bytes of port received while the tree is built.
 };
 
+//a new connection that hasn't sent all of its unique id, node count, node id, rack and local flag yet.
+struct handshake {
+  socket_t socket;
+  uint32_t client_ip;
+  char buf[3*sizeof(size_t)+sizeof(uint16_t)+max_rack+1];
+  size_t got;
+};
+
+/* One job, identified by its unique id.  Nodes register by node id, and once all have (less any
+   dropped) they get a tree.  Their connections are then kept open: one closing means the node died,
+   and a byte on it means the node's allreduce failed and it wants a new tree. */
 struct partial {
-  client* nodes;
+  size_t total;
+  client* nodes; //registered for the next tree, by node id.  socket -1 if not.
   size_t filled;
+  client* members; //in the current tree, by node id.
+  bool* dropped;
+  bool* relaunched;
+  time_t waiting_since; //when the first node registered for the next tree.
+  time_t last_report;
+  int* parent; //in the tree being built, by node id.
+  size_t ports_left; //the tree is being built until all its nodes have sent their port.
 };
 
-static int socket_sort(const void* s1, const void* s2) {
+enum straggler_policy { WAIT, DROP, SPECULATE };
+
+static int rack_sort(const void* s1, const void* s2) {
 
   client* socket1 = (client*)s1;
   client* socket2 = (client*)s2;
-  return socket1->client_ip - socket2->client_ip;
+  int rack = strcmp(socket1->rack, socket2->rack);
+  if (rack != 0)
+    return rack;
+  if (socket1->client_ip != socket2->client_ip)
+    return socket1->client_ip < socket2->client_ip ? -1 : 1;
+  return 0;
 }
 
 int build_tree(int*  parent, uint16_t* kid_count, size_t source_count, int offset) {
@@ -103,26 +145,469 @@ int build_tree(int*  parent, uint16_t* kid_count, size_t source_count, int offse
   return oroot;
 }
 
+/* For nodes sorted by rack: the first two nodes of each rack are its gateways, and the rest form a
+   tree under the second.  The racks form a binary tree too, a rack's first child hanging off its
+   first gateway and its second child off its second one.  So only racks-1 links leave a rack. */
+void build_rack_tree(int* parent, uint16_t* kid_count, client* nodes, size_t total)
+{
+  size_t* rack_start = (size_t*)calloc(total+1, sizeof(size_t));
+  size_t racks = 0;
+  for (size_t i = 0; i < total; i++)
+    if (i == 0 || strcmp(nodes[i].rack, nodes[i-1].rack) != 0)
+      rack_start[racks++] = i;
+  rack_start[racks] = total;
+
+  for (size_t r = 0; r < racks; r++)
+    {
+      int first = (int)rack_start[r];
+      size_t count = rack_start[r+1] - first;
+      if (count > 1)
+	parent[first+1] = first;
+      if (count > 2)
+	parent[build_tree(parent, kid_count, count-2, first+2)] = first+1;
+
+      if (r == 0)
+	parent[first] = -1;
+      else
+	{
+	  size_t up = (r-1)/2;
+	  int gateway = (int)rack_start[up];
+	  if (r % 2 == 0 && rack_start[up+1] - rack_start[up] > 1)
+	    gateway++;
+	  parent[first] = gateway;
+	}
+    }
+  free(rack_start);
+
+  for (size_t i = 0; i < total; i++)
+    kid_count[i] = 0;
+  for (size_t i = 0; i < total; i++)
+    if (parent[i] >= 0)
+      kid_count[parent[i]]++;
+}
+
+//a node that died mid setup just gets a broken tree, which it rebuilds, so this is not fatal.
 void fail_send(const socket_t fd, const void* buf, const int count)
 {
   if (send(fd,(char*)buf,count,0)==-1)
+    cerr << "send failed!" << endl;
+}
+
+void set_nonblocking(socket_t sock)
+{
+#ifdef _WIN32
+  u_long on = 1;
+  ioctlsocket(sock, FIONBIO, &on);
+#else
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+#endif
+}
+
+bool would_block()
+{
+#ifdef _WIN32
+  return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+  return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+/* so a node whose machine went away is noticed too.  The system's keepalive takes hours to give up
+   on a connection, so with a timeout it probes after timeout idle seconds and gives up about as long
+   after that. */
+void keep_alive(const socket_t f, const size_t timeout)
+{
+  int on = 1;
+  setsockopt(f, SOL_SOCKET, SO_KEEPALIVE, (char*)&on, sizeof(on));
+#ifdef TCP_KEEPIDLE
+  if (timeout > 0)
     {
-      cerr << "send failed!" << endl;
-      exit(1);
+      int idle = (int)timeout;
+      int interval = idle >= 3 ? idle / 3 : 1;
+      int probes = 3;
+      setsockopt(f, IPPROTO_TCP, TCP_KEEPIDLE, (char*)&idle, sizeof(idle));
+      setsockopt(f, IPPROTO_TCP, TCP_KEEPINTVL, (char*)&interval, sizeof(interval));
+      setsockopt(f, IPPROTO_TCP, TCP_KEEPCNT, (char*)&probes, sizeof(probes));
+    }
+#endif
+}
+
+void close_client(client& c)
+{
+  CLOSESOCK(c.socket);
+  c.socket = -1;
+}
+
+size_t missing(partial& p)
+{
+  size_t count = 0;
+  for (size_t i = 0; i < p.total; i++)
+    if (p.nodes[i].socket == -1 && !p.dropped[i])
+      count++;
+  return count;
+}
+
+void register_node(partial& p, const size_t id, const socket_t f, const uint32_t ip, const char* rack, const bool local)
+{
+  if (p.filled == 0)
+    p.last_report = p.waiting_since = time(NULL);
+  p.nodes[id].client_ip = ip;
+  p.nodes[id].socket = f;
+  p.nodes[id].id = id;
+  if (rack != p.nodes[id].rack)
+    strcpy(p.nodes[id].rack, rack);
+  p.nodes[id].local = local;
+  p.filled++;
+}
+
+/* The tree is built in two steps so that no node can hold up the others: every node is sent its
+   place in the tree, then once all have answered with the port their children should connect to,
+   every node is sent its parent's address. */
+void start_tree(const size_t nonce, partial& p)
+{
+  static size_t builds = 0;
+  size_t build = ((size_t)time(NULL) << 20) + builds++; //names the nodes' shared memory, so unique.
+
+  //nodes reducing locally first are grouped by address, and only the first of each group is in the tree.
+  map<uint32_t, size_t> first_local;
+  size_t all = p.filled;
+  size_t total = 0;
+  for (size_t i = 0; i < p.total; i++)
+    if (p.nodes[i].socket != -1)
+      {
+	client& c = p.nodes[i];
+	c.local_rank = 0;
+	c.local_size = 1;
+	if (c.local)
+	  {
+	    if (first_local.find(c.client_ip) == first_local.end())
+	      first_local[c.client_ip] = i;
+	    else
+	      c.local_rank = p.nodes[first_local[c.client_ip]].local_size++;
+	  }
+	if (c.local_rank == 0)
+	  total++;
+      }
+
+  client* nodes = (client*)calloc(total, sizeof(client));
+  size_t* rank = (size_t*)calloc(p.total, sizeof(size_t));
+  for (size_t i = 0, j = 0; i < p.total; i++)
+    if (p.nodes[i].socket != -1 && p.nodes[i].local_rank == 0)
+      {
+	rank[i] = j;
+	nodes[j++] = p.nodes[i];
+      }
+  for (size_t i = 0; i < p.total; i++)
+    if (p.nodes[i].socket != -1 && p.nodes[i].local_rank > 0)
+      {
+	size_t first = first_local[p.nodes[i].client_ip];
+	rank[i] = rank[first];
+	p.nodes[i].local_size = p.nodes[first].local_size;
+      }
+
+  qsort(nodes, total, sizeof(client), rack_sort);
+
+  int* parent = (int*)calloc(total,sizeof(int));
+  uint16_t* kid_count = (uint16_t*)calloc(total,sizeof(uint16_t));
+
+  size_t racks = 1;
+  for (size_t i = 1; i < total; i++)
+    if (strcmp(nodes[i].rack, nodes[i-1].rack) != 0)
+      racks++;
+  if (racks == 1)
+    {
+      int root = build_tree(parent, kid_count, total, 0);
+      parent[root] = -1;
     }
+  else
+    build_rack_tree(parent, kid_count, nodes, total);
+  cerr << "job " << nonce << ": building a tree over " << total << " of " << p.total << " nodes in " << racks << " racks";
+  if (total < all)
+    cerr << ", standing in for " << all << " nodes";
+  cerr << endl;
+
+  for (size_t i = 0; i < p.total; i++)
+    if (p.nodes[i].socket != -1)
+      {
+	client& c = p.nodes[i];
+	fail_send(c.socket, &all, sizeof(all));
+	fail_send(c.socket, &rank[i], sizeof(rank[i]));
+	fail_send(c.socket, &total, sizeof(total));
+	fail_send(c.socket, &c.local_rank, sizeof(c.local_rank));
+	fail_send(c.socket, &c.local_size, sizeof(c.local_size));
+	fail_send(c.socket, &build, sizeof(build));
+	c.port_read = c.local_rank == 0 ? 0 : sizeof(c.port); //the others are not in the tree.
+      }
+  for (size_t i = 0; i < total; i++)
+    {
+      size_t id = nodes[i].id;
+      fail_send(nodes[i].socket, &kid_count[i], sizeof(kid_count[i]));
+      p.parent[id] = parent[i] >= 0 ? (int)nodes[parent[i]].id : -1;
+    }
+  p.ports_left = total;
+
+  free(nodes);
+  free(rank);
+  free(parent);
+  free(kid_count);
+}
+
+void finish_tree(partial& p);
+
+void read_port(const size_t nonce, partial& p, const size_t id)
+{
+  client& c = p.nodes[id];
+  if (c.port_read == sizeof(c.port))
+    {//it has nothing more to say, so the node has gone.
+      cerr << "job " << nonce << ": node " << id << " left while its tree was built" << endl;
+      close_client(c);
+      return;
+    }
+  int read_size = recv(c.socket, (char*)&c.port + c.port_read, (int)(sizeof(c.port) - c.port_read), 0);
+  if (read_size < 0 && would_block())
+    return;
+  if (read_size <= 0)
+    {
+      cerr << "job " << nonce << ": node " << id << " left while its tree was built" << endl;
+      close_client(c);
+      c.port_read = sizeof(c.port);
+    }
+  else
+    c.port_read += read_size;
+  if (c.port_read == sizeof(c.port) && --p.ports_left == 0)
+    finish_tree(p);
+}
+
+void finish_tree(partial& p)
+{
+  for (size_t i = 0; i < p.total; i++)
+    if (p.nodes[i].port_read == sizeof(p.nodes[i].port) && !p.dropped[i])
+      {
+	if (p.nodes[i].socket != -1 && p.nodes[i].local_rank == 0)
+	  {
+	    if (p.parent[i] >= 0)
+	      {
+		client& parent = p.nodes[p.parent[i]];
+		fail_send(p.nodes[i].socket, &parent.client_ip, sizeof(parent.client_ip));
+		fail_send(p.nodes[i].socket, &parent.port, sizeof(parent.port));
+	      }
+	    else
+	      {
+		uint16_t bogus = -1; //the size the node reads, as the connection is reused for later trees.
+		uint32_t bogus2 = -1;
+		fail_send(p.nodes[i].socket, &bogus2, sizeof(bogus2));
+		fail_send(p.nodes[i].socket, &bogus, sizeof(bogus));
+	      }
+	  }
+	p.members[i] = p.nodes[i];
+	p.nodes[i].socket = -1;
+	p.nodes[i].port_read = 0;
+      }
+  p.filled = 0;
+}
+
+/* Once nodes have waited timeout seconds for the rest, old tree members that neither died nor asked
+   for a new tree are taken to be hung and forgotten, so a replacement may take their place.  Then
+   the missing nodes are waited for, dropped from the job for good, or relaunched with the given
+   command (whichever copy of a node registers first is used, later ones are refused). */
+void handle_stragglers(const size_t nonce, partial& p, const size_t timeout, const straggler_policy policy, const string& relaunch)
+{
+  time_t now = time(NULL);
+  if (timeout == 0 || p.filled == 0 || p.ports_left > 0 || (size_t)(now - p.waiting_since) < timeout)
+    return;
+
+  for (size_t i = 0; i < p.total; i++)
+    if (p.members[i].socket != -1)
+      {
+	cerr << "job " << nonce << ": node " << i << " is not responding" << endl;
+	close_client(p.members[i]);
+      }
+
+  for (size_t i = 0; i < p.total; i++)
+    if (p.nodes[i].socket == -1 && !p.dropped[i])
+      {
+	if (policy == DROP)
+	  {
+	    cerr << "job " << nonce << ": dropping node " << i << endl;
+	    p.dropped[i] = true;
+	  }
+	else if (policy == SPECULATE && !p.relaunched[i])
+	  {
+	    char command[1024];
+#ifdef _WIN32
+	    sprintf_s(command, sizeof(command), "start /b %s %lu %lu", relaunch.c_str(), (unsigned long)nonce, (unsigned long)i);
+#else
+	    snprintf(command, sizeof(command), "%s %lu %lu &", relaunch.c_str(), (unsigned long)nonce, (unsigned long)i);
+#endif
+	    cerr << "job " << nonce << ": relaunching node " << i << ": " << command << endl;
+	    if (system(command) != 0)
+	      cerr << "relaunch failed" << endl;
+	    p.relaunched[i] = true;
+	  }
+      }
+
+  if (missing(p) > 0 && (size_t)(now - p.last_report) >= timeout)
+    {
+      cerr << "job " << nonce << ": still waiting for " << missing(p) << " of " << p.total << " nodes" << endl;
+      p.last_report = now;
+    }
+}
+
+/* Reads what has arrived of a handshake.  Once it is all there the node is registered for its job's
+   next tree, or refused, and true is returned. */
+bool read_handshake(handshake& h, map<size_t, partial>& partial_nodesets)
+{
+  const size_t header = 3*sizeof(size_t)+sizeof(uint16_t);
+  uint16_t rack_length = 0;
+  size_t wanted = header;
+  if (h.got >= header)
+    {
+      memcpy(&rack_length, h.buf + 3*sizeof(size_t), sizeof(rack_length));
+      wanted = header + rack_length + 1;
+    }
+
+  int read_size = recv(h.socket, h.buf + h.got, (int)(wanted - h.got), 0);
+  if (read_size < 0 && would_block())
+    return false;
+  if (read_size <= 0)
+    {
+      cerr << "node handshake read failed" << endl;
+      CLOSESOCK(h.socket);
+      return true;
+    }
+  h.got += read_size;
+  if (h.got == header)
+    {
+      memcpy(&rack_length, h.buf + 3*sizeof(size_t), sizeof(rack_length));
+      if (rack_length > max_rack)
+	{
+	  cerr << "rack label too long" << endl;
+	  CLOSESOCK(h.socket);
+	  return true;
+	}
+      wanted = header + rack_length + 1;
+    }
+  if (h.got < wanted)
+    return false;
+
+  size_t nonce, total, id;
+  memcpy(&nonce, h.buf, sizeof(nonce));
+  memcpy(&total, h.buf + sizeof(size_t), sizeof(total));
+  memcpy(&id, h.buf + 2*sizeof(size_t), sizeof(id));
+  char rack[max_rack+1];
+  memcpy(rack, h.buf + header, rack_length);
+  rack[rack_length] = '\0';
+  bool local = h.buf[header + rack_length] != 0;
+
+  int ok = true;
+  if ( id >= total )
+    {
+      cout << "invalid id! " << endl;
+      ok = false;
+    }
+
+  if (ok && partial_nodesets.find(nonce) == partial_nodesets.end() )
+    {
+      partial& p = partial_nodesets[nonce];
+      p.total = total;
+      p.nodes = (client*) calloc(total, sizeof(client));
+      p.members = (client*) calloc(total, sizeof(client));
+      for (size_t i = 0; i < total; i++)
+	p.nodes[i].socket = p.members[i].socket = -1;
+      p.dropped = (bool*) calloc(total, sizeof(bool));
+      p.relaunched = (bool*) calloc(total, sizeof(bool));
+      p.parent = (int*) calloc(total, sizeof(int));
+      p.filled = 0;
+      p.ports_left = 0;
+    }
+
+  //a node already waiting or in the tree makes this a duplicate, e.g. a late speculative copy.
+  if (ok)
+    {
+      partial& p = partial_nodesets[nonce];
+      if (total != p.total || p.dropped[id] || p.nodes[id].socket != -1 || p.members[id].socket != -1)
+	ok = false;
+    }
+  fail_send(h.socket,&ok, sizeof(ok));
+
+  if (ok)
+    register_node(partial_nodesets[nonce], id, h.socket, h.client_ip, rack, local);
+  else
+    CLOSESOCK(h.socket);
+  return true;
+}
+
+//what a polled socket is.
+struct watched {
+  enum { LISTENER, HANDSHAKE, WAITING, MEMBER } kind;
+  size_t nonce;
+  size_t index;
+};
+
+void watch(vector<pollfd>& fds, vector<watched>& what, const socket_t sock, const watched& w)
+{
+  pollfd fd;
+  fd.fd = sock;
+  fd.events = POLLIN;
+  fd.revents = 0;
+  fds.push_back(fd);
+  what.push_back(w);
+}
+
+void usage()
+{
+  cout << "usage: spanning_tree [--nondaemon] [--timeout <seconds>] [--stragglers wait|drop|speculate] [--relaunch <command>] [pid_file]" << endl;
+  exit(0);
 }
 
 int main(int argc, char* argv[]) {
-  if (argc > 2)
+  bool nondaemon = false;
+  const char* pid_file_name = NULL;
+  size_t timeout = 0;
+  straggler_policy policy = WAIT;
+  string relaunch;
+  for (int i = 1; i < argc; i++)
+    {
+      if (strcmp("--nondaemon",argv[i])==0)
+	nondaemon = true;
+      else if (strcmp("--timeout",argv[i])==0 && i+1 < argc)
+	timeout = atoi(argv[++i]);
+      else if (strcmp("--stragglers",argv[i])==0 && i+1 < argc)
+	{
+	  i++;
+	  if (strcmp("wait",argv[i])==0)
+	    policy = WAIT;
+	  else if (strcmp("drop",argv[i])==0)
+	    policy = DROP;
+	  else if (strcmp("speculate",argv[i])==0)
+	    policy = SPECULATE;
+	  else
+	    usage();
+	}
+      else if (strcmp("--relaunch",argv[i])==0 && i+1 < argc)
+	relaunch = argv[++i];
+      else if (argv[i][0] != '-' && pid_file_name == NULL)
+	pid_file_name = argv[i];
+      else
+	usage();
+    }
+  if (policy != WAIT && timeout == 0)
     {
-      cout << "usage: spanning_tree [--nondaemon | pid_file]" << endl;
-      exit(0);
+      cerr << "--stragglers drop and speculate need a --timeout" << endl;
+      exit(1);
+    }
+  if ((policy == SPECULATE) != (relaunch != ""))
+    {
+      cerr << "--stragglers speculate needs a --relaunch command, and only it" << endl;
+      exit(1);
     }
 
 #ifdef _WIN32
   WSAData wsaData;
   WSAStartup(MAKEWORD(2,2), &wsaData);
   int lastError = WSAGetLastError();
+#else
+  signal(SIGPIPE, SIG_IGN); //nodes may die at any time
 #endif
 
   socket_t sock = socket(PF_INET, SOCK_STREAM, 0);
@@ -153,19 +638,17 @@ int main(int argc, char* argv[]) {
       exit(1);
     }
 
-  if (argc == 2 && strcmp("--nondaemon",argv[1])==0)
-    ;
-  else
+  if (!nondaemon)
     if (daemon(1,1))
       {
 	cerr << "failure to background!" << endl;
 	exit(1);
       }
 
-  if (argc == 2 && strcmp("--nondaemon",argv[1])!=0)
+  if (pid_file_name != NULL)
     {
       ofstream pid_file;
-      pid_file.open(argv[1]);
+      pid_file.open(pid_file_name);
       if (!pid_file.is_open())
 	{
 	  cerr << "error writing pid file" << endl;
@@ -175,121 +658,147 @@ int main(int argc, char* argv[]) {
       pid_file.close();
     }
 
+  /* Everything is non-blocking and driven by one poll over all sockets, so a slow or dead node
+     holds up nobody else: not other nodes' handshakes, other jobs, nor its own job's tree beyond
+     the wait for it. */
   map<size_t, partial> partial_nodesets;
+  vector<handshake> handshakes;
+  listen(sock, 1024);
+  set_nonblocking(sock);
+  vector<pollfd> fds;
+  vector<watched> what;
   while(true) {
-    listen(sock, 1024);
-
-    sockaddr_in client_address;
-    socklen_t size = sizeof(client_address);
-    socket_t f = accept(sock,(sockaddr*)&client_address,&size);
-
-    {
-        char hostname[NI_MAXHOST];
-        char servInfo[NI_MAXSERV];
-        getnameinfo((sockaddr *) &client_address, sizeof(sockaddr), hostname, NI_MAXHOST, servInfo, NI_MAXSERV, 0);
-
-        cerr << "inbound connection from " << hostname << endl;
-    }
-
-    if (f < 0)
+    fds.clear();
+    what.clear();
+    watched w;
+    w.kind = watched::LISTENER;
+    watch(fds, what, sock, w);
+    for (size_t i = 0; i < handshakes.size(); i++)
       {
-	cerr << "bad client socket!" << endl;
-	exit (1);
+	w.kind = watched::HANDSHAKE;
+	w.index = i;
+	watch(fds, what, handshakes[i].socket, w);
       }
+    for (map<size_t, partial>::iterator it = partial_nodesets.begin(); it != partial_nodesets.end(); it++)
+      for (size_t i = 0; i < it->second.total; i++)
+	{
+	  w.nonce = it->first;
+	  w.index = i;
+	  w.kind = watched::WAITING;
+	  if (it->second.nodes[i].socket != -1)
+	    watch(fds, what, it->second.nodes[i].socket, w);
+	  w.kind = watched::MEMBER;
+	  if (it->second.members[i].socket != -1)
+	    watch(fds, what, it->second.members[i].socket, w);
+	}
 
-    size_t nonce = 0;
-    if (recv(f, (char*)&nonce, sizeof(nonce), 0) != sizeof(nonce))
-      {
-	cerr << "nonce read failed, exiting" << endl;
-	exit(1);
-      }
-    size_t total = 0;
-    if (recv(f, (char*)&total, sizeof(total), 0) != sizeof(total))
-      {
-	cerr << "total node count read failed, exiting" << endl;
-	exit(1);
-      }
-    size_t id = 0;
-    if (recv(f, (char*)&id, sizeof(id), 0) != sizeof(id))
+    if (poll(&fds[0], (unsigned long)fds.size(), timeout > 0 ? 1000 : -1) == -1) //ticks to notice stragglers
       {
-	cerr << "node id read failed, exiting" << endl;
+	if (errno == EINTR)
+	  continue;
+	cerr << "poll failed!" << endl;
 	exit(1);
       }
 
-    int ok = true;
-    if ( id >= total )
-      {
-	cout << "invalid id! " << endl;
-	ok = false;
-      }
-    partial partial_nodeset;
-
-    if (partial_nodesets.find(nonce) == partial_nodesets.end() )
-      {
-	partial_nodeset.nodes = (client*) calloc(total, sizeof(client));
-	for (size_t i = 0; i < total; i++)
-	  partial_nodeset.nodes[i].client_ip = (uint32_t)-1;
-	partial_nodeset.filled = 0;
-      }
-    else {
-      partial_nodeset = partial_nodesets[nonce];
-      partial_nodesets.erase(nonce);
-    }
-
-    if (ok && partial_nodeset.nodes[id].client_ip != (uint32_t)-1)
-      ok = false;
-    fail_send(f,&ok, sizeof(ok));
-
-    if (ok)
+    for (size_t k = 0; k < fds.size(); k++)
       {
-	partial_nodeset.nodes[id].client_ip = client_address.sin_addr.s_addr;
-	partial_nodeset.nodes[id].socket = f;
-	partial_nodeset.filled++;
-      }
-    if (partial_nodeset.filled != total) //Need to wait for more connections
-      {
-	partial_nodesets[nonce] = partial_nodeset;
-      }
-    else
-      {//Time to make the spanning tree
-	qsort(partial_nodeset.nodes, total, sizeof(client), socket_sort);
-
-	int* parent = (int*)calloc(total,sizeof(int));
-	uint16_t* kid_count = (uint16_t*)calloc(total,sizeof(uint16_t));
-
-	int root = build_tree(parent, kid_count, total, 0);
-	parent[root] = -1;
-
-	for (size_t i = 0; i < total; i++)
+	if (fds[k].revents == 0)
+	  continue;
+	if (what[k].kind == watched::LISTENER)
 	  {
-	    fail_send(partial_nodeset.nodes[i].socket, &kid_count[i], sizeof(kid_count[i]));
+	    sockaddr_in client_address;
+	    socklen_t size = sizeof(client_address);
+	    socket_t f;
+	    while ((f = accept(sock,(sockaddr*)&client_address,&size)) != (socket_t)-1)
+	      {
+		{
+		  char hostname[NI_MAXHOST];
+		  char servInfo[NI_MAXSERV];
+		  getnameinfo((sockaddr *) &client_address, sizeof(sockaddr), hostname, NI_MAXHOST, servInfo, NI_MAXSERV, 0);
+
+		  cerr << "inbound connection from " << hostname << endl;
+		}
+		set_nonblocking(f);
+		keep_alive(f, timeout);
+		handshake h;
+		h.socket = f;
+		h.client_ip = client_address.sin_addr.s_addr;
+		h.got = 0;
+		handshakes.push_back(h);
+		size = sizeof(client_address);
+	      }
+	    if (!would_block())//e.g. a connection reset before it was accepted, or out of descriptors
+	      perror("accept");
+	    continue;
+	  }
+	if (what[k].kind == watched::HANDSHAKE)
+	  {
+	    if (read_handshake(handshakes[what[k].index], partial_nodesets))
+	      handshakes[what[k].index].socket = -1;
+	    continue;
 	  }
 
-	uint16_t* client_ports=(uint16_t*)calloc(total,sizeof(uint16_t));
-
-	for(size_t i = 0;i < total;i++) {
-	  int done = 0;
-	  if(recv(partial_nodeset.nodes[i].socket, (char*)&(client_ports[i]), sizeof(client_ports[i]), 0) < (int) sizeof(client_ports[i]))
-	    cerr<<" Port read failed for node "<<i<<" read "<<done<<endl;
-	}// all clients have bound to their ports.
-
-	for (size_t i = 0; i < total; i++)
+	partial& p = partial_nodesets[what[k].nonce];
+	size_t i = what[k].index;
+	if (what[k].kind == watched::MEMBER && p.members[i].socket == fds[k].fd)
 	  {
-	    if (parent[i] >= 0)
+	    char rebuild;
+	    int read_size = recv(p.members[i].socket, &rebuild, 1, 0);
+	    if (read_size < 0 && would_block())
+	      continue;
+	    if (read_size == 1 && p.nodes[i].socket == -1)
 	      {
-		fail_send(partial_nodeset.nodes[i].socket, &partial_nodeset.nodes[parent[i]].client_ip, sizeof(partial_nodeset.nodes[parent[i]].client_ip));
-		fail_send(partial_nodeset.nodes[i].socket, &client_ports[parent[i]], sizeof(client_ports[parent[i]]));
-              }
+		cerr << "job " << what[k].nonce << ": node " << i << " asks for a new tree" << endl;
+		register_node(p, i, p.members[i].socket, p.members[i].client_ip, p.members[i].rack, p.members[i].local);
+		p.members[i].socket = -1;
+	      }
 	    else
 	      {
-		int bogus = -1;
-		uint32_t bogus2 = -1;
-		fail_send(partial_nodeset.nodes[i].socket, &bogus2, sizeof(bogus2));
-		fail_send(partial_nodeset.nodes[i].socket, &bogus, sizeof(bogus));
+		cerr << "job " << what[k].nonce << ": node " << i << " left" << endl;
+		close_client(p.members[i]);
+	      }
+	  }
+	else if (what[k].kind == watched::WAITING && p.nodes[i].socket == fds[k].fd)
+	  {
+	    if (p.ports_left > 0)
+	      read_port(what[k].nonce, p, i);
+	    else
+	      {//nothing is sent while waiting for a tree, so the node has gone.
+		cerr << "job " << what[k].nonce << ": node " << i << " left before its tree was built" << endl;
+		close_client(p.nodes[i]);
+		p.filled--;
 	      }
-	    CLOSESOCK(partial_nodeset.nodes[i].socket);
 	  }
-	free (partial_nodeset.nodes);
+      }
+
+    size_t pending = 0;
+    for (size_t i = 0; i < handshakes.size(); i++)
+      if (handshakes[i].socket != -1)
+	handshakes[pending++] = handshakes[i];
+    handshakes.resize(pending);
+
+    map<size_t, partial>::iterator it = partial_nodesets.begin();
+    while (it != partial_nodesets.end())
+      {
+	partial& p = it->second;
+	handle_stragglers(it->first, p, timeout, policy, relaunch);
+	if (p.ports_left == 0 && p.filled > 0 && missing(p) == 0)
+	  start_tree(it->first, p);
+	bool alive = p.ports_left > 0;
+	for (size_t i = 0; i < p.total; i++)
+	  alive = alive || p.members[i].socket != -1 || p.nodes[i].socket != -1;
+
+	if (!alive)
+	  {
+	    free(p.nodes);
+	    free(p.members);
+	    free(p.dropped);
+	    free(p.relaunched);
+	    free(p.parent);
+	    partial_nodesets.erase(it++);
+	  }
+	else
+	  it++;
       }
   }
 
@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <math.h>
+#include <exception>
+#include "../vowpalwabbit/vwdll.h"
+#include "../vowpalwabbit/parser.h"
+#include "../vowpalwabbit/vw.h"
+
+// Scores examples through VW_AllocBatch/VW_PredictBatch/VW_FreeBatch and checks the predictions
+// against scoring the same examples one at a time.
+
+feature make_feature(VW_HANDLE model, const char* name, size_t space, float x)
+{
+  feature f = { x, (uint32_t)VW_HashFeatureA(model, name, (unsigned long)space) };
+  return f;
+}
+
+int main(int argc, char *argv[])
+{
+  VW_HANDLE model = VW_InitializeA("--quiet --noconstant -q st");
+  const char* train[] = { "1 |s the man |t le homme", "-1 |s the dog |t un chien", "1 |s a man |t un homme" };
+  for (size_t i = 0; i < 3; i++)
+    {
+      VW_EXAMPLE ec = VW_ReadExampleA(model, train[i]);
+      VW_Learn(model, ec);
+      VW_FinishExample(model, ec);
+    }
+
+  size_t s = VW_HashSpaceA(model, "s"), t = VW_HashSpaceA(model, "t");
+  feature s_features[] = { make_feature(model, "the", s, 1.), make_feature(model, "man", s, 1.) };
+  feature t_features[] = { make_feature(model, "un", t, 1.), make_feature(model, "chien", t, 1.) };
+  //the second example names s twice, which must score as one namespace holding both features.
+  VW::primitive_feature_space first[] = { { 's', s_features, 2 }, { 't', t_features, 2 } };
+  VW::primitive_feature_space second[] = { { 's', s_features, 1 }, { 't', t_features, 2 }, { 's', s_features + 1, 1 } };
+  VW_FEATURE_SPACE features[] = { first, second };
+  size_t lens[] = { 2, 3 };
+  float predictions[2];
+
+  VW_BATCH batch = VW_AllocBatch(model, 2);
+  for (int call = 0; call < 2; call++) //the second call reuses the batch's storage.
+    VW_PredictBatch(model, batch, features, lens, 2, predictions);
+  VW_FreeBatch(model, batch, 2);
+
+  VW_EXAMPLE ec = VW_ReadExampleA(model, "|s the man |t un chien");
+  float expected = VW_Learn(model, ec); //unlabeled, so only predicted.
+  VW_FinishExample(model, ec);
+  VW_Finish(model);
+
+  int status = 0;
+  for (int k = 0; k < 2; k++)
+    {
+      printf("batch prediction %d = %f, one at a time = %f\n", k, predictions[k], expected);
+      if (fabs(predictions[k] - expected) > 1e-6)
+	status = 1;
+    }
+
+  VW_HANDLE multiclass = VW_InitializeA("--quiet --oaa 3");
+  try
+    {
+      VW_AllocBatch(multiclass, 1);
+      printf("a batch for a multiclass learner was allowed!\n");
+      status = 1;
+    }
+  catch (std::exception&)
+    {
+      printf("a batch for a multiclass learner was refused\n");
+    }
+  VW_Finish(multiclass);
+  return status;
+}
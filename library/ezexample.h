@@ -87,8 +87,8 @@ class ezexample {
   void addns(char c) {
     if (ensure_ns_exists(c)) return;
 
-    ec->atomics[(int)c].erase();
-    ec->sum_feat_sq[(int)c] = 0;
+    ec->atomics((int)c).erase();
+    ec->sum_feat_sq((int)c) = 0;
     past_seeds.push_back(current_seed);
     current_ns = c;
     str[0] = c;
@@ -101,10 +101,10 @@ class ezexample {
       current_ns = 0;
     } else {
       if (ns_exists[(int)current_ns]) {
-        ec->total_sum_feat_sq -= ec->sum_feat_sq[(int)current_ns];
-        ec->sum_feat_sq[(int)current_ns] = 0;
-        ec->num_features -= ec->atomics[(int)current_ns].size();
-        ec->atomics[(int)current_ns].erase();
+        ec->total_sum_feat_sq -= ec->sum_feat_sq((int)current_ns);
+        ec->sum_feat_sq((int)current_ns) = 0;
+        ec->num_features -= ec->atomics((int)current_ns).size();
+        ec->atomics((int)current_ns).erase();
 
         ns_exists[(int)current_ns] = false;
       }
@@ -122,8 +122,8 @@ class ezexample {
     if (ensure_ns_exists(to_ns)) return 0;
 
     feature f = { v, fint << vw_ref->reg.stride_shift };
-    ec->atomics[(int)to_ns].push_back(f);
-    ec->sum_feat_sq[(int)to_ns] += v * v;
+    ec->atomics((int)to_ns).push_back(f);
+    ec->sum_feat_sq((int)to_ns) += v * v;
     ec->total_sum_feat_sq += v * v;
     ec->num_features++;
     example_changed_since_prediction = true;
@@ -151,11 +151,11 @@ class ezexample {
 
     for (vector<string>::iterator i = vw_ref->pairs.begin(); i != vw_ref->pairs.end(); i++) {
       quadratic_features_num
-        += (ec->atomics[(int)(*i)[0]].end - ec->atomics[(int)(*i)[0]].begin)
-        *  (ec->atomics[(int)(*i)[1]].end - ec->atomics[(int)(*i)[1]].begin);
+        += (ec->atomics((int)(*i)[0]).end - ec->atomics((int)(*i)[0]).begin)
+        *  (ec->atomics((int)(*i)[1]).end - ec->atomics((int)(*i)[1]).begin);
       quadratic_features_sqr
-        += ec->sum_feat_sq[(int)(*i)[0]]
-        *  ec->sum_feat_sq[(int)(*i)[1]];
+        += ec->sum_feat_sq((int)(*i)[0])
+        *  ec->sum_feat_sq((int)(*i)[1]);
     }
     ec->num_features      += quadratic_features_num;
     ec->total_sum_feat_sq += quadratic_features_sqr;
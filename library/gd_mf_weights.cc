@@ -112,7 +112,7 @@ int main(int argc, char *argv[])
     }
 
   // write constant
-  feature* f = ec->atomics[constant_namespace].begin;
+  feature* f = ec->atomics(constant_namespace).begin;
   constant << weights[f->weight_index & mask] << endl;
 
   // clean up
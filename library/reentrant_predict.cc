@@ -0,0 +1,47 @@
+#include <stdio.h>
+#include <math.h>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include "../vowpalwabbit/parser.h"
+#include "../vowpalwabbit/vw.h"
+
+using namespace std;
+
+// Scores every line of a data file with VW::predict and compares the results with the predictions
+// 'vw -t -p' wrote for the same model and data.
+// Usage: reentrant_predict <model> <data> <predictions>
+
+int main(int argc, char *argv[])
+{
+  if (argc != 4)
+    {
+      cerr << "usage: " << argv[0] << " <model> <data> <predictions>" << endl;
+      return 2;
+    }
+  vw* model = VW::initialize(string("--quiet -t -i ") + argv[1]);
+  ifstream data(argv[2]), predictions(argv[3]);
+  string line;
+  size_t lines = 0, differ = 0;
+  float expected;
+  try
+    {
+      while (getline(data, line) && predictions >> expected)
+	{
+	  example* ec = VW::read_example(*model, (char*)line.c_str());
+	  float value = VW::predict(*model, *ec).value;
+	  if (fabs(value - expected) > 1e-5)
+	    differ++;
+	  lines++;
+	  VW::finish_example(*model, ec);
+	}
+    }
+  catch (exception&)
+    {
+      VW::finish(*model);
+      return 1;
+    }
+  VW::finish(*model);
+  cout << lines << " predictions, " << differ << " different from vw -t -p" << endl;
+  return lines > 0 && differ == 0 ? 0 : 1;
+}
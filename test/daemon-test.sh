@@ -0,0 +1,41 @@
+#!/bin/sh
+# Checks that a --daemon answers --sendto clients, over tcp and over the
+# --shm_socket channel, with the same predictions as a local -t run.
+# Usage: daemon-test.sh [vw]
+vw=${1:-../vowpalwabbit/vw}
+data=train-sets/0001.dat
+dir=daemon-test.tmp
+rm -rf $dir
+mkdir $dir
+$vw -d $data -f $dir/model --quiet
+$vw -i $dir/model -t -d $data -p $dir/local.predict --quiet
+$vw -i $dir/model -t --daemon --port 0 --port_file $dir/port --num_children 1 --pid_file $dir/pid --shm_socket $dir/shm --quiet
+tries=0
+while [ ! -s $dir/port -o ! -S $dir/shm ] && [ $tries -lt 50 ]
+do
+    sleep 0.1
+    tries=$((tries+1))
+done
+port=`cat $dir/port`
+$vw --sendto localhost:$port -d $data -p $dir/tcp.predict --quiet
+$vw --sendto localhost:$port --shm_socket $dir/shm -d $data -p $dir/shm.predict 2> $dir/shm.stderr
+kill `cat $dir/pid`
+status=0
+if grep -q "tcp\|falling back" $dir/shm.stderr
+then
+    echo "the shm client didn't get a shared memory channel:"
+    cat $dir/shm.stderr
+    status=1
+fi
+for transport in tcp shm
+do
+    if cmp -s $dir/local.predict $dir/$transport.predict
+    then
+	echo "$transport predictions match"
+    else
+	echo "$transport predictions differ from local ones!"
+	status=1
+    fi
+done
+rm -rf $dir
+exit $status
@@ -9,14 +9,37 @@ Alekh Agarwal and John Langford, with help Olivier Chapelle.
 */
 
 #include <iostream>
-#include <sys/timeb.h>
+#ifndef _WIN32
+#include <sys/time.h>
+#endif
 #include <cmath>
 #include <stdint.h>
+#include <string.h>
 #include "accumulate.h"
 #include "global_data.h"
+#include "memory.h"
    
 using namespace std;
 
+double milliseconds()
+{
+#ifdef _WIN32
+  return (double)GetTickCount64();
+#else
+  timeval t;
+  gettimeofday(&t, NULL);
+  return 1000. * t.tv_sec + t.tv_usec / 1000.;
+#endif
+}
+
+void print_sync_stats(vw& all, size_t k, size_t bytes, double start)
+{
+  if (!all.allreduce_stats)
+    return;
+  cerr << "averaged " << k << " of " << (1 << all.num_bits) << " weights, sent " << bytes << " bytes in "
+       << (int)(milliseconds() - start) << " ms" << endl;
+}
+
 void accumulate(vw& all, string master_location, regressor& reg, size_t o) {
   uint32_t length = 1 << all.num_bits; //This is size of gradient
   size_t stride = 1 << all.reg.stride_shift;
@@ -42,19 +65,21 @@ float accumulate_scalar(vw& all, string master_location, float local_sum) {
 }
 
 void accumulate_avg(vw& all, string master_location, regressor& reg, size_t o) {
+  double start = milliseconds();
   uint32_t length = 1 << all.num_bits; //This is size of gradient
   size_t stride = 1 << all.reg.stride_shift;
   float* local_grad = new float[length];
   weight* weights = reg.weight_vector;
-  float numnodes = (float)all.total;
 
   for(uint32_t i = 0;i < length;i++) 
       local_grad[i] = weights[stride*i+o];
 
   all_reduce<float>(local_grad, length, master_location, all.unique_id, all.total, all.node, all.socks);
+  float numnodes = (float)all.socks.total; //less than all.total if the span server dropped stragglers
   for(uint32_t i = 0;i < length;i++) 
       weights[stride*i+o] = local_grad[i]/numnodes;
   delete[] local_grad;
+  print_sync_stats(all, length, length*sizeof(float), start);
 }
 
 float max_elem(float* arr, int length) {
@@ -76,6 +101,7 @@ void accumulate_weighted_avg(vw& all, string master_location, regressor& reg) {
     cerr<<"Weighted averaging is implemented only for adaptive gradient, use accumulate_avg instead\n";
     return;
   }
+  double start = milliseconds();
   uint32_t length = 1 << all.num_bits; //This is the number of parameters
   size_t stride = 1 << all.reg.stride_shift;
   weight* weights = reg.weight_vector;
@@ -104,8 +130,12 @@ void accumulate_weighted_avg(vw& all, string master_location, regressor& reg) {
       weights[stride*i] = 0;
     }
 
+  size_t reduced = length;
   if(!all.feature_mask_idx) //do in place all_reduce when the feature mask is absent
-    all_reduce<float>(weights, length*stride, master_location, all.unique_id, all.total, all.node, all.socks);
+    {
+      all_reduce<float>(weights, length*stride, master_location, all.unique_id, all.total, all.node, all.socks);
+      reduced += length*stride;
+    }
   
   else {
 
@@ -137,9 +167,333 @@ void accumulate_weighted_avg(vw& all, string master_location, regressor& reg) {
 	for(uint32_t i = 0;i < length;i++) 
 	  weights[stride*i+all.normalized_idx] = local_weights[i];
       }
+    reduced += (all.normalized_updates ? 3 : 2) * length;
   }
 
 
   delete[] local_weights;
+  print_sync_stats(all, length, reduced*sizeof(float), start);
+}
+
+
+//allreduce adds with +=, so these make it OR bitmaps and sum half floats.
+struct bit_word {
+  uint32_t bits;
+  void operator+=(const bit_word& other) { bits |= other.bits; }
+};
+
+uint16_t float_to_half(float f)
+{
+  uint32_t x;
+  memcpy(&x, &f, sizeof(x));
+  uint16_t sign = (x >> 16) & 0x8000;
+  int exponent = (int)((x >> 23) & 0xff) - 127 + 15;
+  uint32_t mantissa = x & 0x7fffff;
+
+  if (exponent >= 31) //saturate rather than overflow to infinity.
+    return sign | 0x7bff;
+  if (exponent <= 0)
+    {
+      if (exponent < -10)
+	return sign;
+      mantissa |= 0x800000;
+      uint32_t shift = 14 - exponent;
+      uint32_t h = mantissa >> shift;
+      uint32_t rest = mantissa & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+      if (rest > halfway || (rest == halfway && (h & 1)))
+	h++;
+      return sign | (uint16_t)h;
+    }
+  uint32_t h = (exponent << 10) | (mantissa >> 13);
+  uint32_t rest = mantissa & 0x1fff;
+  if (rest > 0x1000 || (rest == 0x1000 && (h & 1)))
+    h++;
+  if (h >= 0x7c00)
+    h = 0x7bff;
+  return sign | (uint16_t)h;
+}
+
+float half_to_float(uint16_t h)
+{
+  uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+  uint32_t exponent = (h >> 10) & 0x1f;
+  uint32_t mantissa = h & 0x3ff;
+  uint32_t x;
+  if (exponent == 0)
+    {
+      if (mantissa == 0)
+	x = sign;
+      else
+	{
+	  exponent = 127 - 15 + 1;
+	  while (!(mantissa & 0x400))
+	    {
+	      mantissa <<= 1;
+	      exponent--;
+	    }
+	  x = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+	}
+    }
+  else if (exponent == 31)
+    x = sign | 0x7f800000 | (mantissa << 13);
+  else
+    x = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+  float f;
+  memcpy(&f, &x, sizeof(f));
+  return f;
+}
+
+struct half {
+  uint16_t bits;
+  void operator+=(const half& other) { bits = float_to_half(half_to_float(bits) + half_to_float(other.bits)); }
+};
+
+void sparse_sync_init(vw& all)
+{
+  sparse_sync& s = *all.sparse;
+  uint32_t length = 1 << all.num_bits;
+  if (s.touched == NULL)
+    {
+      s.touched = (uint32_t*)calloc_or_die((length + 31) / 32, sizeof(uint32_t));
+      if (s.fp16)
+	{
+	  s.synced = (float*)calloc_or_die(length, sizeof(float));
+	  s.residual = (float*)calloc_or_die(length, sizeof(float));
+	}
+    }
+  s.weights = all.reg.weight_vector;
+  s.stride_shift = all.reg.stride_shift;
+  //every node starts from the same model, so this is the common value changes are measured from.
+  if (s.fp16)
+    for (uint32_t i = 0; i < length; i++)
+      s.synced[i] = s.weights[i << s.stride_shift];
+}
+
+void sparse_sync_free(vw& all)
+{
+  free(all.sparse->touched);
+  free(all.sparse->synced);
+  free(all.sparse->residual);
+  free(all.sparse);
+  all.sparse = NULL;
+}
+
+//OR the touched bitmaps of all nodes and list the weights any node touched.
+v_array<uint32_t> union_touched(vw& all, string master_location, size_t& bytes)
+{
+  uint32_t length = 1 << all.num_bits;
+  size_t words = (length + 31) / 32;
+  bit_word* bitmap = (bit_word*)all.sparse->touched;
+  all_reduce<bit_word>(bitmap, words, master_location, all.unique_id, all.total, all.node, all.socks);
+  bytes += words * sizeof(bit_word);
+
+  v_array<uint32_t> indices;
+  for (size_t w = 0; w < words; w++)
+    for (uint32_t bits = bitmap[w].bits; bits != 0; bits &= bits - 1)
+      {
+	uint32_t b = 0;
+	while (!(bits & (1u << b)))
+	  b++;
+	indices.push_back((uint32_t)(w * 32 + b));
+      }
+  memset(bitmap, 0, words * sizeof(bit_word));
+  return indices;
 }
 
+/* With fp16 each node sends (its change since the last average)*contribution plus the error left
+   over from rounding last time, and keeps this round's error for the next. */
+void average_changes(vw& all, string master_location, v_array<uint32_t>& indices, float* contribution, size_t& bytes)
+{
+  sparse_sync& s = *all.sparse;
+  size_t stride = 1 << all.reg.stride_shift;
+  weight* weights = all.reg.weight_vector;
+  size_t k = indices.size();
+
+  half* changes = new half[k];
+  for (size_t j = 0; j < k; j++)
+    {
+      uint32_t i = indices[j];
+      float change = (weights[stride*i] - s.synced[i]) * contribution[j] + s.residual[i];
+      changes[j].bits = float_to_half(change);
+      s.residual[i] = change - half_to_float(changes[j].bits);
+    }
+  all_reduce<half>(changes, k, master_location, all.unique_id, all.total, all.node, all.socks);
+  bytes += k * sizeof(half);
+
+  for (size_t j = 0; j < k; j++)
+    {
+      uint32_t i = indices[j];
+      weights[stride*i] = s.synced[i] + half_to_float(changes[j].bits);
+      s.synced[i] = weights[stride*i];
+    }
+  delete[] changes;
+}
+
+void accumulate_sparse_avg(vw& all, string master_location, regressor& reg)
+{
+  double start = milliseconds();
+  size_t bytes = 0;
+  size_t stride = 1 << all.reg.stride_shift;
+  weight* weights = reg.weight_vector;
+
+  //weights nobody touched are still equal on every node, so their average is unchanged.
+  v_array<uint32_t> indices = union_touched(all, master_location, bytes);
+  float numnodes = (float)all.socks.total;
+  size_t k = indices.size();
+
+  if (all.sparse->fp16)
+    {
+      float* contribution = new float[k];
+      for (size_t j = 0; j < k; j++)
+	contribution[j] = 1.f / numnodes;
+      average_changes(all, master_location, indices, contribution, bytes);
+      delete[] contribution;
+    }
+  else
+    {
+      float* local_grad = new float[k];
+      for (size_t j = 0; j < k; j++)
+	local_grad[j] = weights[stride*indices[j]];
+      all_reduce<float>(local_grad, k, master_location, all.unique_id, all.total, all.node, all.socks);
+      bytes += k * sizeof(float);
+      for (size_t j = 0; j < k; j++)
+	weights[stride*indices[j]] = local_grad[j] / numnodes;
+      delete[] local_grad;
+    }
+
+  print_sync_stats(all, k, bytes, start);
+  indices.delete_v();
+}
+
+void accumulate_sparse_weighted_avg(vw& all, string master_location, regressor& reg)
+{
+  if(!all.adaptive) {
+    cerr<<"Weighted averaging is implemented only for adaptive gradient, use accumulate_avg instead\n";
+    return;
+  }
+  double start = milliseconds();
+  size_t bytes = 0;
+  size_t stride = 1 << all.reg.stride_shift;
+  weight* weights = reg.weight_vector;
+  bool fp16 = all.sparse->fp16;
+
+  v_array<uint32_t> indices = union_touched(all, master_location, bytes);
+  size_t k = indices.size();
+
+  //same as accumulate_weighted_avg restricted to the touched weights: weigh each node by its share of the adaptive sum.
+  float* ratios = new float[k];
+  for (size_t j = 0; j < k; j++)
+    ratios[j] = weights[stride*indices[j]+1];
+  all_reduce<float>(ratios, k, master_location, all.unique_id, all.total, all.node, all.socks);
+  bytes += k * sizeof(float);
+  for (size_t j = 0; j < k; j++)
+    ratios[j] = ratios[j] > 0 ? weights[stride*indices[j]+1] / ratios[j] : 0.f;
+
+  //weight (unless sent as a half float change), adaptive sum and normalizer, each scaled by the ratio.
+  size_t fields = (fp16 ? 0 : 1) + 1 + (all.normalized_updates ? 1 : 0);
+  float* local_weights = new float[k*fields];
+  for (size_t j = 0; j < k; j++)
+    {
+      float* w = &weights[stride*indices[j]];
+      float* out = local_weights + j*fields;
+      if (!fp16)
+	*out++ = w[0] * ratios[j];
+      *out++ = w[1] * ratios[j];
+      if (all.normalized_updates)
+	*out++ = w[all.normalized_idx] * ratios[j];
+    }
+  all_reduce<float>(local_weights, k*fields, master_location, all.unique_id, all.total, all.node, all.socks);
+  bytes += k * fields * sizeof(float);
+
+  if (fp16)
+    average_changes(all, master_location, indices, ratios, bytes);
+  for (size_t j = 0; j < k; j++)
+    {
+      float* w = &weights[stride*indices[j]];
+      float* in = local_weights + j*fields;
+      if (!fp16)
+	w[0] = *in++;
+      else if (ratios[j] == 0.f) //as in the dense average, a weight without adaptive sum is reset.
+	{
+	  w[0] = 0.f;
+	  all.sparse->synced[indices[j]] = 0.f;
+	}
+      w[1] = *in++;
+      if (all.normalized_updates)
+	w[all.normalized_idx] = *in++;
+    }
+
+  print_sync_stats(all, k, bytes, start);
+  delete[] local_weights;
+  delete[] ratios;
+  indices.delete_v();
+}
+
+#ifdef _WIN32
+DWORD WINAPI average_thread(LPVOID in)
+#else
+void* average_thread(void* in)
+#endif
+{
+  background_average& b = *(background_average*)in;
+  vw& all = *b.all;
+  if (b.count_finished)
+    b.finished = accumulate_scalar(all, all.span_server, b.finished);
+  if (all.adaptive)
+    accumulate_weighted_avg(all, all.span_server, b.copy);
+  else
+    accumulate_avg(all, all.span_server, b.copy, 0);
+  b.done = true;
+  return 0;
+}
+
+void start_background_average(vw& all, background_average& b)
+{
+  size_t size = ((size_t)1 << all.num_bits) << all.reg.stride_shift;
+  if (b.started == NULL)
+    {
+      b.all = &all;
+      b.started = (weight*)calloc_or_die(size, sizeof(weight));
+      b.copy = all.reg;
+      b.copy.weight_vector = (weight*)calloc_or_die(size, sizeof(weight));
+    }
+  memcpy(b.started, all.reg.weight_vector, size*sizeof(weight));
+  memcpy(b.copy.weight_vector, all.reg.weight_vector, size*sizeof(weight));
+  b.running = true;
+  b.done = false;
+#ifndef _WIN32
+  pthread_create(&b.thread, NULL, average_thread, &b);
+#else
+  b.thread = ::CreateThread(NULL, 0, static_cast<LPTHREAD_START_ROUTINE>(average_thread), &b, NULL, NULL);
+#endif
+}
+
+void finish_background_average(background_average& b)
+{
+  if (!b.running)
+    return;
+#ifndef _WIN32
+  pthread_join(b.thread, NULL);
+#else
+  ::WaitForSingleObject(b.thread, INFINITE);
+  ::CloseHandle(b.thread);
+#endif
+  b.running = false;
+
+  vw& all = *b.all;
+  size_t size = ((size_t)1 << all.num_bits) << all.reg.stride_shift;
+  weight* weights = all.reg.weight_vector;
+  for (size_t i = 0; i < size; i++)
+    if (weights[i] == b.started[i]) //exactly the average; the sum below may be reassociated under -ffast-math.
+      weights[i] = b.copy.weight_vector[i];
+    else
+      weights[i] += b.copy.weight_vector[i] - b.started[i];
+}
+
+void free_background_average(background_average& b)
+{
+  finish_background_average(b);
+  free(b.started);
+  free(b.copy.weight_vector);
+  b.started = b.copy.weight_vector = NULL;
+}
@@ -13,4 +13,46 @@ float accumulate_scalar(vw& all, std::string master_location, float local_sum);
 void accumulate_weighted_avg(vw& all, std::string master_location, regressor& reg);
 void accumulate_avg(vw& all, std::string master_location, regressor& reg, size_t o);
 
+//Weights changed since the last average, so that only those need to be exchanged (--sparse_allreduce).
+struct sparse_sync {
+  uint32_t* touched; //one bit per weight index, set by GD as it updates the weight.
+  weight* weights;
+  size_t stride_shift;
+  bool fp16; //send the change since the last average as half floats.
+  float* synced; //each weight after the last average.  Only with fp16.
+  float* residual; //rounding error not yet sent.  Only with fp16.
+};
+
+inline void mark_touched(sparse_sync& s, size_t index)
+{
+  s.touched[index >> 5] |= 1u << (index & 31);
+}
+
+void sparse_sync_init(vw& all);
+void sparse_sync_free(vw& all);
+void accumulate_sparse_avg(vw& all, std::string master_location, regressor& reg);
+void accumulate_sparse_weighted_avg(vw& all, std::string master_location, regressor& reg);
+
+//An average of a copy of the weights, run on its own thread so that learning goes on meanwhile (--overlap_allreduce).
+struct background_average {
+  vw* all;
+  weight* started; //the weights when the average was started.
+  regressor copy; //all.reg, but over a copy of started that the thread averages in place.
+  bool running;
+  volatile bool done; //set by the thread once the average is ready to finish without waiting.
+  bool count_finished; //also allreduce finished, so that nodes averaging during a pass can agree when it ends.
+  float finished; //1 if this node is at the end of its pass; after the average, how many nodes are.
+#ifndef _WIN32
+  pthread_t thread;
+#else
+  HANDLE thread;
+#endif
+};
+
+void start_background_average(vw& all, background_average& b);
+/* Wait for the average, then move every weight by as much as averaging moved the copy, which gives
+   the average plus what this node learned since it started. */
+void finish_background_average(background_average& b);
+void free_background_average(background_average& b);
+
 #endif
@@ -18,8 +18,13 @@ Alekh Agarwal and John Langford, with help Olivier Chapelle.
 #include <io.h>
 #else
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #endif
 #include <sys/timeb.h>
+#include <signal.h>
 #include "allreduce.h"
 
 using namespace std;
@@ -96,41 +101,335 @@ socket_t getsock()
   return sock;
 }
 
-void all_reduce_init(const string master_location, const size_t unique_id, const size_t total, const size_t node, node_socks& socks)
+// bind to the first free port at or above netport and listen on it.
+socket_t listen_sock(short unsigned int& netport, int backlog)
 {
+  socket_t sock = getsock();
+  sockaddr_in address;
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = netport;
+
+  bool listening = false;
+  while(!listening)
+    {
+      if (bind(sock,(sockaddr*)&address, sizeof(address)) < 0)
+	{
 #ifdef _WIN32
-  WSAData wsaData;
-  WSAStartup(MAKEWORD(2,2), &wsaData);
-  int lastError = WSAGetLastError();
+	  if (WSAGetLastError() == WSAEADDRINUSE)
+#else
+	  if (errno == EADDRINUSE)
 #endif
+	    {
+	      netport = htons(ntohs(netport)+1);
+	      address.sin_port = netport;
+	    }
+	  else
+	    {
+	      perror("Bind failed ");
+	      throw exception();
+	    }
+	}
+      else
+	{
+	  if (listen(sock, backlog) < 0)
+	    {
+	      perror("listen failed! ");
+	      CLOSESOCK(sock);
+	      sock = getsock();
+	    }
+	  else
+	    {
+	      listening = true;
+	    }
+	}
+    }
+  return sock;
+}
 
+void set_nonblocking(socket_t sock)
+{
+#ifdef _WIN32
+  u_long on = 1;
+  ioctlsocket(sock, FIONBIO, &on);
+#else
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+#endif
+}
 
+/* Join the ring.  Every node listens, then the tree (already built) is used to allreduce a table
+   of everyone's address, then each node connects to its successor and accepts its predecessor.
+   Connecting can't deadlock since the successor is already listening. */
+void ring_init(const uint32_t my_ip, const size_t total, const size_t node, node_socks& socks)
+{
+  socks.ring_rank = node;
+  socks.ring_size = total;
+  if (total < 2)
+    return;
 
-  struct hostent* master = gethostbyname(master_location.c_str());
+  short unsigned int netport = htons(26544);
+  socket_t sock = listen_sock(netport, 1);
 
-  if (master == NULL) {
-    cerr << "can't resolve hostname: " << master_location << endl;
-    throw exception();
-  }
-  socks.current_master = master_location;
+  uint32_t* table = (uint32_t*)calloc(2*total, sizeof(uint32_t));
+  table[2*node] = my_ip;
+  table[2*node+1] = netport;
+  tree_allreduce<uint32_t>((char*)table, 2*total*sizeof(uint32_t), socks.parent, socks.children, socks.timeout);
 
-  uint32_t master_ip = * ((uint32_t*)master->h_addr);
-  int port = 26543;
+  size_t next = (node + 1) % total;
+  socks.ring_next = sock_connect(table[2*next], (int)table[2*next+1]);
+  free(table);
 
-  socket_t master_sock = sock_connect(master_ip, htons(port));
-  if(send(master_sock, (const char*)&unique_id, sizeof(unique_id), 0) < (int)sizeof(unique_id))
-    cerr << "write failed!" << endl;
-  if(send(master_sock, (const char*)&total, sizeof(total), 0) < (int)sizeof(total))
-    cerr << "write failed!" << endl;
-  if(send(master_sock, (char*)&node, sizeof(node), 0) < (int)sizeof(node))
-    cerr << "write failed!" << endl;
-  int ok;
-  if (recv(master_sock, (char*)&ok, sizeof(ok), 0) < (int)sizeof(ok))
-    cerr << "read 1 failed!" << endl;
-  if (!ok) {
-    cerr << "mapper already connected" << endl;
-    throw exception();
-  }
+  sockaddr_in prev_address;
+  socklen_t size = sizeof(prev_address);
+  socks.ring_prev = accept(sock,(sockaddr*)&prev_address,&size);
+  if (socks.ring_prev < 0)
+    {
+      cerr << "bad ring socket!" << endl;
+      throw exception();
+    }
+  CLOSESOCK(sock);
+
+  int on = 1;
+  setsockopt(socks.ring_next, IPPROTO_TCP, TCP_NODELAY, (char*)&on, sizeof(on));
+  //both directions move at once, so neither side may block in send.
+  set_nonblocking(socks.ring_next);
+  set_nonblocking(socks.ring_prev);
+}
+
+bool would_block()
+{
+#ifdef _WIN32
+  return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+  return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+bool wait_for_sockets(const socket_t max_fd, fd_set* read_fds, fd_set* write_fds, const size_t timeout)
+{
+  timeval limit;
+  limit.tv_sec = (long)timeout;
+  limit.tv_usec = 0;
+  int ready = select((int)max_fd+1, read_fds, write_fds, NULL, timeout > 0 ? &limit : NULL);
+  if (ready == -1)
+    {
+      if (would_block())
+	return false;
+      cerr << "Select failed!" << endl;
+      perror(NULL);
+      throw exception();
+    }
+  if (ready == 0)
+    {
+      cerr << "no allreduce progress for " << timeout << " seconds" << endl;
+      throw exception();
+    }
+  return true;
+}
+
+void ring_exchange(const socket_t next, const char* out, const size_t out_len, const socket_t prev, char* in, const size_t in_len, const size_t timeout)
+{
+  size_t sent = 0, received = 0;
+  while (sent < out_len || received < in_len)
+    {
+      fd_set read_fds, write_fds;
+      FD_ZERO(&read_fds);
+      FD_ZERO(&write_fds);
+      if (sent < out_len)
+	FD_SET(next, &write_fds);
+      if (received < in_len)
+	FD_SET(prev, &read_fds);
+      if (!wait_for_sockets(max(next, prev), &read_fds, &write_fds, timeout))
+	continue;
+
+      if (sent < out_len && FD_ISSET(next, &write_fds))
+	{
+	  int write_size = send(next, out + sent, (int)min(ar_buf_size, out_len - sent), 0);
+	  if (write_size > 0)
+	    sent += write_size;
+	  else if (!would_block())
+	    {
+	      cerr << "Write to ring successor failed" << endl;
+	      perror(NULL);
+	      throw exception();
+	    }
+	}
+      if (received < in_len && FD_ISSET(prev, &read_fds))
+	{
+	  int read_size = recv(prev, in + received, (int)min(ar_buf_size, in_len - received), 0);
+	  if (read_size > 0)
+	    received += read_size;
+	  else if (read_size == 0 || !would_block())
+	    {
+	      cerr << "Read from ring predecessor failed" << endl;
+	      perror(NULL);
+	      throw exception();
+	    }
+	}
+    }
+}
+
+#ifdef _WIN32
+void local_attach(node_socks&, size_t)
+{
+  cerr << "--local_allreduce is not supported on Windows" << endl;
+  throw exception();
+}
+void local_detach(node_socks&) {}
+char* local_buffer(node_socks&) { return NULL; }
+void local_barrier(node_socks&) {}
+#else
+//heads the shared memory of a machine's local nodes, followed by local_chunk bytes of vector.
+struct local_segment {
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  size_t arrived; //at the current barrier
+  size_t round; //barriers passed
+  volatile size_t ready; //the build that initialized the segment
+};
+
+const size_t segment_size = sizeof(local_segment) + local_chunk;
+
+void wait_a_little(const time_t started, const size_t timeout)
+{
+  if (timeout > 0 && (size_t)(time(NULL) - started) > timeout)
+    {
+      cerr << "local nodes never set up their shared memory" << endl;
+      throw exception();
+    }
+  usleep(1000);
+}
+
+/* The leader of a machine's nodes creates the segment, named for the tree build and the leader's
+   rank in it so no other group shares it, and the others map it once it is initialized.  Once all
+   are in, the name is removed, so the memory goes away with the last of them. */
+void local_attach(node_socks& socks, const size_t build)
+{
+  local_detach(socks);
+  if (socks.local_size == 1)
+    return;
+  char name[64];
+  sprintf(name, "/vw_allreduce.%lu.%lu", (unsigned long)build, (unsigned long)socks.rank);
+  time_t started = time(NULL);
+  int fd;
+  if (socks.local_rank == 0)
+    {
+      shm_unlink(name);
+      fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+      if (fd < 0 || ftruncate(fd, segment_size) != 0)
+	{
+	  cerr << "can't create shared memory " << name << endl;
+	  perror(NULL);
+	  throw exception();
+	}
+    }
+  else
+    {
+      struct stat st;
+      while ((fd = shm_open(name, O_RDWR, 0600)) < 0)
+	wait_a_little(started, socks.timeout);
+      while (fstat(fd, &st) == 0 && (size_t)st.st_size < segment_size)
+	wait_a_little(started, socks.timeout);
+    }
+  void* base = mmap(NULL, segment_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    {
+      cerr << "can't map shared memory " << name << endl;
+      perror(NULL);
+      throw exception();
+    }
+  local_segment* seg = (local_segment*)base;
+  socks.local_seg = seg;
+  if (socks.local_rank == 0)
+    {
+      pthread_mutexattr_t lock_attr;
+      pthread_mutexattr_init(&lock_attr);
+      pthread_mutexattr_setpshared(&lock_attr, PTHREAD_PROCESS_SHARED);
+      pthread_mutex_init(&seg->lock, &lock_attr);
+      pthread_mutexattr_destroy(&lock_attr);
+      pthread_condattr_t wake_attr;
+      pthread_condattr_init(&wake_attr);
+      pthread_condattr_setpshared(&wake_attr, PTHREAD_PROCESS_SHARED);
+      pthread_cond_init(&seg->wake, &wake_attr);
+      pthread_condattr_destroy(&wake_attr);
+      seg->arrived = 0;
+      seg->round = 0;
+      __sync_synchronize();
+      seg->ready = build;
+    }
+  else
+    while (seg->ready != build)
+      wait_a_little(started, socks.timeout);
+  __sync_synchronize();
+
+  local_barrier(socks);
+  if (socks.local_rank == 0)
+    shm_unlink(name);
+}
+
+void local_detach(node_socks& socks)
+{
+  if (socks.local_seg != NULL)
+    munmap(socks.local_seg, segment_size);
+  socks.local_seg = NULL;
+}
+
+char* local_buffer(node_socks& socks)
+{
+  return (char*)socks.local_seg + sizeof(local_segment);
+}
+
+void local_barrier(node_socks& socks)
+{
+  local_segment* seg = (local_segment*)socks.local_seg;
+  timespec limit;
+  limit.tv_sec = time(NULL) + (time_t)socks.timeout;
+  limit.tv_nsec = 0;
+  pthread_mutex_lock(&seg->lock);
+  size_t round = seg->round;
+  if (++seg->arrived == socks.local_size)
+    {
+      seg->arrived = 0;
+      seg->round++;
+      pthread_cond_broadcast(&seg->wake);
+    }
+  else
+    while (seg->round == round)
+      if (socks.timeout == 0)
+	pthread_cond_wait(&seg->wake, &seg->lock);
+      else if (pthread_cond_timedwait(&seg->wake, &seg->lock, &limit) == ETIMEDOUT && seg->round == round)
+	{
+	  pthread_mutex_unlock(&seg->lock);
+	  cerr << "no progress from the local nodes for " << socks.timeout << " seconds" << endl;
+	  throw exception();
+	}
+  pthread_mutex_unlock(&seg->lock);
+}
+#endif
+
+/* Get our place in a tree from the spanning tree server: how many nodes the job has, our rank in the
+   tree and its size, our place among the nodes reducing locally on our machine, then (if we are in
+   the tree) the children to accept and the parent to connect to. */
+void join_tree(node_socks& socks)
+{
+  socket_t master_sock = socks.master;
+  size_t build;
+  if(recv(master_sock, (char*)&socks.total, sizeof(socks.total), 0) < (int)sizeof(socks.total)
+     || recv(master_sock, (char*)&socks.rank, sizeof(socks.rank), 0) < (int)sizeof(socks.rank)
+     || recv(master_sock, (char*)&socks.net_total, sizeof(socks.net_total), 0) < (int)sizeof(socks.net_total)
+     || recv(master_sock, (char*)&socks.local_rank, sizeof(socks.local_rank), 0) < (int)sizeof(socks.local_rank)
+     || recv(master_sock, (char*)&socks.local_size, sizeof(socks.local_size), 0) < (int)sizeof(socks.local_size)
+     || recv(master_sock, (char*)&build, sizeof(build), 0) < (int)sizeof(build))
+    {
+      cerr << "lost the spanning tree server!" << endl;
+      throw exception();
+    }
+  if (socks.local)
+    local_attach(socks, build);
+  socks.parent = socks.children[0] = socks.children[1] = -1;
+  if (socks.local_rank > 0)
+    return;
 
   uint16_t kid_count;
   uint16_t parent_port;
@@ -141,48 +440,8 @@ void all_reduce_init(const string master_location, const size_t unique_id, const
 
   socket_t sock = -1;
   short unsigned int netport = htons(26544);
-  if(kid_count > 0) {
-    sock = getsock();
-    sockaddr_in address;
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = htonl(INADDR_ANY);
-    address.sin_port = netport;
-
-    bool listening = false;
-    while(!listening)
-    {
-      if (bind(sock,(sockaddr*)&address, sizeof(address)) < 0)
-      {
-#ifdef _WIN32
-        if (WSAGetLastError() == WSAEADDRINUSE)
-#else
-        if (errno == EADDRINUSE)
-#endif
-        {
-          netport = htons(ntohs(netport)+1);
-          address.sin_port = netport;
-        }
-        else
-        {
-          perror("Bind failed ");
-          throw exception();
-        }
-      }
-      else
-      {
-        if (listen(sock, kid_count) < 0)
-        {
-          perror("listen failed! ");
-          CLOSESOCK(sock);
-          sock = getsock();
-        }
-        else
-        {
-          listening = true;
-        }
-      }
-    }
-  }
+  if(kid_count > 0)
+    sock = listen_sock(netport, kid_count);
 
   if(send(master_sock, (const char*)&netport, sizeof(netport), 0) < (int)sizeof(netport))
     cerr << "write failed!" << endl;
@@ -192,15 +451,12 @@ void all_reduce_init(const string master_location, const size_t unique_id, const
   if(recv(master_sock, (char*)&parent_port, sizeof(parent_port), 0) < (int)sizeof(parent_port))
     cerr << "read 4 failed!" << endl;
 
-  CLOSESOCK(master_sock);
-
   if(parent_ip != (uint32_t)-1) {
     socks.parent = sock_connect(parent_ip, parent_port);
   }
   else
     socks.parent = -1;
 
-  socks.children[0] = -1; socks.children[1] = -1;
   for (int i = 0; i < kid_count; i++)
   {
     sockaddr_in child_address;
@@ -220,57 +476,91 @@ void all_reduce_init(const string master_location, const size_t unique_id, const
 
   if (kid_count > 0)
     CLOSESOCK(sock);
+
+  if (socks.parent != -1)
+    set_nonblocking(socks.parent);
+  for (int i = 0; i < kid_count; i++)
+    set_nonblocking(socks.children[i]);
+
+  if (socks.ring)
+    ring_init(socks.my_ip, socks.net_total, socks.rank, socks);
 }
 
+void all_reduce_init(const string master_location, const size_t unique_id, const size_t total, const size_t node, node_socks& socks)
+{
+#ifdef _WIN32
+  WSAData wsaData;
+  WSAStartup(MAKEWORD(2,2), &wsaData);
+  int lastError = WSAGetLastError();
+#else
+  if (socks.retries > 0) //a dead neighbour must fail the allreduce, not kill us.
+    signal(SIGPIPE, SIG_IGN);
+#endif
 
-void pass_down(char* buffer, const size_t parent_read_pos, size_t& children_sent_pos, const socket_t * child_sockets, const size_t n) {
 
-  size_t my_bufsize = min(ar_buf_size, (parent_read_pos - children_sent_pos));
 
-  if(my_bufsize > 0) {
-    //going to pass up this chunk of data to the children
-    if(child_sockets[0] != -1 && send(child_sockets[0], buffer+children_sent_pos, (int)my_bufsize, 0) < (int)my_bufsize)
-      cerr<<"Write to left child failed\n";
-    if(child_sockets[1] != -1 && send(child_sockets[1], buffer+children_sent_pos, (int)my_bufsize, 0) < (int)my_bufsize)
-      cerr<<"Write to right child failed\n";
+  struct hostent* master = gethostbyname(master_location.c_str());
 
-    children_sent_pos += my_bufsize;
+  if (master == NULL) {
+    cerr << "can't resolve hostname: " << master_location << endl;
+    throw exception();
   }
-}
+  socks.current_master = master_location;
 
+  uint32_t master_ip = * ((uint32_t*)master->h_addr);
+  int port = 26543;
 
+  socket_t master_sock = sock_connect(master_ip, htons(port));
+  if(send(master_sock, (const char*)&unique_id, sizeof(unique_id), 0) < (int)sizeof(unique_id))
+    cerr << "write failed!" << endl;
+  if(send(master_sock, (const char*)&total, sizeof(total), 0) < (int)sizeof(total))
+    cerr << "write failed!" << endl;
+  if(send(master_sock, (char*)&node, sizeof(node), 0) < (int)sizeof(node))
+    cerr << "write failed!" << endl;
+  uint16_t rack_length = (uint16_t)socks.rack.size();
+  if(send(master_sock, (char*)&rack_length, sizeof(rack_length), 0) < (int)sizeof(rack_length)
+     || send(master_sock, socks.rack.c_str(), rack_length, 0) < (int)rack_length
+     || send(master_sock, (char*)&socks.local, 1, 0) < 1)
+    cerr << "write failed!" << endl;
+  int ok;
+  if (recv(master_sock, (char*)&ok, sizeof(ok), 0) < (int)sizeof(ok))
+    cerr << "read 1 failed!" << endl;
+  if (!ok) {
+    cerr << "mapper already connected, or dropped from the job" << endl;
+    throw exception();
+  }
+  socks.master = master_sock;
 
-void broadcast(char* buffer, const size_t n, const socket_t parent_sock, const socket_t * child_sockets) {
+  //the address the master saw us on is the one the other nodes can reach.
+  sockaddr_in my_address;
+  socklen_t my_address_size = sizeof(my_address);
+  socks.my_ip = 0;
+  if (getsockname(master_sock, (sockaddr*)&my_address, &my_address_size) == 0)
+    socks.my_ip = my_address.sin_addr.s_addr;
 
-   size_t parent_read_pos = 0; //First unread float from parent
-   size_t children_sent_pos = 0; //First unsent float to children
-  //parent_sent_pos <= left_read_pos
-  //parent_sent_pos <= right_read_pos
+  join_tree(socks);
+}
 
-   if(parent_sock == -1) {
-     parent_read_pos = n;
-   }
-   if(child_sockets[0] == -1 && child_sockets[1] == -1)
-     children_sent_pos = n;
+void close_sock(socket_t& sock)
+{
+  if (sock != -1)
+    CLOSESOCK(sock);
+  sock = -1;
+}
 
-   while (parent_read_pos < n || children_sent_pos < n)
+void all_reduce_rebuild(node_socks& socks)
+{
+  close_sock(socks.parent);
+  close_sock(socks.children[0]);
+  close_sock(socks.children[1]);
+  close_sock(socks.ring_next);
+  close_sock(socks.ring_prev);
+
+  char rebuild = 1;
+  if (send(socks.master, &rebuild, 1, 0) < 1)
     {
-      pass_down(buffer, parent_read_pos, children_sent_pos, child_sockets, n);
-      if(parent_read_pos >= n && children_sent_pos >= n) break;
-
-      if (parent_sock != -1) {
-	//there is data to be read from the parent
-	if(parent_read_pos == n) {
-	  cerr<<"I think parent has no data to send but he thinks he has\n";
-	  throw exception();
-	}
-	size_t count = min(ar_buf_size,n-parent_read_pos);
-	int read_size = recv(parent_sock, buffer + parent_read_pos, (int)count, 0);
-	if(read_size == -1) {
-	  cerr <<" Read from parent failed\n";
-	  perror(NULL);
-	}
-	parent_read_pos += read_size;
-      }
+      cerr << "lost the spanning tree server!" << endl;
+      throw exception();
     }
+  join_tree(socks);
 }
@@ -8,6 +8,7 @@ license as described in the file LICENSE.
 #ifndef ALLREDUCE_H
 #define ALLREDUCE_H
 #include <string>
+#include <string.h>
 #ifdef _WIN32
 #include <WinSock2.h>
 #include <WS2tcpip.h>
@@ -31,25 +32,68 @@ typedef int socket_t;
 using namespace std;
 
 const size_t ar_buf_size = 1<<16;
+const size_t local_chunk = 1<<24; //bytes of a vector reduced through shared memory at a time.
+
+struct node_socks;
+void local_detach(node_socks& socks);
 
 struct node_socks {
   std::string current_master;
+  std::string rack; //nodes with the same label are kept together in the tree.
+  socket_t master; //kept open, so the spanning tree server notices if we die; a new tree is asked for on it.
+  size_t total; //nodes in the job, fewer than --total if the server dropped stragglers.
+  size_t rank; //in the tree.
+  size_t net_total; //nodes in the tree.
+  bool local; //reduce with the other such nodes on this machine first, leaving the tree to one of us.
+  size_t local_rank; //0 for the one in the tree.
+  size_t local_size;
+  void* local_seg; //shared memory of the machine's local nodes.
+  uint32_t my_ip;
+  size_t timeout; //seconds an allreduce may wait without progress before it fails, 0 for ever.
+  size_t retries; //times a failed allreduce rebuilds the tree and starts over.
   socket_t parent;
   socket_t children[2];
+  bool ring; //reduce around a ring of all nodes instead of up and down the tree.
+  size_t ring_rank;
+  size_t ring_size;
+  socket_t ring_next; //we send to node+1 and receive from node-1.
+  socket_t ring_prev;
   ~node_socks()
   {
+    local_detach(*this);
     if(current_master != "") {
+      if(master != -1)
+	CLOSESOCK(this->master);
       if(parent != -1)
 	CLOSESOCK(this->parent);
       if(children[0] != -1)
 	CLOSESOCK(this->children[0]);
       if(children[1] != -1)
 	CLOSESOCK(this->children[1]);
+      if(ring_next != -1)
+	CLOSESOCK(this->ring_next);
+      if(ring_prev != -1)
+	CLOSESOCK(this->ring_prev);
     }
   }
   node_socks ()
   {
     current_master = "";
+    master = -1;
+    total = 1;
+    rank = 0;
+    net_total = 1;
+    local = false;
+    local_rank = 0;
+    local_size = 1;
+    local_seg = NULL;
+    timeout = 0;
+    retries = 0;
+    ring = false;
+    ring_rank = 0;
+    ring_size = 1;
+    ring_next = -1;
+    ring_prev = -1;
   }
 };
 
@@ -59,110 +103,275 @@ template <class T> void addbufs(T* buf1, const T* buf2, const size_t n) {
     buf1[i] += buf2[i];
 }
 
-void all_reduce_init(const string master_location, const size_t unique_id, const size_t total, const size_t node, node_socks& socks);
-
-template <class T> void pass_up(char* buffer, size_t left_read_pos, size_t right_read_pos, size_t& parent_sent_pos, socket_t parent_sock, size_t n) {
-  size_t my_bufsize = min(ar_buf_size, ((int)(floor(left_read_pos/((float)sizeof(T)))*sizeof(T)) - parent_sent_pos));
-  my_bufsize = min(my_bufsize, ((int)(floor(right_read_pos/((float)sizeof(T)))*sizeof(T)) - parent_sent_pos));
+// port is already in network order
+socket_t sock_connect(const uint32_t ip, const int port);
 
-  if(my_bufsize > 0) {
-    //going to pass up this chunk of data to the parent
-    int write_size = send(parent_sock, buffer+parent_sent_pos, (int)my_bufsize, 0);
-    if(write_size < (int)my_bufsize)
-      cerr<<"Write to parent failed "<<my_bufsize<<" "<<write_size<<" "<<parent_sent_pos<<" "<<left_read_pos<<" "<<right_read_pos<<endl ;
-    parent_sent_pos += my_bufsize;
-  }
+void all_reduce_init(const string master_location, const size_t unique_id, const size_t total, const size_t node, node_socks& socks);
 
-}
+//drops the current tree and waits for the spanning tree server to build a new one.
+void all_reduce_rebuild(node_socks& socks);
 
-template <class T>void reduce(char* buffer, const size_t n, const socket_t parent_sock, const socket_t* child_sockets) {
+//true if a failed send or recv on a non-blocking socket only has to be retried.
+bool would_block();
 
-  fd_set fds;
-  FD_ZERO(&fds);
-  if(child_sockets[0] != -1)
-    FD_SET(child_sockets[0],&fds);
-  if(child_sockets[1] != -1)
-    FD_SET(child_sockets[1],&fds);
+//select on the fds; false if only interrupted.  Throws once timeout seconds (if not 0) pass with none ready.
+bool wait_for_sockets(const socket_t max_fd, fd_set* read_fds, fd_set* write_fds, const size_t timeout);
 
-  socket_t max_fd = max(child_sockets[0],child_sockets[1])+1;
-  size_t child_read_pos[2] = {0,0}; //First unread float from left and right children
-  int child_unprocessed[2] = {0,0}; //The number of bytes sent by the child but not yet added to the buffer
+/*
+The reduce up the tree and the broadcast back down are pipelined: a node passes a chunk up as soon
+as both children's parts of it have been added, and passes the result for a chunk down as soon as it
+comes back from the parent, so every link carries data both ways at once instead of the broadcast
+waiting for the whole vector to reach the root.  The sockets are non-blocking, and one select loop
+serves all of a node's links.
+ */
+template <class T> void tree_allreduce(char* buffer, const size_t n, const socket_t parent_sock, const socket_t* child_sockets, const size_t timeout)
+{
+  size_t child_read_pos[2] = {0,0}; //bytes received from each child, all but child_unprocessed of them added to the buffer
+  int child_unprocessed[2] = {0,0}; //bytes of a partial T received from a child
   char child_read_buf[2][ar_buf_size+sizeof(T)-1];
-  size_t parent_sent_pos = 0; //First unsent float to parent
-  //parent_sent_pos <= left_read_pos
-  //parent_sent_pos <= right_read_pos
-
-  if(child_sockets[0] == -1) {
-    child_read_pos[0] = n;
-  }
-  if(child_sockets[1] == -1) {
-    child_read_pos[1] = n;
-  }
-
-  while (parent_sent_pos < n || child_read_pos[0] < n || child_read_pos[1] < n)
+  size_t child_sent_pos[2] = {0,0}; //bytes of the result sent to each child
+  size_t parent_sent_pos = 0; //bytes of our partial sum sent to the parent
+  size_t parent_read_pos = 0; //bytes of the result received from the parent
+  //parent_read_pos <= parent_sent_pos <= both child_read_pos, so results never land on sums in progress.
+
+  for (int i = 0; i < 2; i++)
+    if (child_sockets[i] == -1)
+      child_read_pos[i] = child_sent_pos[i] = n;
+  if (parent_sock == -1)
+    parent_read_pos = parent_sent_pos = n;
+
+  while (parent_sent_pos < n || parent_read_pos < n || child_read_pos[0] < n || child_read_pos[1] < n
+	 || child_sent_pos[0] < n || child_sent_pos[1] < n)
     {
-      if(parent_sock != -1)
-	pass_up<T>(buffer, child_read_pos[0], child_read_pos[1], parent_sent_pos, parent_sock, n);
-
-      if(parent_sent_pos >= n && child_read_pos[0] >= n && child_read_pos[1] >= n) break;
+      size_t reduced = min(child_read_pos[0], child_read_pos[1]) / sizeof(T) * sizeof(T);
+      size_t result = parent_sock == -1 ? reduced : parent_read_pos;
+
+      fd_set read_fds, write_fds;
+      FD_ZERO(&read_fds);
+      FD_ZERO(&write_fds);
+      socket_t max_fd = 0;
+      for (int i = 0; i < 2; i++)
+	{
+	  if (child_read_pos[i] < n)
+	    FD_SET(child_sockets[i], &read_fds);
+	  if (child_sent_pos[i] < result)
+	    FD_SET(child_sockets[i], &write_fds);
+	  if (child_sockets[i] != -1)
+	    max_fd = max(max_fd, child_sockets[i]);
+	}
+      if (parent_sock != -1)
+	{
+	  if (parent_read_pos < n)
+	    FD_SET(parent_sock, &read_fds);
+	  if (parent_sent_pos < reduced)
+	    FD_SET(parent_sock, &write_fds);
+	  max_fd = max(max_fd, parent_sock);
+	}
 
-      if(child_read_pos[0] < n || child_read_pos[1] < n) {
-	if (max_fd > 0 && select((int)max_fd,&fds,NULL, NULL, NULL) == -1)
-	  {
-	    cerr << "Select failed!" << endl;
-	    perror(NULL);
-	    throw exception();
-	  }
+      if (!wait_for_sockets(max_fd, &read_fds, &write_fds, timeout))
+	continue;
+
+      for (int i = 0; i < 2; i++)
+	{
+	  if (child_read_pos[i] < n && FD_ISSET(child_sockets[i], &read_fds))
+	    {
+	      size_t count = min(ar_buf_size,n - child_read_pos[i]);
+	      int read_size = recv(child_sockets[i], child_read_buf[i] + child_unprocessed[i], (int)count, 0);
+	      if (read_size <= 0)
+		{
+		  if (read_size < 0 && would_block())
+		    continue;
+		  cerr <<" Read from child failed\n";
+		  perror(NULL);
+		  throw exception();
+		}
+
+	      addbufs((T*)buffer + child_read_pos[i]/sizeof(T), (T*)child_read_buf[i], (child_read_pos[i] + read_size)/sizeof(T) - child_read_pos[i]/sizeof(T));
+
+	      child_read_pos[i] += read_size;
+	      int old_unprocessed = child_unprocessed[i];
+	      child_unprocessed[i] = child_read_pos[i] % (int)sizeof(T);
+	      for(int j = 0;j < child_unprocessed[i];j++) {
+		child_read_buf[i][j] = child_read_buf[i][((old_unprocessed + read_size)/(int)sizeof(T))*sizeof(T)+j];
+	      }
+	    }
+	  if (child_sent_pos[i] < result && FD_ISSET(child_sockets[i], &write_fds))
+	    {
+	      int write_size = send(child_sockets[i], buffer + child_sent_pos[i], (int)min(ar_buf_size, result - child_sent_pos[i]), 0);
+	      if (write_size > 0)
+		child_sent_pos[i] += write_size;
+	      else if (!would_block())
+		{
+		  cerr << "Write to child failed\n";
+		  perror(NULL);
+		  throw exception();
+		}
+	    }
+	}
 
-	for(int i = 0;i < 2;i++) {
-	  if(child_sockets[i] != -1 && FD_ISSET(child_sockets[i],&fds)) {
-	    //there is data to be left from left child
-	    if(child_read_pos[i] == n) {
-	      cerr<<"I think child has no data to send but he thinks he has "<<FD_ISSET(child_sockets[0],&fds)<<" "<<FD_ISSET(child_sockets[1],&fds)<<endl;
+      if (parent_sock == -1)
+	continue;
+      if (parent_read_pos < n && FD_ISSET(parent_sock, &read_fds))
+	{
+	  int read_size = recv(parent_sock, buffer + parent_read_pos, (int)min(ar_buf_size, n - parent_read_pos), 0);
+	  if (read_size > 0)
+	    parent_read_pos += read_size;
+	  else if (read_size == 0 || !would_block())
+	    {
+	      cerr <<" Read from parent failed\n";
+	      perror(NULL);
 	      throw exception();
 	    }
-
-
-	    size_t count = min(ar_buf_size,n - child_read_pos[i]);
-	    int read_size = recv(child_sockets[i], child_read_buf[i] + child_unprocessed[i], (int)count, 0);
-	    if(read_size == -1) {
-	      cerr <<" Read from child failed\n";
+	}
+      if (parent_sent_pos < reduced && FD_ISSET(parent_sock, &write_fds))
+	{
+	  int write_size = send(parent_sock, buffer + parent_sent_pos, (int)min(ar_buf_size, reduced - parent_sent_pos), 0);
+	  if (write_size > 0)
+	    parent_sent_pos += write_size;
+	  else if (!would_block())
+	    {
+	      cerr << "Write to parent failed\n";
 	      perror(NULL);
 	      throw exception();
 	    }
+	}
+    }
+}
 
-	    addbufs((T*)buffer + child_read_pos[i]/sizeof(T), (T*)child_read_buf[i], (child_read_pos[i] + read_size)/sizeof(T) - child_read_pos[i]/sizeof(T));
-
-	    child_read_pos[i] += read_size;
-	    int old_unprocessed = child_unprocessed[i];
-	    child_unprocessed[i] = child_read_pos[i] % (int)sizeof(T);
-	    for(int j = 0;j < child_unprocessed[i];j++) {
-	      child_read_buf[i][j] = child_read_buf[i][((old_unprocessed + read_size)/(int)sizeof(T))*sizeof(T)+j];
-	    }
+//send out_len bytes to next while receiving in_len bytes from prev.
+void ring_exchange(const socket_t next, const char* out, const size_t out_len, const socket_t prev, char* in, const size_t in_len, const size_t timeout);
 
-	    if(child_read_pos[i] == n) //Done reading parent
-	      FD_CLR(child_sockets[i],&fds);
-	  }
-	  else if(child_sockets[i] != -1 && child_read_pos[i] != n)
-	    FD_SET(child_sockets[i],&fds);
-	}
-      }
-      if(parent_sock == -1 && child_read_pos[0] == n && child_read_pos[1] == n)
-	parent_sent_pos = n;
+/*
+Ring allreduce: a reduce-scatter followed by an allgather, each of ring_size-1 steps in which every
+node sends one 1/ring_size slice of the vector to its successor while receiving another from its
+predecessor.  Every link carries 2(p-1)/p of the vector in total regardless of the node count, so
+unlike the tree no single node's link has to carry the whole vector several times.
+ */
+template <class T> void ring_reduce(T* buffer, const size_t n, node_socks& socks)
+{
+  size_t p = socks.ring_size;
+  if (p < 2)
+    return;
+  size_t rank = socks.ring_rank;
+  T* scratch = new T[n/p + 1];
 
+  for (size_t step = 0; step < p-1; step++)
+    {
+      size_t out = (rank + p - step) % p;
+      size_t in = (rank + p - step - 1) % p;
+      size_t out_begin = n*out/p, in_begin = n*in/p;
+      size_t in_count = n*(in+1)/p - in_begin;
+      ring_exchange(socks.ring_next, (char*)(buffer + out_begin), (n*(out+1)/p - out_begin)*sizeof(T),
+		    socks.ring_prev, (char*)scratch, in_count*sizeof(T), socks.timeout);
+      addbufs(buffer + in_begin, scratch, in_count);
+    }
+  //node rank now holds the complete sum of slice rank+1.
+  for (size_t step = 0; step < p-1; step++)
+    {
+      size_t out = (rank + 1 + p - step) % p;
+      size_t in = (rank + p - step) % p;
+      size_t out_begin = n*out/p, in_begin = n*in/p;
+      ring_exchange(socks.ring_next, (char*)(buffer + out_begin), (n*(out+1)/p - out_begin)*sizeof(T),
+		    socks.ring_prev, (char*)(buffer + in_begin), (n*(in+1)/p - in_begin)*sizeof(T), socks.timeout);
     }
+  delete[] scratch;
+}
 
+template <class T> void network_allreduce(T* buffer, const size_t n, node_socks& socks)
+{
+  if (socks.ring)
+    ring_reduce<T>(buffer, n, socks);
+  else
+    tree_allreduce<T>((char*)buffer, n*sizeof(T), socks.parent, socks.children, socks.timeout);
 }
 
-void broadcast(char* buffer, const size_t n, const socket_t parent_sock, const socket_t * child_sockets);
+//the vector shared by a machine's local nodes, local_chunk bytes.
+char* local_buffer(node_socks& socks);
+
+//returns once all of a machine's local nodes have called it.  Throws after socks.timeout seconds (if not 0).
+void local_barrier(node_socks& socks);
+
+/*
+Nodes on one machine first sum their vectors in shared memory, each adding its own slices of the
+vector in turn so they all work at once, then the one of them in the tree allreduces the sum over
+the network for them all, and they copy the result out.  Only one node per machine sends, so the
+tree has a machine's worth fewer nodes and the network carries the vector once per machine.  Every
+node of the job works through the vector in the same local_chunk sized pieces, so the ring's slices
+agree; that is why a job uses --local_allreduce on all of its nodes or none.
+ */
+template <class T> void local_allreduce(T* buffer, const size_t n, node_socks& socks)
+{
+  size_t chunk = local_chunk / sizeof(T);
+  if (socks.local_size == 1)
+    {
+      for (size_t begin = 0; begin < n; begin += chunk)
+	network_allreduce<T>(buffer + begin, min(chunk, n - begin), socks);
+      return;
+    }
 
+  T* shared = (T*)local_buffer(socks);
+  size_t others = socks.local_size - 1;
+  for (size_t begin = 0; begin < n; begin += chunk)
+    {
+      size_t count = min(chunk, n - begin);
+      if (socks.local_rank == 0)
+	memcpy(shared, buffer + begin, count*sizeof(T));
+      local_barrier(socks);
+      for (size_t step = 0; step < others; step++)
+	{
+	  if (socks.local_rank > 0)
+	    {
+	      size_t slice = (socks.local_rank - 1 + step) % others;
+	      size_t slice_begin = count*slice/others;
+	      addbufs(shared + slice_begin, buffer + begin + slice_begin, count*(slice+1)/others - slice_begin);
+	    }
+	  local_barrier(socks);
+	}
+      if (socks.local_rank == 0 && socks.net_total > 1)
+	network_allreduce<T>(shared, count, socks);
+      local_barrier(socks);
+      memcpy(buffer + begin, shared, count*sizeof(T));
+      local_barrier(socks); //before the next chunk overwrites it.
+    }
+}
 
+/*
+A node failing makes its neighbours' allreduce fail, and as each of them drops its links for a new
+tree the failure spreads to every node.  So with retries they all end up asking the spanning tree
+server for a new tree, which it builds once the failed node's replacement has joined too (or it was
+dropped), and they start the allreduce over from their saved input.
+ */
 template <class T> void all_reduce(T* buffer, const size_t n, const std::string master_location, const size_t unique_id, const size_t total, const size_t node, node_socks& socks)
 {
   if(master_location != socks.current_master)
     all_reduce_init(master_location, unique_id, total, node, socks);
-  reduce<T>((char*)buffer, n*sizeof(T), socks.parent, socks.children);
-  broadcast((char*)buffer, n*sizeof(T), socks.parent, socks.children);
+  T* input = NULL;
+  if (socks.retries > 0)
+    {
+      input = new T[n];
+      memcpy(input, buffer, n*sizeof(T));
+    }
+  for (size_t attempt = 0; ; attempt++)
+    try
+      {
+	if (socks.local)
+	  local_allreduce<T>(buffer, n, socks);
+	else
+	  network_allreduce<T>(buffer, n, socks);
+	break;
+      }
+    catch (exception&)
+      {
+	if (attempt >= socks.retries)
+	  {
+	    delete[] input;
+	    throw;
+	  }
+	cerr << "allreduce failed, rebuilding the spanning tree" << endl;
+	memcpy(buffer, input, n*sizeof(T));
+	all_reduce_rebuild(socks);
+      }
+  delete[] input;
 }
 
 
@@ -25,7 +25,7 @@ namespace ALINK {
       if (base_pred != 0.)
 	{
 	  feature f = { base_pred, (uint32_t) (autoconstant + i < b.stride_shift) };
-	  ec.atomics[autolink_namespace].push_back(f);
+	  ec.atomics(autolink_namespace).push_back(f);
 	  sum_sq += base_pred*base_pred;
 	  base_pred *= ld->prediction;
 	}
@@ -37,7 +37,7 @@ namespace ALINK {
     else
       base.predict(ec);
 
-    ec.atomics[autolink_namespace].erase();
+    ec.atomics(autolink_namespace).erase();
     ec.indices.pop();
     ec.total_sum_feat_sq -= sum_sq;
   }
@@ -17,6 +17,9 @@ Implementation by Miro Dudik.
 #include <stdio.h>
 #include <assert.h>
 #include <sys/timeb.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "constant.h"
 #include "simple_label.h"
 #include "accumulate.h"
@@ -39,6 +42,15 @@ using namespace LEARNER;
 #define W_DIR 2
 #define W_COND 3
 
+//the dense loops are split among --bfgs_threads threads when built with OpenMP.
+#ifndef _OPENMP
+#define PARALLEL(clauses)
+#elif defined(_MSC_VER)
+#define PARALLEL(clauses) __pragma(clauses)
+#else
+#define PARALLEL(clauses) _Pragma(#clauses)
+#endif
+
 #define LEARN_OK 0
 #define LEARN_CURV 1
 #define LEARN_CONV 2
@@ -61,6 +73,13 @@ namespace BFGS
 {
   const float max_precond_ratio = 100.f;
 
+  struct batched_example {
+    example* ec;
+    char kind; //one of the below.
+    size_t number; //for the curvature pass, which of predictions is the example's.
+  };
+  enum { SKIP, PREDICT, TEST, TRAIN };
+
   struct bfgs {
     vw* all;
     double wolfe1_bound;
@@ -90,6 +109,14 @@ namespace BFGS
     double* alpha;
     
     weight* regularizers;
+    bool sharded; //each node keeps the history of only its own slice of the weights.
+    uint32_t shard_begin, shard_end; //the weight numbers mem covers.
+    int threads; //with more than one, the dense loops run in parallel, and so do the examples of a batch.
+    learner* l;
+    bool batching; //only when bfgs is the top learner, which finishes the examples.
+    v_array<batched_example> batch; //learned, but not processed or finished yet.
+    float* thread_buffers; //per thread after the first, the gradient and then the preconditioner it accumulated.
+    double* thread_curvature;
     // the below needs to be included when resetting, in addition to preconditioner and derivative
     int lastj, origin;
     double loss_sum, previous_loss_sum;
@@ -113,6 +140,7 @@ void zero_derivative(vw& all)
   uint32_t length = 1 << all.num_bits;
   size_t stride_shift = all.reg.stride_shift;
   weight* weights = all.reg.weight_vector;
+  PARALLEL(omp parallel for)
   for(uint32_t i = 0; i < length; i++)
     weights[(i << stride_shift) +W_GT] = 0;
 }
@@ -122,6 +150,7 @@ void zero_preconditioner(vw& all)
   uint32_t length = 1 << all.num_bits;
   size_t stride_shift = all.reg.stride_shift;
   weight* weights = all.reg.weight_vector;
+  PARALLEL(omp parallel for)
   for(uint32_t i = 0; i < length; i++)
     weights[(i << stride_shift)+W_COND] = 0;
 }
@@ -215,9 +244,11 @@ double regularizer_direction_magnitude(vw& all, bfgs& b, float regularizer)
   size_t stride_shift = all.reg.stride_shift;
   weight* weights = all.reg.weight_vector;
   if (b.regularizers == NULL)
+    PARALLEL(omp parallel for reduction(+:ret))
     for(uint32_t i = 0; i < length; i++)
       ret += regularizer*weights[(i << stride_shift)+W_DIR]*weights[(i << stride_shift)+W_DIR];
   else
+    PARALLEL(omp parallel for reduction(+:ret))
     for(uint32_t i = 0; i < length; i++) 
       ret += b.regularizers[2*i]*weights[(i << stride_shift)+W_DIR]*weights[(i << stride_shift)+W_DIR];
 
@@ -230,31 +261,68 @@ float direction_magnitude(vw& all)
   uint32_t length = 1 << all.num_bits;
   size_t stride_shift = all.reg.stride_shift;
   weight* weights = all.reg.weight_vector;
+  PARALLEL(omp parallel for reduction(+:ret))
   for(uint32_t i = 0; i < length; i++)
     ret += weights[(i << stride_shift)+W_DIR]*weights[(i << stride_shift)+W_DIR];
   
   return (float)ret;
 }
 
-void bfgs_iter_start(vw& all, bfgs& b, float* mem, int& lastj, double importance_weight_sum, int&origin)
+/* With --shard_mem the loops over mem only cover this node's slice, so the dot products they compute
+   are summed over the nodes, and the direction, which every node needs in full to step and to
+   compute the curvature, is put together from everybody's slice. */
+void sum_over_shards(vw& all, bfgs& b, double* sums, size_t n)
+{
+  if (b.sharded)
+    all_reduce<double>(sums, n, all.span_server, all.unique_id, all.total, all.node, all.socks);
+}
+
+void gather_direction(vw& all, bfgs& b)
 {
+  if (!b.sharded)
+    return;
   uint32_t length = 1 << all.num_bits;
-  size_t stride = 1 << all.reg.stride_shift;
-  weight* w = all.reg.weight_vector;
+  size_t stride_shift = all.reg.stride_shift;
+  weight* weights = all.reg.weight_vector;
+  PARALLEL(omp parallel for)
+  for(uint32_t i = 0; i < length; i++)
+    if (i < b.shard_begin || i >= b.shard_end)
+      {
+	weights[(i << stride_shift)+W_DIR] = 0;
+	weights[(i << stride_shift)+W_GT] = 0;
+      }
+  accumulate(all, all.span_server, all.reg, W_DIR);
+}
+
+void bfgs_iter_start(vw& all, bfgs& b, float* mem, int& lastj, double importance_weight_sum, int&origin)
+{
+  uint32_t length = b.shard_end - b.shard_begin;
+  size_t stride_shift = all.reg.stride_shift;
+  weight* weights = all.reg.weight_vector + ((size_t)b.shard_begin << stride_shift);
 
   double g1_Hg1 = 0.;
   double g1_g1 = 0.;
   
   origin = 0;
-  for(uint32_t i = 0; i < length; i++, mem+=b.mem_stride, w+=stride) {
+  size_t mem_xt = (MEM_XT+origin)%b.mem_stride;
+  size_t mem_gt = (MEM_GT+origin)%b.mem_stride;
+  PARALLEL(omp parallel for reduction(+:g1_Hg1,g1_g1))
+  for(uint32_t i = 0; i < length; i++) {
+    float* m = mem + (size_t)i*b.mem_stride;
+    weight* w = weights + ((size_t)i << stride_shift);
     if (all.m>0)
-      mem[(MEM_XT+origin)%b.mem_stride] = w[W_XT]; 
-    mem[(MEM_GT+origin)%b.mem_stride] = w[W_GT];
+      m[mem_xt] = w[W_XT]; 
+    m[mem_gt] = w[W_GT];
     g1_Hg1 += w[W_GT] * w[W_GT] * w[W_COND];
     g1_g1 += w[W_GT] * w[W_GT];
     w[W_DIR] = -w[W_COND]*w[W_GT];
     w[W_GT] = 0;
   }
+  double sums[2] = {g1_Hg1, g1_g1};
+  sum_over_shards(all, b, sums, 2);
+  g1_Hg1 = sums[0];
+  g1_g1 = sums[1];
+  gather_direction(all, b);
   lastj = 0;
   if (!all.quiet)
     fprintf(stderr, "%-10.5f\t%-10.5f\t%-10s\t%-10s\t%-10s\t",
@@ -262,41 +330,50 @@ void bfgs_iter_start(vw& all, bfgs& b, float* mem, int& lastj, double importance
 	    g1_Hg1/importance_weight_sum, "", "", "");
 }
 
+/* The loops below go by index, with the positions in mem worked out beforehand, so that they can be
+   split among threads and vectorized. */
 void bfgs_iter_middle(vw& all, bfgs& b, float* mem, double* rho, double* alpha, int& lastj, int &origin) 
 {  
-  uint32_t length = 1 << all.num_bits;
-  size_t stride = 1 << all.reg.stride_shift;
-  weight* w = all.reg.weight_vector;
+  uint32_t length = b.shard_end - b.shard_begin;
+  size_t stride_shift = all.reg.stride_shift;
+  weight* weights = all.reg.weight_vector + ((size_t)b.shard_begin << stride_shift);
+  size_t mem_stride = b.mem_stride;
   
-  float* mem0 = mem;
-  float* w0 = w;
-
   // implement conjugate gradient
   if (all.m==0) {
     double g_Hy = 0.;
     double g_Hg = 0.;
-    double y = 0.;
+    size_t mem_gt = (MEM_GT+origin)%mem_stride;
   
-    for(uint32_t i = 0; i < length; i++, mem+=b.mem_stride, w+=stride) {
-      y = w[W_GT]-mem[(MEM_GT+origin)%b.mem_stride];
+    PARALLEL(omp parallel for reduction(+:g_Hy,g_Hg))
+    for(uint32_t i = 0; i < length; i++) {
+      float* m = mem + (size_t)i*mem_stride;
+      weight* w = weights + ((size_t)i << stride_shift);
+      double y = w[W_GT]-m[mem_gt];
       g_Hy += w[W_GT] * w[W_COND] * y;
-      g_Hg += mem[(MEM_GT+origin)%b.mem_stride] * w[W_COND] * mem[(MEM_GT+origin)%b.mem_stride];
+      g_Hg += m[mem_gt] * w[W_COND] * m[mem_gt];
     }
+    double sums[2] = {g_Hy, g_Hg};
+    sum_over_shards(all, b, sums, 2);
+    g_Hy = sums[0];
+    g_Hg = sums[1];
 
     float beta = (float) (g_Hy/g_Hg);
 
     if (beta<0.f || nanpattern(beta))
       beta = 0.f;
       
-    mem = mem0;
-    w = w0;
-    for(uint32_t i = 0; i < length; i++, mem+=b.mem_stride, w+=stride) {
-      mem[(MEM_GT+origin)%b.mem_stride] = w[W_GT];
+    PARALLEL(omp parallel for)
+    for(uint32_t i = 0; i < length; i++) {
+      float* m = mem + (size_t)i*mem_stride;
+      weight* w = weights + ((size_t)i << stride_shift);
+      m[mem_gt] = w[W_GT];
 
       w[W_DIR] *= beta;
       w[W_DIR] -= w[W_COND]*w[W_GT];
       w[W_GT] = 0;
     }
+    gather_direction(all, b);
     if (!all.quiet)
       fprintf(stderr, "%f\t", beta);
     return;
@@ -310,15 +387,27 @@ void bfgs_iter_middle(vw& all, bfgs& b, float* mem, double* rho, double* alpha,
   double y_s = 0.;
   double y_Hy = 0.;
   double s_q = 0.;
+  size_t mem_yt = (MEM_YT+origin)%mem_stride;
+  size_t mem_st = (MEM_ST+origin)%mem_stride;
+  size_t mem_gt = (MEM_GT+origin)%mem_stride;
+  size_t mem_xt = (MEM_XT+origin)%mem_stride;
   
-  for(uint32_t i = 0; i < length; i++, mem+=b.mem_stride, w+=stride) {
-    mem[(MEM_YT+origin)%b.mem_stride] = w[W_GT] - mem[(MEM_GT+origin)%b.mem_stride];
-    mem[(MEM_ST+origin)%b.mem_stride] = w[W_XT] - mem[(MEM_XT+origin)%b.mem_stride];
+  PARALLEL(omp parallel for reduction(+:y_s,y_Hy,s_q))
+  for(uint32_t i = 0; i < length; i++) {
+    float* m = mem + (size_t)i*mem_stride;
+    weight* w = weights + ((size_t)i << stride_shift);
+    m[mem_yt] = w[W_GT] - m[mem_gt];
+    m[mem_st] = w[W_XT] - m[mem_xt];
     w[W_DIR] = w[W_GT];
-    y_s += mem[(MEM_YT+origin)%b.mem_stride]*mem[(MEM_ST+origin)%b.mem_stride];
-    y_Hy += mem[(MEM_YT+origin)%b.mem_stride]*mem[(MEM_YT+origin)%b.mem_stride]*w[W_COND];
-    s_q += mem[(MEM_ST+origin)%b.mem_stride]*w[W_GT];  
+    y_s += m[mem_yt]*m[mem_st];
+    y_Hy += m[mem_yt]*m[mem_yt]*w[W_COND];
+    s_q += m[mem_st]*w[W_GT];  
   }
+  double sums[3] = {y_s, y_Hy, s_q};
+  sum_over_shards(all, b, sums, 3);
+  y_s = sums[0];
+  y_Hy = sums[1];
+  s_q = sums[2];
   
   if (y_s <= 0. || y_Hy <= 0.)
     throw curv_ex;
@@ -329,78 +418,108 @@ void bfgs_iter_middle(vw& all, bfgs& b, float* mem, double* rho, double* alpha,
   for (int j=0; j<lastj; j++) {
     alpha[j] = rho[j] * s_q;
     s_q = 0.;
-    mem = mem0;
-    w = w0;
-    for(uint32_t i = 0; i < length; i++, mem+=b.mem_stride, w+=stride) {
-      w[W_DIR] -= (float)alpha[j]*mem[(2*j+MEM_YT+origin)%b.mem_stride];
-      s_q += mem[(2*j+2+MEM_ST+origin)%b.mem_stride]*w[W_DIR];
+    float a = (float)alpha[j];
+    size_t y_j = (2*j+MEM_YT+origin)%mem_stride;
+    size_t s_next = (2*j+2+MEM_ST+origin)%mem_stride;
+    PARALLEL(omp parallel for reduction(+:s_q))
+    for(uint32_t i = 0; i < length; i++) {
+      float* m = mem + (size_t)i*mem_stride;
+      weight* w = weights + ((size_t)i << stride_shift);
+      w[W_DIR] -= a*m[y_j];
+      s_q += m[s_next]*w[W_DIR];
     }
+    sum_over_shards(all, b, &s_q, 1);
   }
 
   alpha[lastj] = rho[lastj] * s_q;
   double y_r = 0.;  
-  mem = mem0;
-  w = w0;
-  for(uint32_t i = 0; i < length; i++, mem+=b.mem_stride, w+=stride) {
-    w[W_DIR] -= (float)alpha[lastj]*mem[(2*lastj+MEM_YT+origin)%b.mem_stride];
+  float a = (float)alpha[lastj];
+  size_t y_last = (2*lastj+MEM_YT+origin)%mem_stride;
+  PARALLEL(omp parallel for reduction(+:y_r))
+  for(uint32_t i = 0; i < length; i++) {
+    float* m = mem + (size_t)i*mem_stride;
+    weight* w = weights + ((size_t)i << stride_shift);
+    w[W_DIR] -= a*m[y_last];
     w[W_DIR] *= gamma*w[W_COND];
-    y_r += mem[(2*lastj+MEM_YT+origin)%b.mem_stride]*w[W_DIR];
+    y_r += m[y_last]*w[W_DIR];
   }
+  sum_over_shards(all, b, &y_r, 1);
 
   double coef_j;
     
   for (int j=lastj; j>0; j--) {
     coef_j = alpha[j] - rho[j] * y_r;
     y_r = 0.;
-    mem = mem0;
-    w = w0;
-    for(uint32_t i = 0; i < length; i++, mem+=b.mem_stride, w+=stride) {
-      w[W_DIR] += (float)coef_j*mem[(2*j+MEM_ST+origin)%b.mem_stride];
-      y_r += mem[(2*j-2+MEM_YT+origin)%b.mem_stride]*w[W_DIR];
+    float c = (float)coef_j;
+    size_t s_j = (2*j+MEM_ST+origin)%mem_stride;
+    size_t y_prev = (2*j-2+MEM_YT+origin)%mem_stride;
+    PARALLEL(omp parallel for reduction(+:y_r))
+    for(uint32_t i = 0; i < length; i++) {
+      float* m = mem + (size_t)i*mem_stride;
+      weight* w = weights + ((size_t)i << stride_shift);
+      w[W_DIR] += c*m[s_j];
+      y_r += m[y_prev]*w[W_DIR];
     }
+    sum_over_shards(all, b, &y_r, 1);
   }
 
 
   coef_j = alpha[0] - rho[0] * y_r;
-  mem = mem0;
-  w = w0;
-  for(uint32_t i = 0; i < length; i++, mem+=b.mem_stride, w+=stride) {
-    w[W_DIR] = -w[W_DIR]-(float)coef_j*mem[(MEM_ST+origin)%b.mem_stride];
+  float c = (float)coef_j;
+  PARALLEL(omp parallel for)
+  for(uint32_t i = 0; i < length; i++) {
+    float* m = mem + (size_t)i*mem_stride;
+    weight* w = weights + ((size_t)i << stride_shift);
+    w[W_DIR] = -w[W_DIR]-c*m[mem_st];
   }
   
   /*********************
    ** shift 
    ********************/
 
-  mem = mem0;
-  w = w0;
   lastj = (lastj<all.m-1) ? lastj+1 : all.m-1;
-  origin = (origin+b.mem_stride-2)%b.mem_stride;
-  for(uint32_t i = 0; i < length; i++, mem+=b.mem_stride, w+=stride) {
-    mem[(MEM_GT+origin)%b.mem_stride] = w[W_GT];
-    mem[(MEM_XT+origin)%b.mem_stride] = w[W_XT];
+  origin = (origin+mem_stride-2)%mem_stride;
+  mem_gt = (MEM_GT+origin)%mem_stride;
+  mem_xt = (MEM_XT+origin)%mem_stride;
+  PARALLEL(omp parallel for)
+  for(uint32_t i = 0; i < length; i++) {
+    float* m = mem + (size_t)i*mem_stride;
+    weight* w = weights + ((size_t)i << stride_shift);
+    m[mem_gt] = w[W_GT];
+    m[mem_xt] = w[W_XT];
     w[W_GT] = 0;
   }
   for (int j=lastj; j>0; j--)
     rho[j] = rho[j-1];
+  gather_direction(all, b);
 }
 
 double wolfe_eval(vw& all, bfgs& b, float* mem, double loss_sum, double previous_loss_sum, double step_size, double importance_weight_sum, int &origin, double& wolfe1) { 
-  uint32_t length = 1 << all.num_bits;
-  size_t stride = 1 << all.reg.stride_shift;
-  weight* w = all.reg.weight_vector;
+  uint32_t length = b.shard_end - b.shard_begin;
+  size_t stride_shift = all.reg.stride_shift;
+  weight* weights = all.reg.weight_vector + ((size_t)b.shard_begin << stride_shift);
   
   double g0_d = 0.;
   double g1_d = 0.;
   double g1_Hg1 = 0.;
   double g1_g1 = 0.;
+  size_t mem_gt = (MEM_GT+origin)%b.mem_stride;
   
-  for(uint32_t i = 0; i < length; i++, mem+=b.mem_stride, w+=stride) {
-    g0_d += mem[(MEM_GT+origin)%b.mem_stride] * w[W_DIR];
+  PARALLEL(omp parallel for reduction(+:g0_d,g1_d,g1_Hg1,g1_g1))
+  for(uint32_t i = 0; i < length; i++) {
+    float* m = mem + (size_t)i*b.mem_stride;
+    weight* w = weights + ((size_t)i << stride_shift);
+    g0_d += m[mem_gt] * w[W_DIR];
     g1_d += w[W_GT] * w[W_DIR];
     g1_Hg1 += w[W_GT] * w[W_GT] * w[W_COND];
     g1_g1 += w[W_GT] * w[W_GT];
   }
+  double sums[4] = {g0_d, g1_d, g1_Hg1, g1_g1};
+  sum_over_shards(all, b, sums, 4);
+  g0_d = sums[0];
+  g1_d = sums[1];
+  g1_Hg1 = sums[2];
+  g1_g1 = sums[3];
   
   wolfe1 = (loss_sum-previous_loss_sum)/(step_size*g0_d);
   double wolfe2 = g1_d/g0_d;
@@ -420,6 +539,7 @@ double add_regularization(vw& all, bfgs& b, float regularization)
   weight* weights = all.reg.weight_vector;
   if (b.regularizers == NULL)
     {
+      PARALLEL(omp parallel for reduction(+:ret))
       for(uint32_t i = 0; i < length; i++) {
 	weights[(i << stride_shift)+W_GT] += regularization*weights[i << stride_shift];
 	ret += 0.5*regularization*weights[i << stride_shift]*weights[i << stride_shift];
@@ -427,6 +547,7 @@ double add_regularization(vw& all, bfgs& b, float regularization)
     }
   else
     {
+      PARALLEL(omp parallel for reduction(+:ret))
       for(uint32_t i = 0; i < length; i++) {
 	weight delta_weight = weights[i << stride_shift] - b.regularizers[2*i+1];
 	weights[(i << stride_shift)+W_GT] += b.regularizers[2*i]*delta_weight;
@@ -445,6 +566,7 @@ void finalize_preconditioner(vw& all, bfgs& b, float regularization)
   float max_hessian = 0.f;
 
   if (b.regularizers == NULL)
+    PARALLEL(omp parallel for reduction(max:max_hessian))
     for(uint32_t i = 0; i < length; i++) {
       weights[stride*i+W_COND] += regularization;
 	  if (weights[stride*i+W_COND] > max_hessian)
@@ -453,6 +575,7 @@ void finalize_preconditioner(vw& all, bfgs& b, float regularization)
 	weights[stride*i+W_COND] = 1.f / weights[stride*i+W_COND];
     }
   else
+    PARALLEL(omp parallel for reduction(max:max_hessian))
     for(uint32_t i = 0; i < length; i++) {
       weights[stride*i+W_COND] += b.regularizers[2*i];
 	  if (weights[stride*i+W_COND] > max_hessian)
@@ -463,6 +586,7 @@ void finalize_preconditioner(vw& all, bfgs& b, float regularization)
 
   float max_precond = (max_hessian==0.f) ? 0.f : max_precond_ratio / max_hessian;
   weights = all.reg.weight_vector;
+  PARALLEL(omp parallel for)
   for(uint32_t i = 0; i < length; i++) {
     if (infpattern(weights[stride*i+W_COND]) || weights[stride*i+W_COND]>max_precond)
 			weights[stride*i+W_COND] = max_precond;
@@ -498,6 +622,7 @@ void zero_state(vw& all)
   uint32_t length = 1 << all.num_bits;
   size_t stride = 1 << all.reg.stride_shift;
   weight* weights = all.reg.weight_vector;
+  PARALLEL(omp parallel for)
   for(uint32_t i = 0; i < length; i++) 
     {
       weights[stride*i+W_GT] = 0;
@@ -509,23 +634,27 @@ void zero_state(vw& all)
 double derivative_in_direction(vw& all, bfgs& b, float* mem, int &origin)
   {  
   double ret = 0.;
-  uint32_t length = 1 << all.num_bits;
-  size_t stride = 1 << all.reg.stride_shift;
-  weight* w = all.reg.weight_vector;
+  uint32_t length = b.shard_end - b.shard_begin;
+  size_t stride_shift = all.reg.stride_shift;
+  weight* weights = all.reg.weight_vector + ((size_t)b.shard_begin << stride_shift);
+  size_t mem_gt = (MEM_GT+origin)%b.mem_stride;
   
-  for(uint32_t i = 0; i < length; i++, w+=stride, mem+=b.mem_stride)
-    ret += mem[(MEM_GT+origin)%b.mem_stride]*w[W_DIR];
+  PARALLEL(omp parallel for reduction(+:ret))
+  for(uint32_t i = 0; i < length; i++)
+    ret += mem[(size_t)i*b.mem_stride+mem_gt]*weights[((size_t)i << stride_shift)+W_DIR];
+  sum_over_shards(all, b, &ret, 1);
   return ret;
 }
   
 void update_weight(vw& all, float step_size, size_t current_pass)
   {
     uint32_t length = 1 << all.num_bits;
-    size_t stride = 1 << all.reg.stride_shift;
-    weight* w = all.reg.weight_vector;
+    size_t stride_shift = all.reg.stride_shift;
+    weight* weights = all.reg.weight_vector;
     
-    for(uint32_t i = 0; i < length; i++, w+=stride)
-      w[W_XT] += step_size * w[W_DIR];
+    PARALLEL(omp parallel for)
+    for(uint32_t i = 0; i < length; i++)
+      weights[(i << stride_shift)+W_XT] += step_size * weights[(i << stride_shift)+W_DIR];
   }
 
 int process_pass(vw& all, bfgs& b) {
@@ -538,6 +667,11 @@ int process_pass(vw& all, bfgs& b) {
       if(all.span_server != "")
 	{
 	  accumulate(all, all.span_server, all.reg, W_COND); //Accumulate preconditioner
+	  if (b.sharded && all.socks.total != all.total)
+	    {
+	      cerr << "--shard_mem needs all " << all.total << " nodes, but the span server dropped some" << endl;
+	      throw exception();
+	    }
 	  float temp = (float)b.importance_weight_sum;
 	  b.importance_weight_sum = accumulate_scalar(all, all.span_server, temp);
 	}
@@ -758,10 +892,179 @@ void process_example(vw& all, bfgs& b, example& ec)
     update_preconditioner(all, ec);//w[3]
  }
 
+/* With --bfgs_threads, learn() only queues examples, and finishing them is put off until half the
+   parser's ring is queued.  The batch is then processed by all threads at once: the first one
+   accumulates into the weights as process_example() does, the others into their own buffers, which
+   are added in at the end of the pass.  Everything that touches shared state is done in order
+   before and after. */
+struct thread_sum {
+  float d;
+  float* buffer;
+  weight* weights;
+  size_t stride_shift;
+};
+
+inline void add_grad_to_buffer(thread_sum& s, float f, float& fw)
+{
+  s.buffer[(&fw - s.weights) >> s.stride_shift] += s.d * f;
+}
+
+inline void add_precond_to_buffer(thread_sum& s, float f, float& fw)
+{
+  s.buffer[(&fw - s.weights) >> s.stride_shift] += s.d * f * f;
+}
+
+void queue_example(vw& all, bfgs& b, example& ec)
+{
+  label_data* ld = (label_data*)ec.ld;
+  batched_example be = {&ec, TRAIN, 0};
+  if (b.current_pass > b.final_pass)
+    be.kind = SKIP;
+  else if (ec.test_only)
+    be.kind = TEST;
+  else if (test_example(ec))
+    be.kind = PREDICT;
+  else
+    {
+      if (b.first_pass)
+	b.importance_weight_sum += ld->weight;
+      if (!b.gradient_pass)
+	{
+	  if (b.example_number >= b.predictions.size())//Make things safe in case example source is strange.
+	    b.example_number = b.predictions.size()-1;
+	  be.number = b.example_number++;
+	}
+    }
+  b.batch.push_back(be);
+}
+
+void process_batched(vw& all, bfgs& b, batched_example& be, int thread)
+{
+  example& ec = *be.ec;
+  label_data* ld = (label_data*)ec.ld;
+  if (be.kind == SKIP)
+    return;
+  if (be.kind != TRAIN)
+    {
+      ld->prediction = bfgs_predict(all, ec);
+      if (be.kind == TEST)
+	ec.loss = all.loss->getLoss(all.sd, ld->prediction, ld->label) * ld->weight;
+      return;
+    }
+
+  size_t length = (size_t)1 << all.num_bits;
+  thread_sum s = {0.f, NULL, all.reg.weight_vector, all.reg.stride_shift};
+  if (thread > 0)
+    s.buffer = b.thread_buffers + 2*length*(thread-1);
+  if (b.gradient_pass)
+    {
+      ld->prediction = bfgs_predict(all, ec);
+      s.d = all.loss->first_derivative(all.sd, ld->prediction, ld->label)*ld->weight;
+      if (thread == 0)
+	{
+	  ec.ft_offset += W_GT;
+	  GD::foreach_feature<float,add_grad>(all, ec, s.d);
+	  ec.ft_offset -= W_GT;
+	}
+      else
+	GD::foreach_feature<thread_sum,add_grad_to_buffer>(all, ec, s);
+      ec.loss = all.loss->getLoss(all.sd, ld->prediction, ld->label) * ld->weight;
+    }
+  else
+    {
+      float d_dot_x = dot_with_direction(all, ec);
+      ld->prediction = b.predictions[be.number];
+      ec.partial_prediction = b.predictions[be.number];
+      ec.loss = all.loss->getLoss(all.sd, ld->prediction, ld->label) * ld->weight;
+      float sd = all.loss->second_derivative(all.sd, ld->prediction, ld->label);
+      b.thread_curvature[thread] += d_dot_x*d_dot_x*sd*ld->weight;
+    }
+
+  if (b.preconditioner_pass)
+    {
+      if (thread == 0)
+	update_preconditioner(all, ec);
+      else
+	{
+	  s.d = all.loss->second_derivative(all.sd, ld->prediction, ld->label) * ld->weight;
+	  s.buffer += length;
+	  GD::foreach_feature<thread_sum,add_precond_to_buffer>(all, ec, s);
+	}
+    }
+}
+
+void flush_batch(vw& all, bfgs& b)
+{
+  int count = (int)b.batch.size();
+  for (int t = 0; t < b.threads; t++)
+    b.thread_curvature[t] = 0.;
+  PARALLEL(omp parallel for schedule(static))
+  for (int k = 0; k < count; k++)
+    {
+#ifdef _OPENMP
+      int thread = omp_get_thread_num();
+#else
+      int thread = 0;
+#endif
+      process_batched(all, b, b.batch[k], thread);
+    }
+  for (int t = 0; t < b.threads; t++)
+    b.curvature += b.thread_curvature[t];
+
+  for (int k = 0; k < count; k++)
+    {
+      example& ec = *b.batch[k].ec;
+      label_data* ld = (label_data*)ec.ld;
+      if (b.batch[k].kind == TRAIN && b.gradient_pass)
+	{
+	  all.set_minmax(all.sd, ld->label);
+	  b.loss_sum += ec.loss;
+	  b.predictions.push_back(ld->prediction);
+	}
+      return_simple_example(all, NULL, ec);
+    }
+  b.batch.erase();
+}
+
+void add_thread_buffers(vw& all, bfgs& b)
+{
+  uint32_t length = 1 << all.num_bits;
+  size_t stride_shift = all.reg.stride_shift;
+  weight* weights = all.reg.weight_vector;
+  PARALLEL(omp parallel for)
+  for (uint32_t i = 0; i < length; i++)
+    for (int t = 1; t < b.threads; t++)
+      {
+	float* buffer = b.thread_buffers + 2*(size_t)length*(t-1);
+	weights[(i << stride_shift)+W_GT] += buffer[i];
+	weights[(i << stride_shift)+W_COND] += buffer[length+i];
+	buffer[i] = buffer[length+i] = 0.f;
+      }
+}
+
+void finish_example(vw& all, bfgs& b, example& ec)
+{
+  if (!b.batching)
+    return_simple_example(all, NULL, ec);
+  else if (b.batch.size() >= all.p->ring_size / 2)
+    flush_batch(all, b);
+}
+
+void end_examples(bfgs& b)
+{
+  if (b.batching)
+    flush_batch(*b.all, b);
+}
+
 void end_pass(bfgs& b)
 {
   vw* all = b.all;
   
+  if (b.batching)
+    flush_batch(*all, b);
+  if (b.threads > 1)
+    add_thread_buffers(*all, b);
+
   if (b.current_pass <= b.final_pass) 
   {
        if(b.current_pass < b.final_pass)
@@ -828,7 +1131,9 @@ void learn(bfgs& b, learner& base, example& ec)
   vw* all = b.all;
   assert(ec.in_use);
 
-  if (b.current_pass <= b.final_pass)
+  if (b.batching)
+    queue_example(*all, b, ec);
+  else if (b.current_pass <= b.final_pass)
     {
       if(ec.test_only)
 	{ 
@@ -849,6 +1154,9 @@ void finish(bfgs& b)
   free(b.mem);
   free(b.rho);
   free(b.alpha);
+  b.batch.delete_v();
+  free(b.thread_buffers);
+  free(b.thread_curvature);
 }
 
 void save_load_regularizer(vw& all, bfgs& b, io_buf& model_file, bool read, bool text)
@@ -920,14 +1228,24 @@ void save_load(bfgs& b, io_buf& model_file, bool read, bool text)
 	}
       int m = all->m;
       
+      b.shard_begin = 0;
+      b.shard_end = length;
+      if (b.sharded)
+	{
+	  b.shard_begin = (uint32_t)((uint64_t)length * all->node / all->total);
+	  b.shard_end = (uint32_t)((uint64_t)length * (all->node + 1) / all->total);
+	}
+      size_t shard_length = b.shard_end - b.shard_begin;
       b.mem_stride = (m==0) ? CG_EXTRA : 2*m;
-      b.mem = (float*) malloc(sizeof(float)*all->length()*(b.mem_stride));
+      b.mem = (float*) malloc(sizeof(float)*shard_length*(b.mem_stride));
       b.rho = (double*) malloc(sizeof(double)*m);
+      if (b.threads > 1 && b.thread_buffers == NULL)
+	b.thread_buffers = (float*)calloc_or_die(2*(size_t)length*(b.threads-1), sizeof(float));
       b.alpha = (double*) malloc(sizeof(double)*m);
       
       if (!all->quiet) 
 	{
-	  fprintf(stderr, "m = %d\nAllocated %luM for weights and mem\n", m, (long unsigned int)all->length()*(sizeof(float)*(b.mem_stride)+(sizeof(weight) << all->reg.stride_shift)) >> 20);
+	  fprintf(stderr, "m = %d\nAllocated %luM for weights and mem\n", m, (long unsigned int)(shard_length*sizeof(float)*b.mem_stride+(all->length()*sizeof(weight) << all->reg.stride_shift)) >> 20);
 	}
       
       b.net_time = 0.0;
@@ -968,6 +1286,7 @@ void save_load(bfgs& b, io_buf& model_file, bool read, bool text)
   void init_driver(bfgs& b)
   {
     b.backstep_on = true;
+    b.batching = b.threads > 1 && b.all->l == b.l;
   }
 
 learner* setup(vw& all, po::variables_map& vm)
@@ -983,6 +1302,7 @@ learner* setup(vw& all, po::variables_map& vm)
   b->final_pass=all.numpasses;  
   b->no_win_counter = 0;
   b->early_stop_thres = 3;
+  b->threads = 1;
 
   po::options_description bfgs_opts("LBFGS options");
 
@@ -990,6 +1310,8 @@ learner* setup(vw& all, po::variables_map& vm)
     ("hessian_on", "use second derivative in line search")
     ("mem", po::value<int>(&(all.m)), "memory in bfgs")
     ("conjugate_gradient", "use conjugate gradient based optimization")
+    ("bfgs_threads", po::value<int>(&(b->threads)), "threads to split passes and vector operations among (needs a build with OpenMP)")
+    ("shard_mem", "with --span_server, each node keeps the history of only its slice of the weights, dividing that memory by the node count")
     ("termination", po::value<float>(&(all.rel_threshold)),"Termination threshold");
 
   vm = add_options(all, bfgs_opts);
@@ -1004,6 +1326,24 @@ learner* setup(vw& all, po::variables_map& vm)
   if (vm.count("hessian_on") || all.m==0) {
     all.hessian_on = true;
   }
+  if (b->threads < 1)
+    b->threads = 1;
+#ifdef _OPENMP
+  omp_set_num_threads(b->threads);
+#else
+  if (b->threads > 1)
+    {
+      cerr << "warning: vw was built without OpenMP, so --bfgs_threads is ignored" << endl;
+      b->threads = 1;
+    }
+#endif
+  b->thread_curvature = (double*)calloc_or_die(b->threads, sizeof(double));
+  b->sharded = vm.count("shard_mem") > 0;
+  if (b->sharded && all.span_server == "")
+    {
+      cerr << "--shard_mem needs --span_server" << endl;
+      throw exception();
+    }
   if (!all.quiet) {
     if (all.m>0)
       cerr << "enabling BFGS based optimization ";
@@ -1024,12 +1364,15 @@ learner* setup(vw& all, po::variables_map& vm)
   all.reg.stride_shift = 2;
 
   learner* l = new learner(b, 1 << all.reg.stride_shift);
+  b->l = l;
   l->set_learn<bfgs, learn>();
   l->set_predict<bfgs, predict>();
   l->set_save_load<bfgs,save_load>();
   l->set_init_driver<bfgs,init_driver>();
   l->set_end_pass<bfgs,end_pass>();
   l->set_finish<bfgs,finish>();
+  l->set_finish_example<bfgs,finish_example>();
+  l->set_end_examples<bfgs,end_examples>();
 
   return l;
 }
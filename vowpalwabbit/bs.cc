@@ -13,6 +13,7 @@ license as described in the file LICENSE.
 #include "simple_label.h"
 #include "rand48.h"
 #include "bs.h"
+#include "vw.h"
 
 using namespace std;
 using namespace LEARNER;
@@ -26,6 +27,7 @@ namespace BS {
     float ub;
     vector<double> pred_vec;
     vw* all;
+    VW::prediction* pred; //per round.
   };
 
   void bs_predict_mean(vw& all, example& ec, vector<double> &pred_vec)
@@ -144,20 +146,33 @@ namespace BS {
     stringstream outputStringStream(outputString);
     d.pred_vec.clear();
 
+    //all rounds are predicted in one pass over the features, and then updated one by one.
+    bool one_pass = !is_learn || base.multipredicts();
+    if (one_pass)
+      base.multipredict(ec, 0, d.B, d.pred);
+
     for (size_t i = 1; i <= d.B; i++)
       {
         ((label_data*)ec.ld)->weight = weight_temp * (float) weight_gen();
 
-	if (is_learn)
-	  base.learn(ec, i-1);
-	else
-	  base.predict(ec, i-1);
+	if (!one_pass)
+	  {
+	    base.learn(ec, i-1);
+	    d.pred[i-1].partial_prediction = ec.partial_prediction;
+	    d.pred[i-1].value = ((label_data*)ec.ld)->prediction;
+	  }
+	else if (is_learn)
+	  {
+	    ec.partial_prediction = d.pred[i-1].partial_prediction;
+	    ((label_data*)ec.ld)->prediction = d.pred[i-1].value;
+	    base.update(ec, i-1);
+	  }
 
-        d.pred_vec.push_back(((label_data*)ec.ld)->prediction);
+        d.pred_vec.push_back(d.pred[i-1].value);
 
         if (shouldOutput) {
           if (i > 1) outputStringStream << ' ';
-          outputStringStream << i << ':' << ec.partial_prediction;
+          outputStringStream << i << ':' << d.pred[i-1].partial_prediction;
         }
       }	
 
@@ -190,6 +205,7 @@ namespace BS {
   void finish(bs& d)
   {
     d.pred_vec.~vector();
+    free(d.pred);
   }
 
   learner* setup(vw& all, po::variables_map& vm)
@@ -235,6 +251,7 @@ namespace BS {
 
     data->pred_vec.reserve(data->B);
     data->all = &all;
+    data->pred = (VW::prediction*)calloc_or_die(data->B, sizeof(VW::prediction));
 
     learner* l = new learner(data, all.l, data->B);
     l->set_learn<bs, predict_or_learn<true> >();
@@ -35,7 +35,7 @@ size_t read_cached_tag(io_buf& cache, example* ae)
   if (buf_read(cache, c, tag_size) < tag_size) 
     return 0;
   
-  ae->tag.erase();
+  ae->tag.clear();
   push_many(ae->tag, c, tag_size);
   return tag_size+sizeof(tag_size);
 }
@@ -80,8 +80,8 @@ int read_cached_features(void* in, example* ec)
       index = *(unsigned char*)c;
       c+= sizeof(index);
       ae->indices.push_back((size_t)index);
-      v_array<feature>* ours = ae->atomics+index;
-      float* our_sum_feat_sq = ae->sum_feat_sq+index;
+      v_array<feature>* ours = &ae->atomics(index);
+      float* our_sum_feat_sq = &ae->sum_feat_sq(index);
       size_t storage = *(size_t *)c;
       c += sizeof(size_t);
       all->p->input->set(c);
@@ -198,5 +198,5 @@ void cache_features(io_buf& cache, example* ae, uint32_t mask)
   cache_tag(cache,ae->tag);
   output_byte(cache, (unsigned char) ae->indices.size());
   for (unsigned char* b = ae->indices.begin; b != ae->indices.end; b++)
-    output_features(cache, *b, ae->atomics[*b].begin,ae->atomics[*b].end, mask);
+    output_features(cache, *b, ae->atomics(*b).begin,ae->atomics(*b).end, mask);
 }
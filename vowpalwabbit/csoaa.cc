@@ -9,6 +9,8 @@ license as described in the file LICENSE.
 #include "cost_sensitive.h"
 #include "simple_label.h"
 #include "v_hashmap.h"
+#include "vw.h"
+#include "rand48.h"
 
 using namespace std;
 
@@ -19,8 +21,57 @@ using namespace COST_SENSITIVE;
 namespace CSOAA {
   struct csoaa{
     vw* all;
+    uint32_t k;
+    VW::prediction* pred; //per class.
+    bool* updated; //per class, set once the current example updated it, as a class may be listed twice.
+
+    uint32_t negatives; //with --csoaa_negatives.
+    bool warned; //that an example had too few other classes to sample.
+    v_array<wclass*> sampled;
+    v_array<float> importance; //per sampled class.
+    v_array<wclass*> rest;
   };
 
+  //the least costly classes, and c.negatives of the others drawn uniformly, weighted to stand for all of them.
+  bool sample_costs(csoaa& c, label& ld)
+  {
+    float least = FLT_MAX;
+    for (wclass *cl = ld.costs.begin; cl != ld.costs.end; cl ++)
+      least = min(least, cl->x);
+    if (least == FLT_MAX)
+      return false;
+    c.sampled.erase();
+    c.importance.erase();
+    c.rest.erase();
+    for (wclass *cl = ld.costs.begin; cl != ld.costs.end; cl ++)
+      if (cl->x == least)
+	{
+	  c.sampled.push_back(cl);
+	  c.importance.push_back(1.);
+	}
+      else if (cl->x != FLT_MAX)
+	c.rest.push_back(cl);
+    size_t rest = c.rest.size();
+    if (rest <= c.negatives)
+      {
+	if (!c.warned && !c.all->quiet)
+	  cerr << "warning: examples with no more than --csoaa_negatives " << c.negatives << " other classes update all of them" << endl;
+	c.warned = true;
+	return false;
+      }
+    float importance = (float)rest / (float)c.negatives;
+    for (size_t j = 0; j < c.negatives; j++)
+      {
+	size_t r = min(j + (size_t)(frand48() * (rest - j)), rest - 1);
+	wclass* drawn = c.rest[r];
+	c.rest[r] = c.rest[j];
+	c.rest[j] = drawn;
+	c.sampled.push_back(drawn);
+	c.importance.push_back(importance);
+      }
+    return true;
+  }
+
   template <bool is_learn>
   void predict_or_learn(csoaa& c, learner& base, example& ec) {
     vw* all = c.all;
@@ -29,6 +80,44 @@ namespace CSOAA {
     float score = FLT_MAX;
     label_data simple_temp = { 0., 0., 0. };
     ec.ld = &simple_temp;
+
+    if (is_learn && c.negatives > 0 && all->training && !ec.test_only && sample_costs(c, *ld))
+      {
+	for (size_t j = 0; j < c.sampled.size(); j++)
+	  {
+	    wclass* cl = c.sampled[j];
+	    uint32_t i = cl->class_index;
+	    simple_temp.label = cl->x;
+	    simple_temp.weight = c.importance[j];
+	    base.learn(ec, i-1);
+	    cl->partial_prediction = ec.partial_prediction;
+	    if (ec.partial_prediction < score || (ec.partial_prediction == score && i < prediction)) {
+	      score = ec.partial_prediction;
+	      prediction = i;
+	    }
+	  }
+	ec.partial_prediction = 0.;
+	ld->prediction = prediction;
+	ec.ld = ld;
+	return;
+      }
+
+    //when the costs cover most of a range of classes, predict the whole range in one pass over the features.
+    uint32_t first = c.k, last = 1;
+    for (wclass *cl = ld->costs.begin; cl != ld->costs.end; cl ++)
+      {
+	first = min(first, cl->class_index);
+	last = max(last, cl->class_index);
+      }
+    bool one_pass = base.multipredicts() && first >= 1 && last <= c.k && last - first < 2*ld->costs.size();
+    if (one_pass)
+      {
+	if (is_learn && all->training) //so the predictions are clipped to a range including every cost, as learning each would.
+	  for (wclass *cl = ld->costs.begin; cl != ld->costs.end; cl ++)
+	    all->set_minmax(all->sd, cl->x);
+	base.multipredict(ec, first-1, last-first+1, c.pred + first-1);
+      }
+
     for (wclass *cl = ld->costs.begin; cl != ld->costs.end; cl ++)
       {
         uint32_t i = cl->class_index;
@@ -44,8 +133,19 @@ namespace CSOAA {
 		simple_temp.label = cl->x;
 		simple_temp.weight = 1.;
 	      }
-	    base.learn(ec, i-1);
 	  }
+	if (one_pass && !c.updated[i-1])
+	  {
+	    ec.partial_prediction = c.pred[i-1].partial_prediction;
+	    if (is_learn)
+	      {
+		simple_temp.prediction = c.pred[i-1].value;
+		base.update(ec, i-1);
+		c.updated[i-1] = true;
+	      }
+	  }
+	else if (is_learn)
+	  base.learn(ec, i-1);
 	else
 	  base.predict(ec, i-1);
 
@@ -56,6 +156,9 @@ namespace CSOAA {
         }
 	ec.partial_prediction = 0.;
       }
+    if (one_pass && is_learn)
+      for (wclass *cl = ld->costs.begin; cl != ld->costs.end; cl ++)
+	c.updated[cl->class_index-1] = false;
     ld->prediction = prediction;
     ec.ld = ld;
   }
@@ -66,6 +169,15 @@ namespace CSOAA {
     VW::finish_example(all, &ec);
   }
 
+  void finish(csoaa& c)
+  {
+    free(c.pred);
+    free(c.updated);
+    c.sampled.delete_v();
+    c.importance.delete_v();
+    c.rest.delete_v();
+  }
+
   learner* setup(vw& all, po::variables_map& vm)
   {
     csoaa* c=(csoaa*)calloc_or_die(1,sizeof(csoaa));
@@ -75,6 +187,20 @@ namespace CSOAA {
 
     nb_actions = (uint32_t)vm["csoaa"].as<size_t>();
 
+    //after the above, as reparsing drops the --csoaa that cb and search put in vm for us.
+    po::options_description csoaa_opts("CSOAA options");
+    csoaa_opts.add_options()
+      ("csoaa_negatives", po::value<size_t>(), "when learning, update the least costly classes and only this many sampled others; the progressive loss then scores only those, while holdout examples score every class");
+    po::variables_map vm_negatives = add_options(all, csoaa_opts);
+    if (vm_negatives.count("csoaa_negatives"))
+      {
+	if (vm_negatives["csoaa_negatives"].as<size_t>() + 1 < nb_actions)
+	  c->negatives = (uint32_t)vm_negatives["csoaa_negatives"].as<size_t>();
+	else
+	  cerr << "warning: --csoaa_negatives " << vm_negatives["csoaa_negatives"].as<size_t>() << " leaves none of the other "
+	       << nb_actions - 1 << " classes out; learning updates every class" << endl;
+      }
+
     //append csoaa with nb_actions to file_options so it is saved to regressor later
     std::stringstream ss;
     ss << " --csoaa " << nb_actions;
@@ -82,20 +208,32 @@ namespace CSOAA {
 
     all.p->lp = cs_label;
     all.sd->k = nb_actions;
+    c->k = nb_actions;
+    c->pred = (VW::prediction*)calloc_or_die(nb_actions, sizeof(VW::prediction));
+    c->updated = (bool*)calloc_or_die(nb_actions, sizeof(bool));
 
     learner* l = new learner(c, all.l, nb_actions);
     l->set_learn<csoaa, predict_or_learn<true> >();
     l->set_predict<csoaa, predict_or_learn<false> >();
     l->set_finish_example<csoaa,finish_example>();
+    l->set_finish<csoaa,finish>();
     return l;
   }
 }
 
 namespace CSOAA_AND_WAP_LDF {
 
+  struct label_span { //of a label's features in ldf.label_feature_arena.
+    size_t start;
+    size_t size;
+  };
+
   struct ldf {
     v_array<example*> ec_seq;
-    v_hashmap< size_t, v_array<feature> > label_features;
+    v_hashmap< size_t, label_span > label_features;
+    v_array<feature> label_feature_arena; //every label's features, one after another.
+    bool score_labels_apart; //when label features are scored on label_ec instead of added to the example.
+    example* label_ec;
 
     size_t read_example_this_loop;
     bool need_to_clear;
@@ -106,6 +244,9 @@ namespace CSOAA_AND_WAP_LDF {
     float csoaa_example_t;
     vw* all;
 
+    bool header_merged; //false while the header's features are scored apart from the actions'.
+    float shared_score; //of the header's features, added to every action's when not merged.
+
     learner* base;
   };
 
@@ -152,18 +293,18 @@ namespace LabelDict {
     size_t numf = features.size();
     ec.num_features -= numf;
 
-    assert (ec.atomics[(size_t)ns].size() >= numf);
-    if (ec.atomics[(size_t)ns].size() == numf) { // did NOT have ns
+    assert (ec.atomics((size_t)ns).size() >= numf);
+    if (ec.atomics((size_t)ns).size() == numf) { // did NOT have ns
       assert(ec.indices.size() > 0);
       assert(ec.indices[ec.indices.size()-1] == (size_t)ns);
       ec.indices.pop();
-      ec.total_sum_feat_sq -= ec.sum_feat_sq[(size_t)ns];
-      ec.atomics[(size_t)ns].erase();
-      ec.sum_feat_sq[(size_t)ns] = 0.;
+      ec.total_sum_feat_sq -= ec.sum_feat_sq((size_t)ns);
+      ec.atomics((size_t)ns).erase();
+      ec.sum_feat_sq((size_t)ns) = 0.;
     } else { // DID have ns
       for (feature*f=features.begin; f!=features.end; f++) {
-        ec.sum_feat_sq[(size_t)ns] -= f->x * f->x;
-        ec.atomics[(size_t)ns].pop();
+        ec.sum_feat_sq((size_t)ns) -= f->x * f->x;
+        ec.atomics((size_t)ns).pop();
       }
     }
   }
@@ -177,19 +318,19 @@ namespace LabelDict {
       }
     }
     if (has_ns) {
-      ec.total_sum_feat_sq -= ec.sum_feat_sq[(size_t)ns];
+      ec.total_sum_feat_sq -= ec.sum_feat_sq((size_t)ns);
     } else {
       ec.indices.push_back((size_t)ns);
-      ec.sum_feat_sq[(size_t)ns] = 0;
+      ec.sum_feat_sq((size_t)ns) = 0;
     }
 
     for (feature*f=features.begin; f!=features.end; f++) {
-      ec.sum_feat_sq[(size_t)ns] += f->x * f->x;
-      ec.atomics[(size_t)ns].push_back(*f);
+      ec.sum_feat_sq((size_t)ns) += f->x * f->x;
+      ec.atomics((size_t)ns).push_back(*f);
     }
 
     ec.num_features += features.size();
-    ec.total_sum_feat_sq += ec.sum_feat_sq[(size_t)ns];
+    ec.total_sum_feat_sq += ec.sum_feat_sq((size_t)ns);
   }
 
 
@@ -197,7 +338,7 @@ namespace LabelDict {
   void add_example_namespaces_from_example(example& target, example& source) {
     for (unsigned char* idx=source.indices.begin; idx!=source.indices.end; idx++) {
       if (*idx == constant_namespace) continue;
-      add_example_namespace(target, (char)*idx, source.atomics[*idx]);
+      add_example_namespace(target, (char)*idx, source.atomics(*idx));
     }
   }
 
@@ -207,41 +348,118 @@ namespace LabelDict {
     idx--;
     for (; idx>=source.indices.begin; idx--) {
       if (*idx == constant_namespace) continue;
-      del_example_namespace(target, (char)*idx, source.atomics[*idx]);
+      del_example_namespace(target, (char)*idx, source.atomics(*idx));
     }
   }
 
+  // a view into the arena, valid until the next label definition.
+  v_array<feature> label_features_of(ldf& l, size_t lab) {
+    label_span span = l.label_features.get(lab, hash_lab(lab));
+    v_array<feature> features;
+    features.begin = l.label_feature_arena.begin + span.start;
+    features.end = features.end_array = features.begin + span.size;
+    return features;
+  }
+
   void add_example_namespace_from_memory(ldf& l, example& ec, size_t lab) {
-    size_t lab_hash = hash_lab(lab);
-    v_array<feature> features = l.label_features.get(lab, lab_hash);
+    v_array<feature> features = label_features_of(l, lab);
     if (features.size() == 0) return;
     add_example_namespace(ec, 'l', features);
   }
 
   void del_example_namespace_from_memory(ldf& l, example& ec, size_t lab) {
-    size_t lab_hash = hash_lab(lab);
-    v_array<feature> features = l.label_features.get(lab, lab_hash);
+    v_array<feature> features = label_features_of(l, lab);
     if (features.size() == 0) return;
     del_example_namespace(ec, 'l', features);
   }
 
-  void set_label_features(ldf& l, size_t lab, v_array<feature>features) {
+  // the score that lab's features add to ec's, without adding them to ec.
+  float label_score(ldf& l, learner& base, example& ec, size_t lab) {
+    v_array<feature> features = label_features_of(l, lab);
+    if (features.size() == 0) return 0.;
+    example& lec = *l.label_ec;
+    lec.atomics((size_t)'l') = features;
+    lec.ft_offset = ec.ft_offset;
+    label_data* simple_label = (label_data*)lec.ld;
+    simple_label->initial = 0.;
+    simple_label->label = FLT_MAX;
+    simple_label->weight = 0.;
+    lec.partial_prediction = 0.;
+    base.predict(lec);
+    lec.atomics((size_t)'l') = v_array<feature>(); //it doesn't own the arena.
+    return lec.partial_prediction;
+  }
+
+  void set_label_features(ldf& l, size_t lab, v_array<feature>& features) {
     size_t lab_hash = hash_lab(lab);
     if (l.label_features.contains(lab, lab_hash)) { return; }
-    l.label_features.put_after_get(lab, lab_hash, features);
+    label_span span = { l.label_feature_arena.size(), features.size() };
+    push_many(l.label_feature_arena, features.begin, features.size());
+    l.label_features.put_after_get(lab, lab_hash, span);
   }
 
-  void free_label_features(ldf& l) {
-    void* label_iter = l.label_features.iterator();
-    while (label_iter != NULL) {
-      v_array<feature> *features = l.label_features.iterator_get_value(label_iter);
-      features->erase();
-      features->delete_v();
+  bool crosses(std::vector<std::string>& interactions, example& shared, example& action) {
+    for (size_t i=0; i<interactions.size(); i++) {
+      bool in_shared = false, in_action = false;
+      for (size_t j=0; j<interactions[i].size(); j++) {
+        unsigned char ns = (unsigned char)interactions[i][j];
+        in_shared |= (ns != constant_namespace) && (shared.atomics(ns).size() > 0);
+        in_action |= (ns == 'l') || (action.atomics(ns).size() > 0); // label features may come from memory
+      }
+      if (in_shared && in_action) return true;
+    }
+    return false;
+  }
 
-      label_iter = l.label_features.iterator_next(label_iter);
+  // When no interaction crosses the header's features with an action's, an action's score is its own
+  // plus that of the header's features, so the header is scored once here instead of being merged into
+  // every action to predict.  This needs a linear base, which multipredicts() tells.
+  bool score_header_apart(vw& all, ldf& l, learner& base) {
+    example& header = *l.ec_seq[0];
+    if (!base.multipredicts() || all.audit || all.hash_inv) return false;
+    bool has_constant = header.atomics(constant_namespace).size() > 0;
+    if (has_constant && (header.indices.size() == 0 || header.indices.last() != constant_namespace)) return false;
+    for (size_t k=1; k<l.ec_seq.size(); k++) {
+      example& action = *l.ec_seq[k];
+      if (action.ft_offset != l.ec_seq[1]->ft_offset) return false;
+      if (crosses(all.pairs, header, action) || crosses(all.triples, header, action)) return false;
     }
+
+    // the actions keep their own constant, as add_example_namespaces_from_example skips the header's.
+    void* ld = header.ld;
+    uint32_t ft_offset = header.ft_offset;
+    label_data simple_label;
+    simple_label.initial = 0.;
+    simple_label.label = FLT_MAX;
+    simple_label.weight = 0.;
+    header.ld = &simple_label;
+    header.ft_offset = l.ec_seq.size() > 1 ? l.ec_seq[1]->ft_offset : ft_offset;
+    header.partial_prediction = 0.;
+    if (has_constant) header.indices.decr();
+    base.predict(header);
+    if (has_constant) header.indices.end++;
+    header.ft_offset = ft_offset;
+    header.ld = ld;
+
+    l.shared_score = header.partial_prediction;
+    l.header_merged = false;
+    return true;
+  }
+
+  void merge_header(ldf& l) {
+    if (l.header_merged) return;
+    for (size_t k=1; k<l.ec_seq.size(); k++)
+      add_example_namespaces_from_example(*l.ec_seq[k], *l.ec_seq[0]);
+    l.shared_score = 0.;
+    l.header_merged = true;
+  }
+
+  void free_label_features(ldf& l) {
+    l.label_feature_arena.delete_v();
     l.label_features.clear();
     l.label_features.delete_v();
+    dealloc_example(NULL, *l.label_ec);
+    free(l.label_ec);
   }
 }
 
@@ -260,9 +478,9 @@ namespace LabelDict {
     size_t num_f = 0;
     for (unsigned char* i = ecsub->indices.begin; i != ecsub->indices.end; i++) {
       size_t feature_index = 0;
-      for (feature *f = ecsub->atomics[*i].begin; f != ecsub->atomics[*i].end; f++) {
+      for (feature *f = ecsub->atomics(*i).begin; f != ecsub->atomics(*i).end; f++) {
         feature temp = { -f->x, (uint32_t) (f->weight_index) };
-        ec->atomics[wap_ldf_namespace].push_back(temp);
+        ec->atomics(wap_ldf_namespace).push_back(temp);
         norm_sq += f->x * f->x;
         num_f ++;
 
@@ -279,7 +497,7 @@ namespace LabelDict {
       }
     }
     ec->indices.push_back(wap_ldf_namespace);
-    ec->sum_feat_sq[wap_ldf_namespace] = norm_sq;
+    ec->sum_feat_sq(wap_ldf_namespace) = norm_sq;
     ec->total_sum_feat_sq += norm_sq;
     ec->num_features += num_f;
   }
@@ -296,10 +514,10 @@ namespace LabelDict {
       return;
     }
 
-    ec->num_features -= ec->atomics[wap_ldf_namespace].size();
-    ec->total_sum_feat_sq -= ec->sum_feat_sq[wap_ldf_namespace];
-    ec->sum_feat_sq[wap_ldf_namespace] = 0;
-    ec->atomics[wap_ldf_namespace].erase();
+    ec->num_features -= ec->atomics(wap_ldf_namespace).size();
+    ec->total_sum_feat_sq -= ec->sum_feat_sq(wap_ldf_namespace);
+    ec->sum_feat_sq(wap_ldf_namespace) = 0;
+    ec->atomics(wap_ldf_namespace).erase();
     if (all.audit) {
       if (ec->audit_features[wap_ldf_namespace].begin != ec->audit_features[wap_ldf_namespace].end) {
         for (audit_data *f = ec->audit_features[wap_ldf_namespace].begin; f != ec->audit_features[wap_ldf_namespace].end; f++) {
@@ -329,17 +547,34 @@ namespace LabelDict {
       
       ec.ld = &simple_label;
       base.predict(ec); // make a prediction
+      ec.partial_prediction += l.shared_score;
     } else {
-      for (size_t j=0; j<costs.size(); j++) {
+      float score = 0.;
+      if (l.score_labels_apart) { // score ec once, and each label's features on their own
         simple_label.initial = 0.;
         simple_label.label = FLT_MAX;
         simple_label.weight = 0.;
         ec.partial_prediction = 0.;
-
-        LabelDict::add_example_namespace_from_memory(l, ec, costs[j].class_index);
-      
         ec.ld = &simple_label;
-        base.predict(ec); // make a prediction
+        base.predict(ec);
+        score = ec.partial_prediction + l.shared_score;
+      }
+      for (size_t j=0; j<costs.size(); j++) {
+        if (l.score_labels_apart)
+          ec.partial_prediction = score + LabelDict::label_score(l, base, ec, costs[j].class_index);
+        else {
+          simple_label.initial = 0.;
+          simple_label.label = FLT_MAX;
+          simple_label.weight = 0.;
+          ec.partial_prediction = 0.;
+
+          LabelDict::add_example_namespace_from_memory(l, ec, costs[j].class_index);
+
+          ec.ld = &simple_label;
+          base.predict(ec); // make a prediction
+          ec.partial_prediction += l.shared_score;
+          LabelDict::del_example_namespace_from_memory(l, ec, costs[j].class_index);
+        }
         costs[j].partial_prediction = ec.partial_prediction;
         //cdbg << "costs[" << j << "].partial_prediction = " << ec.partial_prediction << endl;
 
@@ -350,8 +585,6 @@ namespace LabelDict {
 
         if (min_cost && (costs[j].x < *min_cost)) *min_cost = costs[j].x;
         if (max_cost && (costs[j].x > *max_cost)) *max_cost = costs[j].x;
-
-        LabelDict::del_example_namespace_from_memory(l, ec, costs[j].class_index);
       }
     }
     
@@ -385,6 +618,7 @@ namespace LabelDict {
     // do actual learning
     vector<COST_SENSITIVE::wclass*> all_costs;
     if (is_learn && all.training && !isTest) {
+      LabelDict::merge_header(l);
       for (size_t k=start_K; k<K; k++) {
         v_array<COST_SENSITIVE::wclass> this_costs = ((label*)l.ec_seq.begin[k]->ld)->costs;
         for (size_t j=0; j<this_costs.size(); j++)
@@ -477,8 +711,10 @@ namespace LabelDict {
     }
 
     // do actual learning
-    if (is_learn && all.training && !isTest)
+    if (is_learn && all.training && !isTest) {
+      LabelDict::merge_header(l);
       l.csoaa_example_t += 1.;
+    }
     for (size_t k=start_K; k<K; k++) {
       example *ec = l.ec_seq.begin[k];
       label   *ld = (label*)ec->ld;
@@ -541,11 +777,7 @@ namespace LabelDict {
     /////////////////////// handle label definitions
     if (LabelDict::ec_seq_is_label_definition(l, l.ec_seq)) {  
       for (size_t i=0; i<l.ec_seq.size(); i++) {
-        v_array<feature> features;
-        for (feature*f=l.ec_seq[i]->atomics[l.ec_seq[i]->indices[0]].begin; f!=l.ec_seq[i]->atomics[l.ec_seq[i]->indices[0]].end; f++) {
-          feature fnew = { f->x,  f->weight_index };
-          features.push_back(fnew);
-        }
+        v_array<feature>& features = l.ec_seq[i]->atomics(l.ec_seq[i]->indices[0]);
 
         v_array<COST_SENSITIVE::wclass> costs = ((COST_SENSITIVE::label*)l.ec_seq[i]->ld)->costs;
         for (size_t j=0; j<costs.size(); j++) {
@@ -560,8 +792,9 @@ namespace LabelDict {
     size_t start_K = 0;
     if (LabelDict::ec_is_example_header(*l.ec_seq[0])) {
       start_K = 1;
-      for (size_t k=1; k<K; k++)
-        LabelDict::add_example_namespaces_from_example(*l.ec_seq[k], *l.ec_seq[0]);
+      if (!LabelDict::score_header_apart(all, l, base))
+        for (size_t k=1; k<K; k++)
+          LabelDict::add_example_namespaces_from_example(*l.ec_seq[k], *l.ec_seq[0]);
     }
 
     /////////////////////// learn
@@ -569,9 +802,11 @@ namespace LabelDict {
     else          do_actual_learning_oaa<is_learn>(all, l, base, start_K);
     
     /////////////////////// remove header
-    if (start_K > 0)
+    if (start_K > 0 && l.header_merged)
       for (size_t k=1; k<K; k++)
         LabelDict::del_example_namespaces_from_example(*l.ec_seq[k], *l.ec_seq[0]);
+    l.header_merged = true;
+    l.shared_score = 0.;
 
   }
 
@@ -786,6 +1021,7 @@ namespace LabelDict {
     ld->all = &all;
     ld->need_to_clear = true;
     ld->first_pass = true;
+    ld->header_merged = true;
  
     string ldf_arg;
 
@@ -830,9 +1066,19 @@ namespace LabelDict {
     if (all.add_constant) {
       all.add_constant = false;
     }
-    ld->label_features.init(256, v_array<feature>(), LabelDict::size_t_eq);
+    label_span no_features = { 0, 0 };
+    ld->label_features.init(256, no_features, LabelDict::size_t_eq);
     ld->label_features.get(1, 94717244); // TODO: figure this out
 
+    // label features add linearly to a linear base's score unless an interaction crosses them.
+    ld->score_labels_apart = all.l->multipredicts() && !all.audit && !all.hash_inv;
+    for (size_t i=0; i<all.pairs.size(); i++)
+      if (all.pairs[i].find('l') != string::npos) ld->score_labels_apart = false;
+    for (size_t i=0; i<all.triples.size(); i++)
+      if (all.triples[i].find('l') != string::npos) ld->score_labels_apart = false;
+    ld->label_ec = alloc_examples(sizeof(label_data), 1);
+    ld->label_ec->indices.push_back((size_t)'l');
+
     ld->read_example_this_loop = 0;
     ld->need_to_clear = false;
     learner* l = new learner(ld, all.l);
@@ -17,6 +17,7 @@ license as described in the file LICENSE.
 #include "reductions.h"
 #include "multiclass.h"
 #include "simple_label.h"
+#include "vw.h"
 
 using namespace std;
 using namespace LEARNER;
@@ -51,6 +52,8 @@ namespace ECT
     
     v_array<bool> tournaments_won;
 
+    VW::prediction* finals; //one per problem of the final elimination tournament.
+
     vw* all;
   };
 
@@ -195,13 +198,21 @@ namespace ECT
     label_data simple_temp = {FLT_MAX, 0., 0.};
     ec.ld = & simple_temp;
 
+    //its problems are consecutive, so when the base can, all of them are predicted in one pass over the features.
+    bool one_pass = e.errors > 0 && base.multipredicts();
+    if (one_pass)
+      base.multipredict(ec, e.last_pair, e.errors, e.finals);
+
     for (size_t i = e.tree_height-1; i != (size_t)0 -1; i--)
       {
         if ((finals_winner | (((size_t)1) << i)) <= e.errors)
           {// a real choice exists
             uint32_t problem_number = e.last_pair + (finals_winner | (((uint32_t)1) << i)) - 1; //This is unique.
 	  
-            base.learn(ec, problem_number);
+	    if (one_pass)
+	      simple_temp.prediction = e.finals[problem_number - e.last_pair].value;
+	    else
+	      base.learn(ec, problem_number);
 	  
 	    if (simple_temp.prediction > 0.)
               finals_winner = finals_winner | (((size_t)1) << i);
@@ -362,6 +373,8 @@ namespace ECT
     e.down_directions.delete_v();
 
     e.tournaments_won.delete_v();
+
+    free(e.finals);
   }
 
   void finish_example(vw& all, ect&, example& ec)
@@ -397,6 +410,7 @@ namespace ECT
     all.p->lp = MULTICLASS::mc_label;
     size_t wpp = create_circuit(all, *data, data->k, data->errors+1);
     data->all = &all;
+    data->finals = (VW::prediction*)calloc_or_die(data->errors+1, sizeof(VW::prediction));
     
     learner* l = new learner(data, all.l, wpp);
     l->set_learn<ect, learn>();
@@ -86,8 +86,17 @@ void copy_example_data(bool audit, example* dst, example* src)
   dst->example_counter = src->example_counter;
 
   copy_array(dst->indices, src->indices);
-  for (size_t i=0; i<256; i++)
-    copy_array(dst->atomics[i], src->atomics[i]);
+  for (namespace_features** n = dst->namespaces.begin; n != dst->namespaces.end; n++)
+    {
+      (*n)->atomics.erase();
+      (*n)->sum_feat_sq = 0.;
+    }
+  for (namespace_features** n = src->namespaces.begin; n != src->namespaces.end; n++)
+    {
+      namespace_features& d = dst->features_of((*n)->index);
+      copy_array(d.atomics, (*n)->atomics);
+      d.sum_feat_sq = (*n)->sum_feat_sq;
+    }
   dst->ft_offset = src->ft_offset;
 
   if (audit)
@@ -101,7 +110,6 @@ void copy_example_data(bool audit, example* dst, example* src)
   dst->eta_round = src->eta_round;
   dst->eta_global = src->eta_global;
   dst->example_t = src->example_t;
-  memcpy(dst->sum_feat_sq, src->sum_feat_sq, 256 * sizeof(float));
   dst->total_sum_feat_sq = src->total_sum_feat_sq;
   dst->revert_weight = src->revert_weight;
   dst->test_only = src->test_only;
@@ -161,6 +169,37 @@ void free_flatten_example(flat_example* fec)
 
 }
 
+v_array<audit_data> no_audit_features[256];
+
+const v_array<feature> no_features = v_array<feature>();
+
+namespace_features& example::add_namespace(unsigned char ns)
+{
+  namespace_features* n = (namespace_features*)calloc_or_die(1, sizeof(namespace_features));
+  n->index = ns;
+  namespace_slot[ns] = (unsigned char)namespaces.size();
+  namespaces.push_back(n);
+  return *n;
+}
+
+void dealloc_namespaces(example& ec)
+{
+  for (namespace_features** n = ec.namespaces.begin; n != ec.namespaces.end; n++)
+    {
+      (*n)->atomics.delete_v();
+      free(*n);
+    }
+  ec.namespaces.delete_v();
+}
+
+v_array<audit_data>* alloc_audit_features(bool audit)
+{
+  if (audit)
+    return (v_array<audit_data>*)calloc_or_die(256, sizeof(v_array<audit_data>));
+  else
+    return no_audit_features;
+}
+
 example *alloc_examples(size_t label_size, size_t count=1)
 {
   example* ec = (example*)calloc_or_die(count, sizeof(example));
@@ -172,6 +211,7 @@ example *alloc_examples(size_t label_size, size_t count=1)
       free(ec);
       return NULL;
     }
+    ec[i].audit_features = alloc_audit_features(true);
     ec[i].in_use = true;
     ec[i].ft_offset = 0;
     //  std::cerr << "  alloc_example.indices.begin=" << ec->indices.begin << " end=" << ec->indices.end << " // ld = " << ec->ld << "\t|| me = " << ec << std::endl;
@@ -189,22 +229,25 @@ void dealloc_example(void(*delete_label)(void*), example&ec)
   ec.topic_predictions.delete_v();
 
   free(ec.ld);
-  for (size_t j = 0; j < 256; j++)
+  dealloc_namespaces(ec);
+
+  if (ec.audit_features != no_audit_features && ec.audit_features != NULL)
     {
-      ec.atomics[j].delete_v();
-
-      if (ec.audit_features[j].begin != ec.audit_features[j].end_array)
-        {
-          for (audit_data* temp = ec.audit_features[j].begin; 
-               temp != ec.audit_features[j].end; temp++)
-            if (temp->alloced) {
-              free(temp->space);
-              free(temp->feature);
-              temp->alloced = false;
-            }
-	  ec.audit_features[j].delete_v();
-        }
+      for (size_t j = 0; j < 256; j++)
+	if (ec.audit_features[j].begin != ec.audit_features[j].end_array)
+	  {
+	    for (audit_data* temp = ec.audit_features[j].begin; 
+		 temp != ec.audit_features[j].end; temp++)
+	      if (temp->alloced) {
+		free(temp->space);
+		free(temp->feature);
+		temp->alloced = false;
+	      }
+	    ec.audit_features[j].delete_v();
+	  }
+      free(ec.audit_features);
     }
+  ec.audit_features = NULL;
   ec.indices.delete_v();
 }
 
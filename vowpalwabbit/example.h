@@ -32,6 +32,15 @@ struct audit_data {
   bool alloced;
 };
 
+struct namespace_features { //what an example holds for one namespace.
+  v_array<feature> atomics; // raw parsed data
+  float sum_feat_sq;//helper for total_sum_feat_sq.
+  unsigned char index;
+};
+
+//Shared, always empty stand-in for the features of a namespace a const example doesn't hold.
+extern const v_array<feature> no_features;
+
 struct example // core example datatype.
 {
   void* ld;
@@ -40,10 +49,12 @@ struct example // core example datatype.
   size_t example_counter;
 
   v_array<unsigned char> indices;
-  v_array<feature> atomics[256]; // raw parsed data
+  //storage for the namespaces the example has used, kept when it is reused; see atomics() below.
+  v_array<namespace_features*> namespaces;
+  unsigned char namespace_slot[256];//position in namespaces, if the entry there is that namespace's.
   uint32_t ft_offset;
   
-  v_array<audit_data> audit_features[256];
+  v_array<audit_data>* audit_features;//one per namespace; points at no_audit_features unless auditing.
   
   size_t num_features;//precomputed, cause it's fast&easy.
   float partial_prediction;//shared data for prediction.
@@ -52,7 +63,6 @@ struct example // core example datatype.
   float eta_round;
   float eta_global;
   float example_t;//sum of importance weights so far.
-  float sum_feat_sq[256];//helper for total_sum_feat_sq.
   float total_sum_feat_sq;//precomputed, cause it's kind of fast & easy.
   float revert_weight;
 
@@ -60,6 +70,33 @@ struct example // core example datatype.
   bool end_pass;//special example indicating end of pass.
   bool sorted;//Are the features sorted or not?
   bool in_use; //in use or not (for the parser)
+
+  //The features and sum of squares of namespace ns.  Writable access adds the namespace the first
+  //time; a const example reads namespaces it doesn't hold as empty.
+  inline v_array<feature>& atomics(unsigned char ns) { return features_of(ns).atomics; }
+  inline float& sum_feat_sq(unsigned char ns) { return features_of(ns).sum_feat_sq; }
+  inline const v_array<feature>& atomics(unsigned char ns) const
+  {
+    const namespace_features* n = find(ns);
+    return n ? n->atomics : no_features;
+  }
+  inline float sum_feat_sq(unsigned char ns) const
+  {
+    const namespace_features* n = find(ns);
+    return n ? n->sum_feat_sq : 0.f;
+  }
+
+  inline namespace_features* find(unsigned char ns) const
+  {
+    size_t slot = namespace_slot[ns];
+    return slot < namespaces.size() && namespaces.begin[slot]->index == ns ? namespaces.begin[slot] : NULL;
+  }
+  inline namespace_features& features_of(unsigned char ns)
+  {
+    namespace_features* n = find(ns);
+    return n ? *n : add_namespace(ns);
+  }
+  namespace_features& add_namespace(unsigned char ns);
 };
 
  struct vw;  
@@ -84,8 +121,13 @@ flat_example* flatten_example(vw& all, example *ec);
 void free_flatten_example(flat_example* fec);
 }
 
+//Shared, always empty stand-in for the audit arrays of examples that are never audited.  Read-only.
+extern v_array<audit_data> no_audit_features[256];
+v_array<audit_data>* alloc_audit_features(bool audit);
+
 example *alloc_examples(size_t,size_t);
 void dealloc_example(void(*delete_label)(void*), example&);
+void dealloc_namespaces(example&);
 
 inline int example_is_newline(example& ec)
 {
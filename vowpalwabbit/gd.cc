@@ -6,6 +6,7 @@ license as described in the file LICENSE.
 #include <fstream>
 #include <sstream>
 #include <float.h>
+#include <time.h>
 #ifdef _WIN32
 #include <WinSock2.h>
 #else
@@ -22,7 +23,9 @@ license as described in the file LICENSE.
 #include "gd.h"
 #include "simple_label.h"
 #include "accumulate.h"
+#include "param_client.h"
 #include "reductions.h"
+#include "vw.h"
 
 using namespace std;
 
@@ -30,6 +33,8 @@ using namespace LEARNER;
 
 namespace GD
 {
+  struct multiupdate_data;
+
   struct gd{
     bool active;
     bool active_simulation;
@@ -37,7 +42,14 @@ namespace GD
     size_t no_win_counter;
     size_t early_stop_thres;
     float initial_constant;
+    bool overlap; //average in the background while the next pass learns.
+    background_average pass_average;
+    size_t average_every; //average every this many examples during a pass too (0 = never).
+    size_t average_seconds; //or every this many seconds.
+    size_t examples_since_average;
+    time_t last_average;
     void (*predict)(gd&, learner&, example&);
+    v_array<multiupdate_data> multi; //per weight vector of a multiupdate.
 
     vw* all;
   };
@@ -110,12 +122,15 @@ float InvSqrt(float x){
     }
   }
   
-  template<bool sqrt_rate, size_t adaptive, size_t normalized, size_t feature_mask>
-  void train(vw& all, example& ec, float update)
+  inline void touch_feature(sparse_sync& s, const float x, float& fw)
+  {
+    mark_touched(s, (&fw - s.weights) >> s.stride_shift);
+  }
+
+  //scales an update by the average norm of the examples so far, as train() applies it.
+  template<bool sqrt_rate, size_t adaptive, size_t normalized>
+  float normalize_update(vw& all, example& ec, float update)
   {
-    if (fabsf(update) == 0.f)
-      return;
-    
     float total_weight = ec.example_t;
 
     if(!all.holdout_set_off)
@@ -135,39 +150,147 @@ float InvSqrt(float x){
       else 
 	update *= powf(avg_norm * avg_norm, minus_power_t_norm);
     }
+    return update;
+  }
 
+  template<bool sqrt_rate, size_t adaptive, size_t normalized, size_t feature_mask>
+  void train(vw& all, example& ec, float update)
+  {
+    if (fabsf(update) == 0.f)
+      return;
+    
+    update = normalize_update<sqrt_rate, adaptive, normalized>(all, ec, update);
+    float minus_power_t_norm = (adaptive ? all.power_t : 0.f) -1.f;
     train_data d = {update, {-all.power_t, minus_power_t_norm}};
     
     foreach_feature<train_data,update_feature<sqrt_rate, adaptive, normalized, feature_mask> >(all, ec, d);
+
+    if (all.sparse)
+      foreach_feature<sparse_sync,touch_feature>(all, ec, *all.sparse);
   }
 
-  void end_pass(gd& g)
+  void average_pass(vw* all)
   {
-    vw* all = g.all;
-    
-    sync_weights(*all);
     if(all->span_server != "") {
-      if(all->adaptive)
+      if(all->sparse)
+	{
+	  if(all->adaptive)
+	    accumulate_sparse_weighted_avg(*all, all->span_server, all->reg);
+	  else
+	    accumulate_sparse_avg(*all, all->span_server, all->reg);
+	}
+      else if(all->adaptive)
 	accumulate_weighted_avg(*all, all->span_server, all->reg);
       else 
         accumulate_avg(*all, all->span_server, all->reg, 0);	      
     }
+  }
+
+  bool averaging_periodically(gd& g)
+  {
+    return g.average_every > 0 || g.average_seconds > 0;
+  }
+
+  //starts a background average once enough examples or time have gone by since the last one.
+  void average_periodically(gd& g)
+  {
+    background_average& b = g.pass_average;
+    g.examples_since_average++;
+    if (b.running)
+      {
+	if (!b.done)
+	  return;
+	finish_background_average(b);
+      }
+    if ((g.average_every > 0 && g.examples_since_average >= g.average_every)
+	|| (g.average_seconds > 0 && (size_t)(time(NULL) - g.last_average) >= g.average_seconds))
+      {
+	g.examples_since_average = 0;
+	g.last_average = time(NULL);
+	sync_weights(*g.all);
+	b.finished = 0.;
+	start_background_average(*g.all, b);
+      }
+  }
+
+  /* Nodes reach the end of a pass at different times, so one that has keeps joining averages until
+     all have.  That last average is the end of pass one, and since the nodes waiting in it learned
+     nothing meanwhile it leaves them all with the same model. */
+  void average_pass_end(gd& g)
+  {
+    background_average& b = g.pass_average;
+    finish_background_average(b);
+    do
+      {
+	b.finished = 1.;
+	start_background_average(*g.all, b);
+	finish_background_average(b);
+      }
+    while (b.finished < (float)g.all->socks.total);
+    g.examples_since_average = 0;
+    g.last_average = time(NULL);
+  }
+
+  void end_pass(gd& g)
+  {
+    vw* all = g.all;
+    
+    sync_weights(*all);
+    bool last_pass = all->current_pass + 1 >= all->numpasses;
+    if(all->ps)
+      {
+	if (last_pass)
+	  PS::finish_training(*all);
+	else
+	  PS::clock(*all);
+      }
+    else if(averaging_periodically(g))
+      average_pass_end(g);
+    else if(g.overlap)
+      finish_background_average(g.pass_average);
+    else
+      average_pass(all);
     
     all->eta *= all->eta_decay_rate;
-    if (all->save_per_pass)
+    if (all->save_per_pass && !g.overlap)
       save_predictor(*all, all->final_regressor_name, all->current_pass);   
     
     all->current_pass++;
     
+    bool improved = false;
     if(!all->holdout_set_off)
       {
-        if(summarize_holdout_set(*all, g.no_win_counter))
+        improved = summarize_holdout_set(*all, g.no_win_counter);
+        if(improved && !g.overlap)
           finalize_regressor(*all, all->final_regressor_name);
         if((g.early_stop_thres == g.no_win_counter) &&
            ((all->check_holdout_every_n_passes <= 1) ||
             ((all->current_pass % all->check_holdout_every_n_passes) == 0)))
 	  set_done(*all);
       }   
+
+    //a model that gets saved must be the average; otherwise average while the next pass runs.
+    //started after the holdout loss allreduce, which would otherwise share the sockets with it.
+    if(g.overlap)
+      {
+	if(last_pass || improved || all->early_terminate || all->save_per_pass)
+	  {
+	    average_pass(all);
+	    if (all->save_per_pass)
+	      save_predictor(*all, all->final_regressor_name, all->current_pass - 1);
+	    if(improved)
+	      finalize_regressor(*all, all->final_regressor_name);
+	  }
+	else
+	  start_background_average(*all, g.pass_average);
+      }
+  }
+
+  void finish(gd& g)
+  {
+    if (g.overlap || averaging_periodically(g))
+      free_background_average(g.pass_average);
+    g.multi.delete_v();
   }
 
 struct string_value {
@@ -195,6 +318,7 @@ bool operator<(const string_value& first, const string_value& second)
   size_t index = (f->weight_index + offset) & all.reg.weight_mask;
   weight* weights = all.reg.weight_vector;
   size_t stride_shift = all.reg.stride_shift;
+  size_t number = ((f->weight_index + offset) >> stride_shift) & all.parse_mask; //in the whole vector, which weights may only cache.
   
   if(all.audit) tempstream << prepend;
   
@@ -213,7 +337,7 @@ bool operator<(const string_value& first, const string_value& second)
     tempstream << "Constant:";
   }  
   if(all.audit){
-    tempstream << ((index >> stride_shift) & all.parse_mask) << ':' << mult*f->x;
+    tempstream << number << ':' << mult*f->x;
     tempstream  << ':' << trunc_weight(weights[index], (float)all.sd->gravity) * (float)all.sd->contraction;
   }
   if(all.current_pass == 0 && all.inv_hash_regressor_name != ""){ //for invert_hash
@@ -221,11 +345,11 @@ bool operator<(const string_value& first, const string_value& second)
       tmp = "Constant";
 
     ostringstream convert;
-    convert << ((index >>stride_shift) & all.parse_mask);
+    convert << number;
     tmp = ns_pre + tmp + ":"+ convert.str();
     
     if(!all.name_index_map.count(tmp)){
-      all.name_index_map.insert(std::map< std::string, size_t>::value_type(tmp, ((index >> stride_shift) & all.parse_mask)));
+      all.name_index_map.insert(std::map< std::string, size_t>::value_type(tmp, number));
     }
   }
 
@@ -289,7 +413,7 @@ void print_features(vw& all, example& ec)
     {
       size_t count = 0;
       for (unsigned char* i = ec.indices.begin; i != ec.indices.end; i++)
-	count += ec.audit_features[*i].size() + ec.atomics[*i].size();
+	count += ec.audit_features[*i].size() + ec.atomics(*i).size();
       for (unsigned char* i = ec.indices.begin; i != ec.indices.end; i++) 
 	for (audit_data *f = ec.audit_features[*i].begin; f != ec.audit_features[*i].end; f++)
 	  {
@@ -307,19 +431,19 @@ void print_features(vw& all, example& ec)
       
       for (unsigned char* i = ec.indices.begin; i != ec.indices.end; i++){ 
         ns_pre = "";
-	audit_features(all, ec.atomics[*i], ec.audit_features[*i], features, empty, ns_pre, ec.ft_offset);
+	audit_features(all, ec.atomics(*i), ec.audit_features[*i], features, empty, ns_pre, ec.ft_offset);
         ns_pre = "";
       }
       for (vector<string>::iterator i = all.pairs.begin(); i != all.pairs.end();i++) 
 	{
 	  int fst = (*i)[0];
 	  int snd = (*i)[1];
-	  for (size_t j = 0; j < ec.atomics[fst].size(); j++)
+	  for (size_t j = 0; j < ec.atomics(fst).size(); j++)
 	    {
 	      audit_data* a = NULL;
 	      if (ec.audit_features[fst].size() > 0)
 		a = & ec.audit_features[fst][j];
-	      audit_quad(all, ec.atomics[fst][j], a, ec.atomics[snd], ec.audit_features[snd], features, ns_pre);
+	      audit_quad(all, ec.atomics(fst)[j], a, ec.atomics(snd), ec.audit_features[snd], features, ns_pre);
 	    }
 	}
 
@@ -328,17 +452,17 @@ void print_features(vw& all, example& ec)
 	  int fst = (*i)[0];
 	  int snd = (*i)[1];
 	  int trd = (*i)[2];
-	  for (size_t j = 0; j < ec.atomics[fst].size(); j++)
+	  for (size_t j = 0; j < ec.atomics(fst).size(); j++)
 	    {
 	      audit_data* a1 = NULL;
 	      if (ec.audit_features[fst].size() > 0)
 		a1 = & ec.audit_features[fst][j];
-	      for (size_t k = 0; k < ec.atomics[snd].size(); k++)
+	      for (size_t k = 0; k < ec.atomics(snd).size(); k++)
 		{
 		  audit_data* a2 = NULL;
 		  if (ec.audit_features[snd].size() > 0)
 		    a2 = & ec.audit_features[snd][k];
-		  audit_triple(all, ec.atomics[fst][j], a1, ec.atomics[snd][k], a2, ec.atomics[trd], ec.audit_features[trd], features, ns_pre);
+		  audit_triple(all, ec.atomics(fst)[j], a1, ec.atomics(snd)[k], a2, ec.atomics(trd), ec.audit_features[trd], features, ns_pre);
 		}
 	    }
 	}
@@ -384,9 +508,9 @@ float finalize_prediction(vw& all, float ret)
    p.prediction += trunc_weight(fw, p.gravity) * fx;
  }
 
- inline float trunc_predict(vw& all, example& ec, float gravity)
+ inline float trunc_predict(vw& all, const example& ec, float gravity)
  {
-   label_data* ld = (label_data*)ec.ld;
+   const label_data* ld = (const label_data*)ec.ld;
    trunc_data temp = {ld->initial, gravity};
    foreach_feature<trunc_data, vec_add_trunc>(all, ec, temp);
    return temp.prediction;
@@ -397,6 +521,9 @@ void predict(gd& g, learner& base, example& ec)
 {
   vw& all = *g.all;
 
+  if (all.ps)
+    PS::refresh(all, ec);
+
   if (reg_mode_odd)
     {
       float gravity = (float)all.sd->gravity;
@@ -412,6 +539,108 @@ void predict(gd& g, learner& base, example& ec)
     print_audit_features(all, ec);
 }
 
+  struct multipredict_data {
+    VW::prediction* pred;
+    size_t count;
+    weight* weights;
+    size_t mask;
+    float gravity;
+  };
+
+  //adds x times the weights at index, index+stride, ... to the count predictions.
+  template<bool reg_mode_odd>
+  inline void add_multi(multipredict_data& d, float x, size_t index, size_t stride)
+  {
+    index &= d.mask;
+    if (index + stride*(d.count-1) <= d.mask)
+      {
+	weight* w = d.weights + index;
+	for (size_t c = 0; c < d.count; c++, w += stride)
+	  d.pred[c].partial_prediction += x * (reg_mode_odd ? trunc_weight(*w, d.gravity) : *w);
+      }
+    else
+      for (size_t c = 0; c < d.count; c++, index += stride)
+	{
+	  weight w = d.weights[index & d.mask];
+	  d.pred[c].partial_prediction += x * (reg_mode_odd ? trunc_weight(w, d.gravity) : w);
+	}
+  }
+
+/* Predicts for count weight vectors step apart with one walk over the features, in the same order as
+   foreach_feature, so each prediction is exactly what predict() makes.  A linear feature's weights
+   are step apart, but an interaction's are spread by its hash, so those have their own stride. */
+template<bool reg_mode_odd>
+void multipredict(gd& g, learner& base, example& ec, size_t count, size_t step, VW::prediction* pred)
+{
+  vw& all = *g.all;
+  label_data& ld = *(label_data*)ec.ld;
+
+  if (all.audit || all.hash_inv)
+    {//one at a time, as each prints its own audit.
+      for (size_t c = 0; c < count; c++)
+	{
+	  ec.ft_offset += (uint32_t)(step*c);
+	  predict<reg_mode_odd>(g, base, ec);
+	  ec.ft_offset -= (uint32_t)(step*c);
+	  pred[c].partial_prediction = ec.partial_prediction;
+	  pred[c].value = ld.prediction;
+	}
+      return;
+    }
+  if (all.ps)
+    for (size_t c = 0; c < count; c++)
+      {
+	ec.ft_offset += (uint32_t)(step*c);
+	PS::refresh(all, ec);
+	ec.ft_offset -= (uint32_t)(step*c);
+      }
+
+  for (size_t c = 0; c < count; c++)
+    pred[c].partial_prediction = ld.initial;
+  multipredict_data d = {pred, count, all.reg.weight_vector, all.reg.weight_mask, (float)all.sd->gravity};
+  uint32_t offset = ec.ft_offset;
+
+  for (unsigned char* i = ec.indices.begin; i != ec.indices.end; i++) 
+    for (feature* f = ec.atomics(*i).begin; f != ec.atomics(*i).end; f++)
+      add_multi<reg_mode_odd>(d, f->x, f->weight_index + offset, step);
+
+  uint32_t quadratic_stride = quadratic_constant * (uint32_t)step;
+  for (vector<string>::iterator i = all.pairs.begin(); i != all.pairs.end();i++)
+    {
+      v_array<feature>& first = ec.atomics((int)(*i)[0]);
+      v_array<feature>& second = ec.atomics((int)(*i)[1]);
+      for (feature* f1 = first.begin; f1 != first.end; f1++)
+	{
+	  uint32_t halfhash = quadratic_constant * (f1->weight_index + offset);
+	  for (feature* f2 = second.begin; f2 != second.end; f2++)
+	    add_multi<reg_mode_odd>(d, f1->x * f2->x, (uint32_t)(f2->weight_index + halfhash), quadratic_stride);
+	}
+    }
+
+  uint32_t cubic_stride = cubic_constant2 * (cubic_constant + 1) * (uint32_t)step;
+  for (vector<string>::iterator i = all.triples.begin(); i != all.triples.end();i++)
+    {
+      v_array<feature>& first = ec.atomics((int)(*i)[0]);
+      v_array<feature>& second = ec.atomics((int)(*i)[1]);
+      v_array<feature>& third = ec.atomics((int)(*i)[2]);
+      if (first.size() == 0 || second.size() == 0 || third.size() == 0)
+	continue;
+      for (feature* f1 = first.begin; f1 != first.end; f1++)
+	for (feature* f2 = second.begin; f2 != second.end; f2++)
+	  {
+	    uint32_t halfhash = cubic_constant2 * (cubic_constant * (f1->weight_index + offset) + f2->weight_index + offset);
+	    float mult = f1->x * f2->x;
+	    for (feature* f3 = third.begin; f3 != third.end; f3++)
+	      add_multi<reg_mode_odd>(d, mult * f3->x, (uint32_t)(f3->weight_index + halfhash), cubic_stride);
+	  }
+    }
+
+  for (size_t c = 0; c < count; c++)
+    pred[c].value = finalize_prediction(all, pred[c].partial_prediction * (float)all.sd->contraction);
+  ec.partial_prediction = pred[count-1].partial_prediction;
+  ld.prediction = pred[count-1].value;
+}
+
   struct norm_data {
     float g;
     float pred_per_update;
@@ -446,18 +675,12 @@ inline void pred_per_update_feature(norm_data& nd, float x, float& fw) {
   }
 }
   
-template<bool sqrt_rate, size_t adaptive, size_t normalized, size_t feature_mask>
-float pred_per_update(vw& all, example& ec)
-{//We must traverse the features in _precisely_ the same order as during training.
+//adds the example's norm to the running sum, and scales its prediction per update by the average.
+template<bool sqrt_rate, size_t adaptive, size_t normalized>
+float finish_pred_per_update(vw& all, example& ec, norm_data& nd)
+{
   label_data* ld = (label_data*)ec.ld;
-  float g = all.loss->getSquareGrad(ld->prediction, ld->label) * ld->weight;
-  if (g==0) return 1.;
-
   float minus_power_t_norm = (adaptive ? all.power_t : 0.f) - 1.f;
-  norm_data nd = {g, 0., 0., {-all.power_t, minus_power_t_norm}};
-  
-  foreach_feature<norm_data,pred_per_update_feature<sqrt_rate, adaptive, normalized, feature_mask> >(all, ec, nd);
-  
   if(normalized) {
     float total_weight = ec.example_t;
     
@@ -477,6 +700,34 @@ float pred_per_update(vw& all, example& ec)
   return nd.pred_per_update;
 }
 
+template<bool sqrt_rate, size_t adaptive, size_t normalized, size_t feature_mask>
+float pred_per_update(vw& all, example& ec)
+{//We must traverse the features in _precisely_ the same order as during training.
+  label_data* ld = (label_data*)ec.ld;
+  float g = all.loss->getSquareGrad(ld->prediction, ld->label) * ld->weight;
+  if (g==0) return 1.;
+
+  float minus_power_t_norm = (adaptive ? all.power_t : 0.f) - 1.f;
+  norm_data nd = {g, 0., 0., {-all.power_t, minus_power_t_norm}};
+  
+  foreach_feature<norm_data,pred_per_update_feature<sqrt_rate, adaptive, normalized, feature_mask> >(all, ec, nd);
+  
+  return finish_pred_per_update<sqrt_rate, adaptive, normalized>(all, ec, nd);
+}
+
+//the update of the label's prediction, given its prediction per unit of update.
+template<size_t adaptive>
+float get_update(vw& all, label_data& ld, float norm, float t)
+{
+  float eta_t = all.eta * norm * ld.weight;
+  if(!adaptive && all.power_t != 0) eta_t *= powf(t,-all.power_t);
+
+  if( all.invariant_updates )
+    return all.loss->getUpdate(ld.prediction, ld.label, eta_t, norm);
+  else
+    return all.loss->getUnsafeUpdate(ld.prediction, ld.label, eta_t, norm);
+}
+
 template<bool sqrt_rate, size_t adaptive, size_t normalized, size_t feature_mask>
 void compute_update(vw& all, gd& g, example& ec)
 {
@@ -509,21 +760,13 @@ void compute_update(vw& all, gd& g, example& ec)
     {
       if (all.training && ec.loss > 0.)
         {
-	  float eta_t;
 	  float norm;
           if(adaptive || normalized)
 	    norm = pred_per_update<sqrt_rate, adaptive, normalized, feature_mask>(all,ec);
           else
             norm = ec.total_sum_feat_sq;
 
-          eta_t = all.eta * norm * ld->weight;
-          if(!adaptive && all.power_t != 0) eta_t *= powf(t,-all.power_t);
-
-          float update = 0.f;
-          if( all.invariant_updates )
-            update = all.loss->getUpdate(ld->prediction, ld->label, eta_t, norm);
-          else
-            update = all.loss->getUnsafeUpdate(ld->prediction, ld->label, eta_t, norm);
+          float update = get_update<adaptive>(all, *ld, norm, t);
 
 	  if (all.reg_mode && fabs(ec.eta_round) > 1e-8) {
 	    double dev1 = all.loss->first_derivative(all.sd, ld->prediction, ld->label);
@@ -554,6 +797,9 @@ void update(gd& g, learner& base, example& ec)
       if (all->sd->contraction < 1e-10)  // updating weights now to avoid numerical instability
 	sync_weights(*all);
     }
+
+  if (averaging_periodically(g))
+    average_periodically(g);
 }
 
 template<bool sqrt_rate, size_t adaptive, size_t normalized, size_t feature_mask>
@@ -568,8 +814,163 @@ void learn(gd& g, learner& base, example& ec)
 
   if ((all->holdout_set_off || !ec.test_only) && ld->weight > 0)
     update<sqrt_rate, adaptive, normalized, feature_mask>(g,base,ec);
-  else if(ld->weight > 0)
-    ec.loss = all->loss->getLoss(all->sd, ld->prediction, ld->label) * ld->weight;
+  else
+    {
+      if(ld->weight > 0)
+	ec.loss = all->loss->getLoss(all->sd, ld->prediction, ld->label) * ld->weight;
+      if (averaging_periodically(g))
+	average_periodically(g);
+    }
+}
+
+  struct multiupdate_data {
+    norm_data nd; //nd.g is 0 when its prediction per update isn't needed.
+    float update; //0 when it isn't updated.
+  };
+
+/* Calls T(dat, c, x, w) for each feature x and each of count weight vectors step apart, with w the c-th
+   one's weight, visiting each vector's weights in the order foreach_feature does. */
+template <class R, void (*T)(R&, size_t, float, float&)>
+void foreach_feature_multi(vw& all, example& ec, R& dat, size_t count, size_t step)
+{
+  weight* weights = all.reg.weight_vector;
+  size_t mask = all.reg.weight_mask;
+  uint32_t offset = ec.ft_offset;
+
+  for (unsigned char* i = ec.indices.begin; i != ec.indices.end; i++) 
+    for (feature* f = ec.atomics(*i).begin; f != ec.atomics(*i).end; f++)
+      {
+	size_t index = f->weight_index + offset;
+	for (size_t c = 0; c < count; c++, index += step)
+	  T(dat, c, f->x, weights[index & mask]);
+      }
+
+  size_t quadratic_stride = quadratic_constant * (uint32_t)step;
+  for (vector<string>::iterator i = all.pairs.begin(); i != all.pairs.end();i++)
+    {
+      v_array<feature>& first = ec.atomics((int)(*i)[0]);
+      v_array<feature>& second = ec.atomics((int)(*i)[1]);
+      for (feature* f1 = first.begin; f1 != first.end; f1++)
+	{
+	  uint32_t halfhash = quadratic_constant * (f1->weight_index + offset);
+	  for (feature* f2 = second.begin; f2 != second.end; f2++)
+	    {
+	      size_t index = (uint32_t)(f2->weight_index + halfhash);
+	      for (size_t c = 0; c < count; c++, index += quadratic_stride)
+		T(dat, c, f1->x * f2->x, weights[index & mask]);
+	    }
+	}
+    }
+
+  size_t cubic_stride = cubic_constant2 * (cubic_constant + 1) * (uint32_t)step;
+  for (vector<string>::iterator i = all.triples.begin(); i != all.triples.end();i++)
+    {
+      v_array<feature>& first = ec.atomics((int)(*i)[0]);
+      v_array<feature>& second = ec.atomics((int)(*i)[1]);
+      v_array<feature>& third = ec.atomics((int)(*i)[2]);
+      if (first.size() == 0 || second.size() == 0 || third.size() == 0)
+	continue;
+      for (feature* f1 = first.begin; f1 != first.end; f1++)
+	for (feature* f2 = second.begin; f2 != second.end; f2++)
+	  {
+	    uint32_t halfhash = cubic_constant2 * (cubic_constant * (f1->weight_index + offset) + f2->weight_index + offset);
+	    float mult = f1->x * f2->x;
+	    for (feature* f3 = third.begin; f3 != third.end; f3++)
+	      {
+		size_t index = (uint32_t)(f3->weight_index + halfhash);
+		for (size_t c = 0; c < count; c++, index += cubic_stride)
+		  T(dat, c, mult * f3->x, weights[index & mask]);
+	      }
+	  }
+    }
+}
+
+template<bool sqrt_rate, size_t adaptive, size_t normalized, size_t feature_mask>
+inline void pred_per_update_multi(v_array<multiupdate_data>& d, size_t c, float x, float& fw)
+{
+  if (d[c].nd.g != 0)
+    pred_per_update_feature<sqrt_rate, adaptive, normalized, feature_mask>(d[c].nd, x, fw);
+}
+
+template<bool sqrt_rate, size_t adaptive, size_t normalized, size_t feature_mask>
+inline void update_multi(v_array<multiupdate_data>& d, size_t c, float x, float& fw)
+{
+  if (d[c].update != 0)
+    {
+      train_data s = {d[c].update, d[c].nd.pd};
+      update_feature<sqrt_rate, adaptive, normalized, feature_mask>(s, x, fw);
+    }
+}
+
+/* Updates count weight vectors step apart, as update() would one after the other, with two walks over
+   the features instead of two per vector: one for the adaptive and normalized state, and one for the
+   weights.  The scalar work in between (the losses, the running norm and the updates) is done vector
+   by vector in order, so the result is update()'s unless different vectors' features share a weight.
+   Options that keep state between updates go one at a time. */
+template<bool sqrt_rate, size_t adaptive, size_t normalized, size_t feature_mask>
+void multiupdate(gd& g, learner& base, example& ec, size_t count, size_t step, VW::prediction* pred, float* labels)
+{
+  vw& all = *g.all;
+  label_data& ld = *(label_data*)ec.ld;
+
+  if (g.active_simulation || all.active || all.reg_mode || all.sparse || averaging_periodically(g))
+    {
+      for (size_t c = 0; c < count; c++)
+	{
+	  ld.label = labels[c];
+	  ld.prediction = pred[c].value;
+	  ec.partial_prediction = pred[c].partial_prediction;
+	  ec.ft_offset += (uint32_t)(step*c);
+	  update<sqrt_rate, adaptive, normalized, feature_mask>(g, base, ec);
+	  ec.ft_offset -= (uint32_t)(step*c);
+	}
+      return;
+    }
+
+  float minus_power_t_norm = (adaptive ? all.power_t : 0.f) - 1.f;
+  bool learning = all.training && !ec.test_only;
+  g.multi.clear();
+  for (size_t c = 0; c < count; c++)
+    {
+      multiupdate_data d = {{0., 0., 0., {-all.power_t, minus_power_t_norm}}, 0.};
+      if ((adaptive || normalized) && learning && labels[c] != FLT_MAX
+	  && all.loss->getLoss(all.sd, pred[c].value, labels[c]) * ld.weight > 0.)
+	d.nd.g = all.loss->getSquareGrad(pred[c].value, labels[c]) * ld.weight;
+      g.multi.push_back(d);
+    }
+  if (adaptive || normalized)
+    foreach_feature_multi<v_array<multiupdate_data>, pred_per_update_multi<sqrt_rate, adaptive, normalized, feature_mask> >(all, ec, g.multi, count, step);
+
+  float t = (float)(ec.example_t - all.sd->weighted_holdout_examples);
+  bool updates = false;
+  for (size_t c = 0; c < count; c++)
+    {
+      ld.label = labels[c];
+      ld.prediction = pred[c].value;
+      ec.partial_prediction = pred[c].partial_prediction;
+      ec.eta_round = 0;
+      if (ld.label != FLT_MAX)
+	ec.loss = all.loss->getLoss(all.sd, ld.prediction, ld.label) * ld.weight;
+      if (ld.label == FLT_MAX || !learning || ec.loss <= 0.)
+	continue;
+
+      float norm;
+      if (!adaptive && !normalized)
+	norm = ec.total_sum_feat_sq;
+      else if (g.multi[c].nd.g == 0)
+	norm = 1.;
+      else
+	norm = finish_pred_per_update<sqrt_rate, adaptive, normalized>(all, ec, g.multi[c].nd);
+
+      ec.eta_round = (float) (get_update<adaptive>(all, ld, norm, t) / all.sd->contraction);
+      if (fabsf(ec.eta_round) != 0.f)
+	{
+	  g.multi[c].update = normalize_update<sqrt_rate, adaptive, normalized>(all, ec, ec.eta_round);
+	  updates = true;
+	}
+    }
+  if (updates)
+    foreach_feature_multi<v_array<multiupdate_data>, update_multi<sqrt_rate, adaptive, normalized, feature_mask> >(all, ec, g.multi, count, step);
 }
 
 void sync_weights(vw& all) {
@@ -578,7 +979,12 @@ void sync_weights(vw& all) {
   uint32_t length = 1 << all.num_bits;
   size_t stride = 1 << all.reg.stride_shift;
   for(uint32_t i = 0; i < length && all.reg_mode; i++)
-    all.reg.weight_vector[stride*i] = trunc_weight(all.reg.weight_vector[stride*i], (float)all.sd->gravity) * (float)all.sd->contraction;
+    {
+      weight w = trunc_weight(all.reg.weight_vector[stride*i], (float)all.sd->gravity) * (float)all.sd->contraction;
+      if (all.sparse && w != all.reg.weight_vector[stride*i])
+	mark_touched(*all.sparse, i);
+      all.reg.weight_vector[stride*i] = w;
+    }
   all.sd->gravity = 0.;
   all.sd->contraction = 1.;
 }
@@ -591,6 +997,12 @@ void save_load_regressor(vw& all, io_buf& model_file, bool read, bool text)
   uint32_t i = 0;
   size_t brw = 1;
 
+  if (!read && PS::partial(all))
+    {
+      PS::save_weights(all, model_file, text);
+      return;
+    }
+
   if(all.print_invert){ //write readable model with feature names           
     weight* v;
     char buff[512];
@@ -619,7 +1031,13 @@ void save_load_regressor(vw& all, io_buf& model_file, bool read, bool text)
 	{
 	  c++;
 	  brw = bin_read_fixed(model_file, (char*)&i, sizeof(i),"");
-	  if (brw > 0)
+	  if (brw > 0 && PS::partial(all))
+	    {
+	      weight w;
+	      brw += bin_read_fixed(model_file, (char*)&w, sizeof(w), "");
+	      PS::seed(all, i, w);
+	    }
+	  else if (brw > 0)
 	    {
 	      assert (i< length);		
 	      v = &(all.reg.weight_vector[stride*i]);
@@ -650,10 +1068,17 @@ void save_load_regressor(vw& all, io_buf& model_file, bool read, bool text)
 	i++;
     }
   while ((!read && i < length) || (read && brw >0));  
+  if (read && PS::partial(all))
+    PS::finish_seeding(all);
 }
 
 void save_load_online_state(vw& all, io_buf& model_file, bool read, bool text)
 {
+  if (PS::partial(all))
+    {
+      cerr << "the learning rate state of --save_resume needs --ps_cache_bits of at least -b" << endl;
+      throw exception();
+    }
   char buff[512];
   
   uint32_t text_len = sprintf(buff, "initial_t %f\n", all.initial_t);
@@ -797,9 +1222,8 @@ void save_load(gd& g, io_buf& model_file, bool read, bool text)
 
       if(all->adaptive && all->initial_t > 0)
 	{
-	  uint32_t length = 1 << all->num_bits;
 	  uint32_t stride = 1 << all->reg.stride_shift;
-	  for (size_t j = 1; j < stride*length; j+=stride)
+	  for (size_t j = 1; j <= all->reg.weight_mask; j+=stride)
 	    {
 	      all->reg.weight_vector[j] = all->initial_t;   //for adaptive update, we interpret initial_t as previously seeing initial_t fake datapoints, all with squared gradient=1
 	      //NOTE: this is not invariant to the scaling of the data (i.e. when combined with normalized). Since scaling the data scales the gradient, this should ideally be 
@@ -826,6 +1250,11 @@ void save_load(gd& g, io_buf& model_file, bool read, bool text)
       else
 	save_load_regressor(*all, model_file, read, text);
     }
+
+  if (read && all->sparse)
+    sparse_sync_init(*all);
+  if (read && all->ps)
+    PS::attach(*all);
 }
 
 template<bool sqrt_rate, size_t adaptive, size_t normalized, size_t next>
@@ -836,6 +1265,7 @@ size_t set_learn(vw& all, learner* ret, bool feature_mask_off)
     {
       ret->set_learn<gd, learn<sqrt_rate, adaptive,normalized,0> >();
       ret->set_update<gd, update<sqrt_rate, adaptive,normalized,0> >();
+      ret->set_multiupdate<gd, multiupdate<sqrt_rate, adaptive,normalized,0> >();
       all.feature_mask_idx = 0;
       return next;
     }
@@ -843,6 +1273,7 @@ size_t set_learn(vw& all, learner* ret, bool feature_mask_off)
     {
       ret->set_learn<gd, learn<sqrt_rate, adaptive,normalized,next> >();
       ret->set_update<gd, update<sqrt_rate, adaptive,normalized,next> >();
+      ret->set_multiupdate<gd, multiupdate<sqrt_rate, adaptive,normalized,next> >();
       all.feature_mask_idx = next;
       return next+1;
     }
@@ -884,6 +1315,26 @@ learner* setup(vw& all, po::variables_map& vm)
   g->normalized_sum_norm_x = all.normalized_sum_norm_x;
   g->no_win_counter = 0;
   g->early_stop_thres = 3;
+  g->overlap = vm.count("overlap_allreduce") && all.span_server != "";
+  if (all.span_server != "")
+    {
+      if (vm.count("average_every"))
+	g->average_every = vm["average_every"].as<size_t>();
+      if (vm.count("average_seconds"))
+	g->average_seconds = vm["average_seconds"].as<size_t>();
+      g->last_average = time(NULL);
+      g->pass_average.count_finished = averaging_periodically(*g);
+    }
+  if (g->overlap && averaging_periodically(*g))
+    {
+      cerr << "--overlap_allreduce can't be combined with --average_every or --average_seconds" << endl;
+      throw exception();
+    }
+  if ((g->overlap || averaging_periodically(*g)) && all.sparse)
+    {
+      cerr << "--sparse_allreduce can't be combined with background averaging" << endl;
+      throw exception();
+    }
 
   bool feature_mask_off = true;
   if(vm.count("feature_mask"))
@@ -929,11 +1380,13 @@ learner* setup(vw& all, po::variables_map& vm)
   if (all.reg_mode % 2)
     {
       ret->set_predict<gd, predict<true> >();
+      ret->set_multipredict<gd, multipredict<true> >();
       g->predict = predict<true>;
     }
   else
     {
       ret->set_predict<gd, predict<false> >();
+      ret->set_multipredict<gd, multipredict<false> >();
       g->predict = predict<true>;
     }
   
@@ -949,6 +1402,25 @@ learner* setup(vw& all, po::variables_map& vm)
   ret->set_save_load<gd,save_load>();
 
   ret->set_end_pass<gd, end_pass>();
+  ret->set_finish<gd, finish>();
   return ret;
 }
 }
+
+namespace VW {
+  prediction predict(vw& all, const example& ec)
+  {
+    if (all.scorer == NULL || all.l->get_base() != all.scorer)
+      { //a reduction above it would change the prediction, and a score for another offset is no prediction at all.
+	cerr << "VW::predict requires a gradient descent learner with no reductions but the scorer" << endl;
+	throw exception();
+      }
+    prediction ret;
+    if (all.reg_mode % 2)
+      ret.partial_prediction = GD::trunc_predict(all, ec, (float)all.sd->gravity);
+    else
+      ret.partial_prediction = GD::inline_predict(all, ec);
+    ret.value = GD::finalize_prediction(all, ret.partial_prediction * (float)all.sd->contraction);
+    return ret;
+  }
+}
@@ -38,36 +38,36 @@ void output_and_account_example(example* ec);
    }
 
  template <class R, void (*T)(R&, const float, float&)>
-   inline void foreach_feature(vw& all, example& ec, R& dat)
+   inline void foreach_feature(vw& all, const example& ec, R& dat)
    {
      uint32_t offset = ec.ft_offset;
 
      for (unsigned char* i = ec.indices.begin; i != ec.indices.end; i++) 
-       foreach_feature<R,T>(all.reg.weight_vector, all.reg.weight_mask, ec.atomics[*i].begin, ec.atomics[*i].end, dat, offset);
+       foreach_feature<R,T>(all.reg.weight_vector, all.reg.weight_mask, ec.atomics(*i).begin, ec.atomics(*i).end, dat, offset);
      
      for (vector<string>::iterator i = all.pairs.begin(); i != all.pairs.end();i++) {
-       if (ec.atomics[(int)(*i)[0]].size() > 0) {
-		v_array<feature> temp = ec.atomics[(int)(*i)[0]];
+       if (ec.atomics((int)(*i)[0]).size() > 0) {
+		v_array<feature> temp = ec.atomics((int)(*i)[0]);
 		 for (; temp.begin != temp.end; temp.begin++)
 		   {
 			 uint32_t halfhash = quadratic_constant * (temp.begin->weight_index + offset);
        
-			 foreach_feature<R,T>(all.reg.weight_vector, all.reg.weight_mask, ec.atomics[(int)(*i)[1]].begin, ec.atomics[(int)(*i)[1]].end, dat, 
+			 foreach_feature<R,T>(all.reg.weight_vector, all.reg.weight_mask, ec.atomics((int)(*i)[1]).begin, ec.atomics((int)(*i)[1]).end, dat, 
 					halfhash, temp.begin->x);
 		   }
        }
      }
      
      for (vector<string>::iterator i = all.triples.begin(); i != all.triples.end();i++) {
-       if ((ec.atomics[(int)(*i)[0]].size() == 0) || (ec.atomics[(int)(*i)[1]].size() == 0) || (ec.atomics[(int)(*i)[2]].size() == 0)) { continue; }
-       v_array<feature> temp1 = ec.atomics[(int)(*i)[0]];
+       if ((ec.atomics((int)(*i)[0]).size() == 0) || (ec.atomics((int)(*i)[1]).size() == 0) || (ec.atomics((int)(*i)[2]).size() == 0)) { continue; }
+       v_array<feature> temp1 = ec.atomics((int)(*i)[0]);
        for (; temp1.begin != temp1.end; temp1.begin++) {
-	 v_array<feature> temp2 = ec.atomics[(int)(*i)[1]];
+	 v_array<feature> temp2 = ec.atomics((int)(*i)[1]);
 	 for (; temp2.begin != temp2.end; temp2.begin++) {
 	   
 	   uint32_t halfhash = cubic_constant2 * (cubic_constant * (temp1.begin->weight_index + offset) + temp2.begin->weight_index + offset);
 	   float mult = temp1.begin->x * temp2.begin->x;
-	   foreach_feature<R,T>(all.reg.weight_vector, all.reg.weight_mask, ec.atomics[(int)(*i)[2]].begin, ec.atomics[(int)(*i)[2]].end, dat, halfhash, mult);
+	   foreach_feature<R,T>(all.reg.weight_vector, all.reg.weight_mask, ec.atomics((int)(*i)[2]).begin, ec.atomics((int)(*i)[2]).end, dat, halfhash, mult);
 	 }
        }
      }
@@ -77,9 +77,9 @@ void output_and_account_example(example* ec);
    p += fw * fx;
  }
 
- inline float inline_predict(vw& all, example& ec)
+ inline float inline_predict(vw& all, const example& ec)
  {
-   label_data* ld = (label_data*)ec.ld;
+   const label_data* ld = (const label_data*)ec.ld;
    float temp = ld->initial;
    foreach_feature<float, vec_add>(all, ec, temp);
    return temp;
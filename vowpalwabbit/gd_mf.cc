@@ -41,7 +41,7 @@ void mf_print_offset_features(vw& all, example& ec, size_t offset)
 	  cout << ':' << weights[(f->weight_index + offset) & mask];
 	}
     else
-      for (feature *f = ec.atomics[*i].begin; f != ec.atomics[*i].end; f++)
+      for (feature *f = ec.atomics(*i).begin; f != ec.atomics(*i).end; f++)
 	{
 	  size_t index = (f->weight_index + offset) & all.reg.weight_mask;
 	  
@@ -50,7 +50,7 @@ void mf_print_offset_features(vw& all, example& ec, size_t offset)
 	  cout  << ':' << weights;
 	}
   for (vector<string>::iterator i = all.pairs.begin(); i != all.pairs.end();i++) 
-    if (ec.atomics[(int)(*i)[0]].size() > 0 && ec.atomics[(int)(*i)[1]].size() > 0)
+    if (ec.atomics((int)(*i)[0]).size() > 0 && ec.atomics((int)(*i)[1]).size() > 0)
       {
 	/* print out nsk^feature:hash:value:weight:nsk^feature^:hash:value:weight:prod_weights */
 	for (size_t k = 1; k <= all.rank; k++)
@@ -95,7 +95,7 @@ float mf_predict(vw& all, example& ec)
   float linear_prediction = 0.;
   // linear terms
   for (unsigned char* i = ec.indices.begin; i != ec.indices.end; i++) 
-    GD::foreach_feature<float, GD::vec_add>(all.reg.weight_vector, all.reg.weight_mask, ec.atomics[*i].begin, ec.atomics[*i].end, linear_prediction);
+    GD::foreach_feature<float, GD::vec_add>(all.reg.weight_vector, all.reg.weight_mask, ec.atomics(*i).begin, ec.atomics(*i).end, linear_prediction);
 
   // store constant + linear prediction
   // note: constant is now automatically added
@@ -106,20 +106,20 @@ float mf_predict(vw& all, example& ec)
   // interaction terms
   for (vector<string>::iterator i = all.pairs.begin(); i != all.pairs.end();i++) 
     {
-      if (ec.atomics[(int)(*i)[0]].size() > 0 && ec.atomics[(int)(*i)[1]].size() > 0)
+      if (ec.atomics((int)(*i)[0]).size() > 0 && ec.atomics((int)(*i)[1]).size() > 0)
 	{
 	  for (uint32_t k = 1; k <= all.rank; k++)
 	    {
 	      // x_l * l^k
 	      // l^k is from index+1 to index+all.rank
-	      //float x_dot_l = sd_offset_add(weights, mask, ec.atomics[(int)(*i)[0]].begin, ec.atomics[(int)(*i)[0]].end, k);
+	      //float x_dot_l = sd_offset_add(weights, mask, ec.atomics((int)(*i)[0]).begin, ec.atomics((int)(*i)[0]).end, k);
               float x_dot_l = 0.;
-	      GD::foreach_feature<float, GD::vec_add>(all.reg.weight_vector, all.reg.weight_mask, ec.atomics[(int)(*i)[0]].begin, ec.atomics[(int)(*i)[0]].end, x_dot_l, k);
+	      GD::foreach_feature<float, GD::vec_add>(all.reg.weight_vector, all.reg.weight_mask, ec.atomics((int)(*i)[0]).begin, ec.atomics((int)(*i)[0]).end, x_dot_l, k);
 	      // x_r * r^k
 	      // r^k is from index+all.rank+1 to index+2*all.rank
-	      //float x_dot_r = sd_offset_add(weights, mask, ec.atomics[(int)(*i)[1]].begin, ec.atomics[(int)(*i)[1]].end, k+all.rank);
+	      //float x_dot_r = sd_offset_add(weights, mask, ec.atomics((int)(*i)[1]).begin, ec.atomics((int)(*i)[1]).end, k+all.rank);
               float x_dot_r = 0.;
-	      GD::foreach_feature<float,GD::vec_add>(all.reg.weight_vector, all.reg.weight_mask, ec.atomics[(int)(*i)[1]].begin, ec.atomics[(int)(*i)[1]].end, x_dot_r, k+all.rank);
+	      GD::foreach_feature<float,GD::vec_add>(all.reg.weight_vector, all.reg.weight_mask, ec.atomics((int)(*i)[1]).begin, ec.atomics((int)(*i)[1]).end, x_dot_r, k+all.rank);
 
 	      prediction += x_dot_l * x_dot_r;
 
@@ -176,12 +176,12 @@ void mf_train(vw& all, example& ec, float update)
 
       // linear update
       for (unsigned char* i = ec.indices.begin; i != ec.indices.end; i++) 
-	sd_offset_update(weights, mask, ec.atomics[*i].begin, ec.atomics[*i].end, 0, update, regularization);
+	sd_offset_update(weights, mask, ec.atomics(*i).begin, ec.atomics(*i).end, 0, update, regularization);
       
       // quadratic update
       for (vector<string>::iterator i = all.pairs.begin(); i != all.pairs.end();i++) 
 	{
-	  if (ec.atomics[(int)(*i)[0]].size() > 0 && ec.atomics[(int)(*i)[1]].size() > 0)
+	  if (ec.atomics((int)(*i)[0]).size() > 0 && ec.atomics((int)(*i)[1]).size() > 0)
 	    {
 
 	      // update l^k weights
@@ -190,7 +190,7 @@ void mf_train(vw& all, example& ec, float update)
 		  // r^k \cdot x_r
 		  float r_dot_x = ec.topic_predictions[2*k];
 		  // l^k <- l^k + update * (r^k \cdot x_r) * x_l
-		  sd_offset_update(weights, mask, ec.atomics[(int)(*i)[0]].begin, ec.atomics[(int)(*i)[0]].end, k, update*r_dot_x, regularization);
+		  sd_offset_update(weights, mask, ec.atomics((int)(*i)[0]).begin, ec.atomics((int)(*i)[0]).end, k, update*r_dot_x, regularization);
 		}
 
 	      // update r^k weights
@@ -199,7 +199,7 @@ void mf_train(vw& all, example& ec, float update)
 		  // l^k \cdot x_l
 		  float l_dot_x = ec.topic_predictions[2*k-1];
 		  // r^k <- r^k + update * (l^k \cdot x_l) * x_r
-		  sd_offset_update(weights, mask, ec.atomics[(int)(*i)[1]].begin, ec.atomics[(int)(*i)[1]].end, k+all.rank, update*l_dot_x, regularization);
+		  sd_offset_update(weights, mask, ec.atomics((int)(*i)[1]).begin, ec.atomics((int)(*i)[1]).end, k+all.rank, update*l_dot_x, regularization);
 		}
 
 	    }
@@ -15,6 +15,7 @@ license as described in the file LICENSE.
 #include "parser.h"
 #include "gd.h"
 #include "memory.h"
+#include "shm_transport.h"
 
 using namespace std;
 
@@ -34,7 +35,7 @@ size_t really_read(int sock, void* in, size_t count)
 #ifdef _WIN32
 		  recv(sock,buf,(unsigned int)(count-done),0)
 #else
-		  read(sock,buf,(unsigned int)(count-done))
+		  (SHM::is_channel(sock) ? SHM::read(sock,buf,count-done) : read(sock,buf,(unsigned int)(count-done)))
 #endif
 		  ) == 0)
 	return 0;
@@ -68,7 +69,7 @@ void send_prediction(int sock, global_prediction p)
 #ifdef _WIN32
 	  send(sock, reinterpret_cast<const char*>(&p), sizeof(p), 0)
 #else
-	  write(sock, &p, sizeof(p))
+	  (SHM::is_channel(sock) ? SHM::write(sock, &p, sizeof(p)) : write(sock, &p, sizeof(p)))
 #endif
 	  < (int)sizeof(p))
     {
@@ -307,6 +308,9 @@ vw::vw()
   unique_id = 0;
   total = 1;
   node = 0;
+  sparse = NULL;
+  allreduce_stats = false;
+  ps = NULL;
 
   for (size_t i = 0; i < 256; i++)
     {
@@ -118,6 +118,9 @@ struct regressor {
   uint32_t stride_shift;
 };
 
+struct sparse_sync;
+namespace PS { struct param_client; }
+
 struct vw {
   shared_data* sd;
 
@@ -241,6 +244,9 @@ struct vw {
   size_t unique_id; //unique id for each node in the network, id == 0 means extra io.
   size_t total; //total number of nodes
   size_t node; //node id number
+  sparse_sync* sparse; //non-NULL when averaging only the touched weights.
+  bool allreduce_stats; //print what each averaging sent and how long it took.
+  PS::param_client* ps; //non-NULL when training against parameter servers.
 
   void (*print)(int,float,float,v_array<char>);
   void (*print_text)(int, string, v_array<char>);
@@ -6,6 +6,7 @@ license as described in the file LICENSE.
 #include <string.h>
 
 #include "io_buf.h"
+#include "shm_transport.h"
 
 #ifdef WIN32
 #include <winsock2.h>
@@ -125,6 +126,8 @@ ssize_t io_buf::read_file_or_socket(int f, void* buf, size_t nbytes) {
     return _read(f, buf, (unsigned int)nbytes); 
   }
 #else
+  if (SHM::is_channel(f))
+    return SHM::read(f, buf, nbytes);
   return read(f, buf, (unsigned int)nbytes); 
 #endif
 }
@@ -139,6 +142,8 @@ ssize_t io_buf::write_file_or_socket(int f, const void* buf, size_t nbytes)
     return _write(f, buf, (unsigned int)nbytes);
   }
 #else
+  if (SHM::is_channel(f))
+    return SHM::write(f, buf, nbytes);
   return write(f, buf, (unsigned int)nbytes);
 #endif
 }
@@ -153,6 +158,8 @@ void io_buf::close_file_or_socket(int f)
     _close(f);
   }
 #else
+  if (SHM::is_channel(f))
+    SHM::close(f);
   close(f);
 #endif
 }
@@ -18,11 +18,24 @@ license as described in the file LICENSE.
 #include "gd.h"
 #include "simple_label.h"
 #include "rand48.h"
+#include "hash.h"
 #include "reductions.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 using namespace LEARNER;
 using namespace std;
 
+//the documents of a minibatch, and then its words, are split among --lda_threads threads when built with OpenMP.
+#ifndef _OPENMP
+#define PARALLEL(clauses)
+#elif defined(_MSC_VER)
+#define PARALLEL(clauses) __pragma(clauses)
+#else
+#define PARALLEL(clauses) _Pragma(#clauses)
+#endif
+
 namespace LDA {
 
 class index_feature {
@@ -32,8 +45,19 @@ public:
   bool operator<(const index_feature b) const { return f.weight_index < b.f.weight_index; }
 };
 
+  struct sparse_topic {
+    float u; //the word's exp(E[log beta]) for the topic.
+    uint32_t topic;
+  };
+
+  inline bool more_mass(const sparse_topic& a, const sparse_topic& b) { return a.u > b.u; }
+
+  struct doc_token {
+    uint32_t word; //its run in sorted_features.
+    float x;
+  };
+
   struct lda {
-    v_array<float> Elogtheta;
     v_array<float> decay_levels;
     v_array<float> total_new;
     v_array<example* > examples;
@@ -42,8 +66,21 @@ public:
     v_array<float> digammas;
     v_array<float> v;
     vector<index_feature> sorted_features;
+    v_array<size_t> word_runs; //where each word's run of sorted_features starts, and then where the last one ends.
+    v_array<float> scores; //per document of the minibatch.
+
+    int threads;
+    float* thread_scratch; //per thread, new and old gamma and Elogtheta for lda_loop.
+    float* thread_total_new; //per thread, its share of total_new.
+
+    uint32_t topk; //with --lda_topk, each word of a minibatch only spreads over its topk topics of most mass.
+    v_array<sparse_topic> top_topics; //topk per word run.
+    v_array<doc_token> doc_tokens; //the minibatch's tokens by document.
+    v_array<size_t> doc_ends; //where each document's tokens end.
+    sparse_topic* thread_ranks; //per thread, all.lda of them to pick a word's top topics from.
 
     bool total_lambda_init;
+    float untouched_decay; //what the initial weights of words a model file left out are scaled by.
     
     double example_t;
     vw* all;
@@ -407,12 +444,11 @@ float average_diff(vw& all, float* oldgamma, float* newgamma)
 }
 
 // Returns E_q[log p(\theta)] - E_q[log q(\theta)].
-  float theta_kl(vw& all, v_array<float>& Elogtheta, float* gamma)
+  float theta_kl(vw& all, float* Elogtheta, float* gamma)
 {
   float gammasum = 0;
-  Elogtheta.erase();
   for (size_t k = 0; k < all.lda; k++) {
-    Elogtheta.push_back(mydigamma(gamma[k]));
+    Elogtheta[k] = mydigamma(gamma[k]);
     gammasum += gamma[k];
   }
   float digammasum = mydigamma(gammasum);
@@ -430,75 +466,136 @@ float average_diff(vw& all, float* oldgamma, float* newgamma)
 
 float find_cw(vw& all, float* u_for_w, float* v)
 {
+  size_t K = all.lda;
   float c_w = 0;
-  for (size_t k =0; k<all.lda; k++)
+  for (size_t k =0; k<K; k++)
     c_w += u_for_w[k]*v[k];
 
   return 1.f / c_w;
 }
 
-v_array<float> new_gamma;
-v_array<float> old_gamma;
+inline int thread_number()
+{
+#ifdef _OPENMP
+  return omp_get_thread_num();
+#else
+  return 0;
+#endif
+}
+
 // Returns an estimate of the part of the variational bound that
 // doesn't have to do with beta for the entire corpus for the current
 // setting of lambda based on the document passed in. The value is
 // divided by the total number of words in the document This can be
 // used as a (possibly very noisy) estimate of held-out likelihood.
-  float lda_loop(vw& all, v_array<float>& Elogtheta, float* v,weight* weights,example* ec, float power_t)
+// scratch holds 3*all.lda floats of the calling thread's, so documents can be done in parallel.
+  float lda_loop(vw& all, float* scratch, float* v,weight* weights,example* ec)
 {
-  new_gamma.erase();
-  old_gamma.erase();
-  
-  for (size_t i = 0; i < all.lda; i++)
+  size_t K = all.lda;
+  float* new_gamma = scratch;
+  float* old_gamma = scratch + K;
+  float* Elogtheta = scratch + 2*K;
+  for (size_t i = 0; i < K; i++)
     {
-      new_gamma.push_back(1.f);
-      old_gamma.push_back(0.f);
+      new_gamma[i] = 1.f;
+      old_gamma[i] = 0.f;
     }
-  size_t num_words =0;
-  for (unsigned char* i = ec->indices.begin; i != ec->indices.end; i++)
-    num_words += ec->atomics[*i].end - ec->atomics[*i].begin;
 
   float xc_w = 0;
   float score = 0;
   float doc_length = 0;
   do
     {
-      memcpy(v,new_gamma.begin,sizeof(float)*all.lda);
+      memcpy(v,new_gamma,sizeof(float)*K);
       myexpdigammify(all, v);
 
-      memcpy(old_gamma.begin,new_gamma.begin,sizeof(float)*all.lda);
-      memset(new_gamma.begin,0,sizeof(float)*all.lda);
+      memcpy(old_gamma,new_gamma,sizeof(float)*K);
+      memset(new_gamma,0,sizeof(float)*K);
 
       score = 0;
       size_t word_count = 0;
       doc_length = 0;
       for (unsigned char* i = ec->indices.begin; i != ec->indices.end; i++)
 	{
-	  feature *f = ec->atomics[*i].begin;
-	  for (; f != ec->atomics[*i].end; f++)
+	  feature *f = ec->atomics(*i).begin;
+	  for (; f != ec->atomics(*i).end; f++)
 	    {
 	      float* u_for_w = &weights[(f->weight_index&all.reg.weight_mask)+all.lda+1];
 	      float c_w = find_cw(all, u_for_w,v);
 	      xc_w = c_w * f->x;
               score += -f->x*log(c_w);
-	      size_t max_k = all.lda;
-	      for (size_t k =0; k<max_k; k++) {
+	      for (size_t k =0; k<K; k++) {
 		new_gamma[k] += xc_w*u_for_w[k];
 	      }
 	      word_count++;
               doc_length += f->x;
 	    }
 	}
-      for (size_t k =0; k<all.lda; k++)
+      for (size_t k =0; k<K; k++)
 	new_gamma[k] = new_gamma[k]*v[k]+all.lda_alpha;
     }
-  while (average_diff(all, old_gamma.begin, new_gamma.begin) > all.lda_epsilon);
+  while (average_diff(all, old_gamma, new_gamma) > all.lda_epsilon);
 
   ec->topic_predictions.erase();
-  ec->topic_predictions.resize(all.lda);
-  memcpy(ec->topic_predictions.begin,new_gamma.begin,all.lda*sizeof(float));
+  ec->topic_predictions.resize(K);
+  memcpy(ec->topic_predictions.begin,new_gamma,K*sizeof(float));
 
-  score += theta_kl(all, Elogtheta, new_gamma.begin);
+  score += theta_kl(all, Elogtheta, new_gamma);
+
+  return score / doc_length;
+}
+
+// lda_loop for --lda_topk: each token only spreads over its word's top topics, so it costs
+// O(l.topk) rather than O(all.lda).
+  float lda_loop_sparse(lda& l, float* scratch, float* v, doc_token* token, doc_token* end, example* ec)
+{
+  vw& all = *l.all;
+  size_t K = all.lda;
+  size_t topk = l.topk;
+  float* new_gamma = scratch;
+  float* old_gamma = scratch + K;
+  float* Elogtheta = scratch + 2*K;
+  for (size_t i = 0; i < K; i++)
+    {
+      new_gamma[i] = 1.f;
+      old_gamma[i] = 0.f;
+    }
+
+  float score = 0;
+  float doc_length = 0;
+  do
+    {
+      memcpy(v,new_gamma,sizeof(float)*K);
+      myexpdigammify(all, v);
+
+      memcpy(old_gamma,new_gamma,sizeof(float)*K);
+      memset(new_gamma,0,sizeof(float)*K);
+
+      score = 0;
+      doc_length = 0;
+      for (doc_token* t = token; t != end; t++)
+	{
+	  sparse_topic* top = l.top_topics.begin + t->word*topk;
+	  float c_w = 0;
+	  for (size_t j = 0; j < topk; j++)
+	    c_w += top[j].u*v[top[j].topic];
+	  c_w = 1.f / c_w;
+	  float xc_w = c_w * t->x;
+	  score += -t->x*log(c_w);
+	  for (size_t j = 0; j < topk; j++)
+	    new_gamma[top[j].topic] += xc_w*top[j].u;
+	  doc_length += t->x;
+	}
+      for (size_t k =0; k<K; k++)
+	new_gamma[k] = new_gamma[k]*v[k]+all.lda_alpha;
+    }
+  while (average_diff(all, old_gamma, new_gamma) > all.lda_epsilon);
+
+  ec->topic_predictions.erase();
+  ec->topic_predictions.resize(K);
+  memcpy(ec->topic_predictions.begin,new_gamma,K*sizeof(float));
+
+  score += theta_kl(all, Elogtheta, new_gamma);
 
   return score / doc_length;
 }
@@ -513,6 +610,37 @@ size_t next_pow2(size_t x) {
   return ((size_t)1) << i;
 }
 
+float initial_scale(vw& all)
+{
+  return (float)(all.lda_D / all.lda / all.length() * 200);
+}
+
+// A word's initial weights are derived from its index, so the ones no minibatch or model file has
+// used yet are never stored, nor saved: a model file starts with a record for the word
+// untouched_word, which holds the decay those words are read back with.  A word's slot K is 0
+// until its weights are stored, and then 1 + the decay level they were last brought up to.
+const uint32_t untouched_word = (uint32_t)-1;
+
+float initial_weight(lda& l, uint32_t word, size_t k)
+{
+  uint64_t seed = uniform_hash(&word, sizeof(word), (uint32_t)k);
+  return (float)(-log(1.f - merand48(seed)) + 1.0f) * initial_scale(*l.all);
+}
+
+void materialize(lda& l, weight* weights_for_w, uint32_t word)
+{
+  for (size_t k = 0; k < l.all->lda; k++)
+    weights_for_w[k] = initial_weight(l, word, k) * l.untouched_decay;
+  weights_for_w[l.all->lda] = 1.f;
+}
+
+// Words' weights decay lazily, and are brought up to date only when a minibatch uses them, or on
+// their way out here.
+float decay_since(lda& l, weight* weights_for_w, float level)
+{
+  return fmin(1.0, exp(level - l.decay_levels[(size_t)weights_for_w[l.all->lda] - 1]));
+}
+
 void save_load(lda& l, io_buf& model_file, bool read, bool text)
 {
   vw* all = l.all;
@@ -522,16 +650,11 @@ void save_load(lda& l, io_buf& model_file, bool read, bool text)
   if (read)
     {
       initialize_regressor(*all);
-      for (size_t j = 0; j < stride*length; j+=stride)
-	{
-	  for (size_t k = 0; k < all->lda; k++) {
-	    if (all->random_weights) {
-	      all->reg.weight_vector[j+k] = (float)(-log(frand48()) + 1.0f);
-	      all->reg.weight_vector[j+k] *= (float)(all->lda_D / all->lda / all->length() * 200);
-	    }
-	  }
-	  all->reg.weight_vector[j+all->lda] = all->initial_t;
-	}
+      //total_lambda starts from the expected sum of the initial weights, each (1 - log u) * scale for
+      //a uniform u, and is kept up to date from here on, so nothing has to visit the untouched words.
+      l.total_lambda.erase();
+      for (size_t k = 0; k < all->lda; k++)
+	l.total_lambda.push_back(2.f * initial_scale(*all) * length);
     }
     
   if (model_file.files.size() > 0)
@@ -540,28 +663,54 @@ void save_load(lda& l, io_buf& model_file, bool read, bool text)
       uint32_t text_len;
       char buff[512];
       size_t brw = 1;
+      if (!read && !text)
+	{
+	  uint32_t word = untouched_word;
+	  float decay = l.untouched_decay * fmin(1.0, exp(l.decay_levels.last() - l.decay_levels[0]));
+	  bin_text_read_write_fixed(model_file,(char *)&word, sizeof (word), "", read, buff, 0, text);
+	  bin_text_read_write_fixed(model_file,(char *)&decay, sizeof (decay), "", read, buff, 0, text);
+	}
       do 
 	{
 	  brw = 0;
 	  size_t K = all->lda;
+	  if (!read && all->reg.weight_vector[stride*i+K] == 0)
+	    {
+	      i++;
+	      continue;
+	    }
 	  
 	  text_len = sprintf(buff, "%d ", i);
 	  brw += bin_text_read_write_fixed(model_file,(char *)&i, sizeof (i),
 					   "", read,
 					   buff, text_len, text);
+	  if (read && brw != 0 && i == untouched_word)
+	    {
+	      brw += bin_text_read_write_fixed(model_file,(char *)&l.untouched_decay, sizeof (l.untouched_decay),
+					       "", read, buff, 0, text);
+	      for (size_t k = 0; k < K; k++)
+		l.total_lambda[k] *= l.untouched_decay;
+	      continue;
+	    }
+	  weight* weights_for_w = &(all->reg.weight_vector[stride*i]);
+	  bool untouched = brw != 0 && weights_for_w[K] == 0;
+	  float decay = (brw != 0 && !read) ? decay_since(l, weights_for_w, l.decay_levels.last()) : 1.f;
 	  if (brw != 0)
 	    for (uint32_t k = 0; k < K; k++)
 	      {
-		uint32_t ndx = stride*i+k;
-		
-		weight* v = &(all->reg.weight_vector[ndx]);
-		text_len = sprintf(buff, "%f ", *v + all->lda_rho);
+		weight* v = &(weights_for_w[k]);
+		weight old_v = untouched ? initial_weight(l, i, k) * l.untouched_decay : *v;
+		weight decayed = old_v * decay;
+		text_len = sprintf(buff, "%f ", decayed + all->lda_rho);
 		
-		brw += bin_text_read_write_fixed(model_file,(char *)v, sizeof (*v),
+		brw += bin_text_read_write_fixed(model_file,read ? (char *)v : (char *)&decayed, sizeof (*v),
 						 "", read,
 						 buff, text_len, text);
-		
+		if (read)
+		  l.total_lambda[k] += *v - old_v;
 	      }
+	  if (read && brw != 0)
+	    weights_for_w[K] = 1.f;
 	  if (text)
 	    brw += bin_text_read_write_fixed(model_file,buff,0,
 					     "", read,
@@ -591,17 +740,6 @@ void save_load(lda& l, io_buf& model_file, bool read, bool text)
     float eta = -1;
     float minuseta = -1;
 
-    if (l.total_lambda.size() == 0)
-      {
-	for (size_t k = 0; k < l.all->lda; k++)
-	  l.total_lambda.push_back(0.f);
-	
-	size_t stride = 1 << l.all->reg.stride_shift;
-	for (size_t i =0; i <= l.all->reg.weight_mask;i+=stride)
-	  for (size_t k = 0; k < l.all->lda; k++)
-	    l.total_lambda[k] += l.all->reg.weight_vector[i+k];
-      }
-
     l.example_t++;
     l.total_new.erase();
     for (size_t k = 0; k < l.all->lda; k++)
@@ -624,29 +762,83 @@ void save_load(lda& l, io_buf& model_file, bool read, bool text)
     
     
     weight* weights = l.all->reg.weight_vector;
-    
-    size_t last_weight_index = -1;
-    for (index_feature* s = &l.sorted_features[0]; s <= &l.sorted_features.back(); s++)
+    size_t K = l.all->lda;
+    size_t mask = l.all->reg.weight_mask;
+
+    l.word_runs.erase();
+    for (size_t i = 0; i < l.sorted_features.size(); i++)
+      if (i == 0 || (l.sorted_features[i].f.weight_index & mask) != (l.sorted_features[i-1].f.weight_index & mask))
+	l.word_runs.push_back(i);
+    l.word_runs.push_back(l.sorted_features.size());
+    int words = (int)l.word_runs.size() - 1;
+
+    size_t topk = l.topk;
+    if (topk > 0)
       {
-	if (last_weight_index == s->f.weight_index)
-	  continue;
-	last_weight_index = s->f.weight_index;
-	float* weights_for_w = &(weights[s->f.weight_index & l.all->reg.weight_mask]);
-	float decay = fmin(1.0, exp(l.decay_levels.end[-2] - l.decay_levels.end[(int)(-1 - l.example_t+weights_for_w[l.all->lda])]));
-	float* u_for_w = weights_for_w + l.all->lda+1;
+	if ((size_t)(l.top_topics.end_array - l.top_topics.begin) < words*topk)
+	  l.top_topics.resize(words*topk);
+	//a counting sort of the tokens by document: doc_ends[d+2] counts d's, then doc_ends[d+1] becomes
+	//where d's start, and moves up to where they end as they are placed.
+	l.doc_ends.erase();
+	for (size_t d = 0; d < batch_size+2; d++)
+	  l.doc_ends.push_back(0);
+	for (size_t i = 0; i < l.sorted_features.size(); i++)
+	  l.doc_ends[l.sorted_features[i].document+2]++;
+	for (size_t d = 1; d < batch_size+2; d++)
+	  l.doc_ends[d] += l.doc_ends[d-1];
+	if ((size_t)(l.doc_tokens.end_array - l.doc_tokens.begin) < l.sorted_features.size())
+	  l.doc_tokens.resize(l.sorted_features.size());
+	for (int r = 0; r < words; r++)
+	  for (size_t i = l.word_runs[r]; i < l.word_runs[r+1]; i++)
+	    {
+	      index_feature& f = l.sorted_features[i];
+	      doc_token t = {(uint32_t)r, f.f.x};
+	      l.doc_tokens[l.doc_ends[f.document+1]++] = t;
+	    }
+      }
+
+    PARALLEL(omp parallel for schedule(static))
+    for (int r = 0; r < words; r++)
+      {
+	index_feature* s = &l.sorted_features[l.word_runs[r]];
+	float* weights_for_w = &(weights[s->f.weight_index & mask]);
+	if (weights_for_w[K] == 0)
+	  materialize(l, weights_for_w, (uint32_t)((s->f.weight_index & mask) >> l.all->reg.stride_shift));
+	float decay = decay_since(l, weights_for_w, l.decay_levels.end[-2]);
+	float* u_for_w = weights_for_w + K+1;
 	
-	weights_for_w[l.all->lda] = (float)l.example_t;
-	for (size_t k = 0; k < l.all->lda; k++)
+	weights_for_w[K] = (float)l.decay_levels.size();
+	for (size_t k = 0; k < K; k++)
 	  {
 	    weights_for_w[k] *= decay;
 	    u_for_w[k] = weights_for_w[k] + l.all->lda_rho;
 	  }
 	myexpdigammify_2(*l.all, u_for_w, l.digammas.begin);
+
+	if (topk > 0)
+	  {
+	    sparse_topic* ranks = l.thread_ranks + K*thread_number();
+	    for (size_t k = 0; k < K; k++)
+	      {
+		ranks[k].u = u_for_w[k];
+		ranks[k].topic = (uint32_t)k;
+	      }
+	    nth_element(ranks, ranks + topk - 1, ranks + K, more_mass);
+	    memcpy(l.top_topics.begin + r*topk, ranks, topk*sizeof(sparse_topic));
+	  }
       }
-    
+
+    PARALLEL(omp parallel for schedule(dynamic))
+    for (int d = 0; d < (int)batch_size; d++)
+      if (topk > 0)
+	l.scores[d] = lda_loop_sparse(l, l.thread_scratch + 3*K*thread_number(), &(l.v[d*K]),
+				      l.doc_tokens.begin + l.doc_ends[d], l.doc_tokens.begin + l.doc_ends[d+1], l.examples[d]);
+      else
+	l.scores[d] = lda_loop(*l.all, l.thread_scratch + 3*K*thread_number(), &(l.v[d*K]), weights, l.examples[d]);
+
     for (size_t d = 0; d < batch_size; d++)
       {
-	float score = lda_loop(*l.all, l.Elogtheta, &(l.v[d*l.all->lda]), weights, l.examples[d],l.all->power_t);
+	float score = l.scores[d];
 	if (l.all->audit)
 	  GD::print_audit_features(*l.all, *l.examples[d]);
 	// If the doc is empty, give it loss of 0.
@@ -656,30 +848,49 @@ void save_load(lda& l, io_buf& model_file, bool read, bool text)
 	}
 	return_simple_example(*l.all, NULL, *l.examples[d]);
       }
-    
-    for (index_feature* s = &l.sorted_features[0]; s <= &l.sorted_features.back();)
+
+    memset(l.thread_total_new, 0, l.threads*K*sizeof(float));
+    PARALLEL(omp parallel for schedule(static))
+    for (int r = 0; r < words; r++)
       {
-	index_feature* next = s+1;
-	while(next <= &l.sorted_features.back() && next->f.weight_index == s->f.weight_index)
-	  next++;
+	index_feature* s = &l.sorted_features[l.word_runs[r]];
+	index_feature* next = &l.sorted_features[0] + l.word_runs[r+1];
+	float* total_new = l.thread_total_new + K*thread_number();
 	
-	float* word_weights = &(weights[s->f.weight_index & l.all->reg.weight_mask]);
-	for (size_t k = 0; k < l.all->lda; k++) {
+	float* word_weights = &(weights[s->f.weight_index & mask]);
+	for (size_t k = 0; k < K; k++) {
 	  float new_value = minuseta*word_weights[k];
 	  word_weights[k] = new_value;
 	}
 	
+	if (topk > 0)
+	  for (sparse_topic* top = l.top_topics.begin + r*topk; s != next; s++) {
+	    float* v_s = &(l.v[s->document*K]);
+	    float c_w = 0;
+	    for (size_t j = 0; j < topk; j++)
+	      c_w += top[j].u*v_s[top[j].topic];
+	    c_w = eta*s->f.x / c_w;
+	    for (size_t j = 0; j < topk; j++) {
+	      float new_value = top[j].u*v_s[top[j].topic]*c_w;
+	      total_new[top[j].topic] += new_value;
+	      word_weights[top[j].topic] += new_value;
+	    }
+	  }
+
 	for (; s != next; s++) {
-	  float* v_s = &(l.v[s->document*l.all->lda]);
-	  float* u_for_w = &weights[(s->f.weight_index & l.all->reg.weight_mask) + l.all->lda + 1];
+	  float* v_s = &(l.v[s->document*K]);
+	  float* u_for_w = &weights[(s->f.weight_index & mask) + K + 1];
 	  float c_w = eta*find_cw(*l.all, u_for_w, v_s)*s->f.x;
-	  for (size_t k = 0; k < l.all->lda; k++) {
+	  for (size_t k = 0; k < K; k++) {
 	    float new_value = u_for_w[k]*v_s[k]*c_w;
-	    l.total_new[k] += new_value;
+	    total_new[k] += new_value;
 	    word_weights[k] += new_value;
 	  }
 	}
       }
+    for (int t = 0; t < l.threads; t++)
+      for (size_t k = 0; k < K; k++)
+	l.total_new[k] += l.thread_total_new[t*K + k];
     for (size_t k = 0; k < l.all->lda; k++) {
       l.total_lambda[k] *= minuseta;
       l.total_lambda[k] += l.total_new[k];
@@ -697,9 +908,10 @@ void save_load(lda& l, io_buf& model_file, bool read, bool text)
     l.examples.push_back(&ec);
     l.doc_lengths.push_back(0);
     for (unsigned char* i = ec.indices.begin; i != ec.indices.end; i++) {
-      feature* f = ec.atomics[*i].begin;
-      for (; f != ec.atomics[*i].end; f++) {
+      feature* f = ec.atomics(*i).begin;
+      for (; f != ec.atomics(*i).end; f++) {
 	index_feature temp = {(uint32_t)num_ex, *f};
+	temp.f.weight_index &= (uint32_t)l.all->reg.weight_mask; //so that each word sorts into one run.
 	l.sorted_features.push_back(temp);
 	l.doc_lengths[num_ex] += (int)f->x;
       }
@@ -723,23 +935,20 @@ void save_load(lda& l, io_buf& model_file, bool read, bool text)
       learn_batch(l);
   }
 
-void end_examples(lda& l)
-{
-  for (size_t i = 0; i < l.all->length(); i++) {
-    weight* weights_for_w = & (l.all->reg.weight_vector[i << l.all->reg.stride_shift]);
-    float decay = fmin(1.0, exp(l.decay_levels.last() - l.decay_levels.end[(int)(-1- l.example_t +weights_for_w[l.all->lda])]));
-    for (size_t k = 0; k < l.all->lda; k++) 
-      weights_for_w[k] *= decay;
-  }
-}
-
   void finish_example(vw& all, lda&, example& ec)
 {}
 
   void finish(lda& ld)
   {
     ld.sorted_features.~vector<index_feature>();
-    ld.Elogtheta.delete_v();
+    ld.word_runs.delete_v();
+    ld.scores.delete_v();
+    free(ld.thread_scratch);
+    free(ld.thread_total_new);
+    ld.top_topics.delete_v();
+    ld.doc_tokens.delete_v();
+    ld.doc_ends.delete_v();
+    free(ld.thread_ranks);
     ld.decay_levels.delete_v();
     ld.total_new.delete_v();
     ld.examples.delete_v();
@@ -756,6 +965,8 @@ learner* setup(vw&all, po::variables_map& vm)
   ld->total_lambda_init = 0;
   ld->all = &all;
   ld->example_t = all.initial_t;
+  ld->untouched_decay = 1.f;
+  ld->threads = 1;
 
   po::options_description lda_opts("LDA options");
   lda_opts.add_options()
@@ -763,14 +974,15 @@ learner* setup(vw&all, po::variables_map& vm)
     ("lda_rho", po::value<float>(&all.lda_rho), "Prior on sparsity of topic distributions")
     ("lda_D", po::value<float>(&all.lda_D), "Number of documents")
     ("lda_epsilon", po::value<float>(&all.lda_epsilon), "Loop convergence threshold")
-    ("minibatch", po::value<size_t>(&all.minibatch), "Minibatch size, for LDA");
+    ("minibatch", po::value<size_t>(&all.minibatch), "Minibatch size, for LDA")
+    ("lda_threads", po::value<int>(&ld->threads), "threads to split the documents and words of a minibatch among (needs a build with OpenMP)")
+    ("lda_topk", po::value<uint32_t>(&ld->topk), "spread each word over only this many of its topics of most mass, for large topic counts");
 
   vm = add_options(all, lda_opts);
 
   all.p->sort_features = true;
   float temp = ceilf(logf((float)(all.lda*2+1)) / logf (2.f));
   all.reg.stride_shift = (size_t)temp;
-  all.random_weights = true;
   all.add_constant = false;
 
   if (vm.count("lda") && all.eta > 1.)
@@ -785,6 +997,25 @@ learner* setup(vw&all, po::variables_map& vm)
   }
   
   ld->v.resize(all.lda*all.minibatch);
+  ld->scores.resize(all.minibatch);
+
+  if (ld->threads < 1)
+    ld->threads = 1;
+#ifdef _OPENMP
+  omp_set_num_threads(ld->threads);
+#else
+  if (ld->threads > 1)
+    {
+      cerr << "warning: vw was built without OpenMP, so --lda_threads is ignored" << endl;
+      ld->threads = 1;
+    }
+#endif
+  ld->thread_scratch = (float*)calloc_or_die(3*all.lda*ld->threads, sizeof(float));
+  ld->thread_total_new = (float*)calloc_or_die(all.lda*ld->threads, sizeof(float));
+  if (ld->topk >= all.lda)
+    ld->topk = 0;
+  if (ld->topk > 0)
+    ld->thread_ranks = (sparse_topic*)calloc_or_die(all.lda*ld->threads, sizeof(sparse_topic));
   
   ld->decay_levels.push_back(0.f);
 
@@ -793,7 +1024,6 @@ learner* setup(vw&all, po::variables_map& vm)
   l->set_predict<lda,predict>();
   l->set_save_load<lda,save_load>();
   l->set_finish_example<lda,finish_example>();
-  l->set_end_examples<lda,end_examples>();  
   l->set_end_pass<lda,end_pass>();  
   l->set_finish<lda,finish>();
   
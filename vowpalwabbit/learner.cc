@@ -1,11 +1,49 @@
 #include "global_data.h"
 #include "parser.h"
 #include "learner.h"
+#include "simple_label.h"
+#include "vw.h"
 
 void save_predictor(vw& all, string reg_name, size_t current_pass);
 
 namespace LEARNER
 {
+  void learner::multipredict(example& ec, size_t i, size_t count, VW::prediction* pred)
+  {
+    if (learn_fd.multipredict_f == NULL)
+      {
+	for (size_t c = 0; c < count; c++)
+	  {
+	    predict(ec, i+c);
+	    pred[c].partial_prediction = ec.partial_prediction;
+	    pred[c].value = ((label_data*)ec.ld)->prediction;
+	  }
+	return;
+      }
+    ec.ft_offset += (uint32_t)(increment*i);
+    learn_fd.multipredict_f(learn_fd.data, *learn_fd.base, ec, count, increment, pred);
+    ec.ft_offset -= (uint32_t)(increment*i);
+  }
+
+  void learner::multiupdate(example& ec, size_t i, size_t count, VW::prediction* pred, float* labels)
+  {
+    if (learn_fd.multiupdate_f == NULL)
+      {
+	label_data& ld = *(label_data*)ec.ld;
+	for (size_t c = 0; c < count; c++)
+	  {
+	    ld.label = labels[c];
+	    ld.prediction = pred[c].value;
+	    ec.partial_prediction = pred[c].partial_prediction;
+	    update(ec, i+c);
+	  }
+	return;
+      }
+    ec.ft_offset += (uint32_t)(increment*i);
+    learn_fd.multiupdate_f(learn_fd.data, *learn_fd.base, ec, count, increment, pred, labels);
+    ec.ft_offset -= (uint32_t)(increment*i);
+  }
+
   void generic_driver(vw* all)
   {
     example* ec = NULL;
@@ -11,6 +11,7 @@ using namespace std;
 
 struct vw;
 void return_simple_example(vw& all, void*, example& ec);  
+namespace VW { struct prediction; }
   
 namespace LEARNER
 {
@@ -37,6 +38,8 @@ namespace LEARNER
     void (*learn_f)(void* data, learner& base, example&);
     void (*predict_f)(void* data, learner& base, example&);
     void (*update_f)(void* data, learner& base, example&);
+    void (*multipredict_f)(void* data, learner& base, example&, size_t count, size_t step, VW::prediction* pred);
+    void (*multiupdate_f)(void* data, learner& base, example&, size_t count, size_t step, VW::prediction* pred, float* labels);
   };
 
   struct save_load_data{
@@ -59,13 +62,21 @@ namespace LEARNER
   inline void generic_func(void* data) {}
 
   const save_load_data generic_save_load_fd = {NULL, NULL, generic_sl};
-  const learn_data generic_learn_fd = {NULL, NULL, generic_learner, NULL, NULL};
+  const learn_data generic_learn_fd = {NULL, NULL, generic_learner, NULL, NULL, NULL, NULL};
   const func_data generic_func_fd = {NULL, NULL, generic_func};
   
   template<class R, void (*T)(R&, learner& base, example& ec)>
     inline void tlearn(void* d, learner& base, example& ec)
     { T(*(R*)d, base, ec); }
 
+  template<class R, void (*T)(R&, learner& base, example& ec, size_t count, size_t step, VW::prediction* pred)>
+    inline void tmultipredict(void* d, learner& base, example& ec, size_t count, size_t step, VW::prediction* pred)
+    { T(*(R*)d, base, ec, count, step, pred); }
+
+  template<class R, void (*T)(R&, learner& base, example& ec, size_t count, size_t step, VW::prediction* pred, float* labels)>
+    inline void tmultiupdate(void* d, learner& base, example& ec, size_t count, size_t step, VW::prediction* pred, float* labels)
+    { T(*(R*)d, base, ec, count, step, pred, labels); }
+
   template<class R, void (*T)(R&, io_buf& io, bool read, bool text)>
     inline void tsl(void* d, io_buf& io, bool read, bool text)
   { T(*(R*)d, io, read, text); }
@@ -116,6 +127,9 @@ public:
     learn_fd.update_f = tlearn<T,u>;
   }
 
+  //the learner this one reduces to, NULL for a learning algorithm.
+  inline learner* get_base() { return learn_fd.base; }
+
   inline void predict(example& ec, size_t i=0) 
   { 
     ec.ft_offset += (uint32_t)(increment*i);
@@ -140,6 +154,27 @@ public:
     learn_fd.update_f = tlearn<T,u>;
   }
 
+  //predicts with the count weight vectors from i on into pred, as predict(ec, i+c) would for each c.
+  //A learner that sets it does so in one pass over the features, in which case predicting all of them
+  //and then calling update() for each is cheaper than learning each.
+  void multipredict(example& ec, size_t i, size_t count, VW::prediction* pred);
+  inline bool multipredicts() { return learn_fd.multipredict_f != NULL; }
+  template <class T, void (*u)(T& data, learner& base, example&, size_t count, size_t step, VW::prediction* pred)>
+  inline void set_multipredict()
+  {
+    learn_fd.multipredict_f = tmultipredict<T,u>;
+  }
+
+  //updates the count weight vectors from i on as update(ec, i+c) would for each c, with the label set to
+  //labels[c] and the predictions to pred[c] from multipredict().  A learner that sets it does so in one
+  //walk over the features for the weights and another for their adaptive and normalized state.
+  void multiupdate(example& ec, size_t i, size_t count, VW::prediction* pred, float* labels);
+  template <class T, void (*u)(T& data, learner& base, example&, size_t count, size_t step, VW::prediction* pred, float* labels)>
+  inline void set_multiupdate()
+  {
+    learn_fd.multiupdate_f = tmultiupdate<T,u>;
+  }
+
   //called anytime saving or loading needs to happen. Autorecursive.
   inline void save_load(io_buf& io, bool read, bool text) { save_load_fd.save_load_f(save_load_fd.data, io, read, text); if (save_load_fd.base) save_load_fd.base->save_load(io, read, text); }
   template <class T, void (*sl)(T&, io_buf&, bool, bool)>
@@ -222,6 +257,8 @@ public:
     
     learn_fd.data = dat;
     learn_fd.base = base;
+    learn_fd.multipredict_f = NULL;
+    learn_fd.multiupdate_f = NULL;
 
     finisher_fd.data = dat;
     finisher_fd.base = base;
@@ -69,7 +69,7 @@ namespace LRQ {
     for (unsigned char* i = ec.indices.begin; i != ec.indices.end; ++i)
       {
         if (lrq.lrindices[*i])
-          lrq.orig_size[*i] = ec.atomics[*i].size ();
+          lrq.orig_size[*i] = ec.atomics(*i).size ();
       }
 
     size_t which = ec.example_counter;
@@ -97,7 +97,7 @@ namespace LRQ {
 
             for (unsigned int lfn = 0; lfn < lrq.orig_size[left]; ++lfn)
               {
-                feature* lf = ec.atomics[left].begin + lfn;
+                feature* lf = ec.atomics(left).begin + lfn;
                 float lfx = lf->x;
                 size_t lindex = lf->weight_index + ec.ft_offset;
     
@@ -117,7 +117,7 @@ namespace LRQ {
                              rfn < lrq.orig_size[right]; 
                              ++rfn)
                           {
-                            feature* rf = ec.atomics[right].begin + rfn;
+                            feature* rf = ec.atomics(right).begin + rfn;
 
                             // NB: ec.ft_offset added by base learner
                             float rfx = rf->x;
@@ -128,7 +128,7 @@ namespace LRQ {
                             lrq.x = scale * *lw * lfx * rfx;
                             lrq.weight_index = rwindex; 
 
-                            ec.atomics[right].push_back (lrq);
+                            ec.atomics(right).push_back (lrq);
 
                             if (all.audit)
                               {
@@ -168,8 +168,8 @@ namespace LRQ {
           {
             unsigned char right = (*i)[(which+1)%2];
 
-            ec.atomics[right].end = 
-              ec.atomics[right].begin + lrq.orig_size[right];
+            ec.atomics(right).end = 
+              ec.atomics(right).begin + lrq.orig_size[right];
 
             if (all.audit)
               ec.audit_features[right].end = 
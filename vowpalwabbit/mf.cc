@@ -68,7 +68,7 @@ void predict(mf& data, learner& base, example& ec) {
     int left_ns = (int) (*i)[0];
     int right_ns = (int) (*i)[1];
 
-    if (ec.atomics[left_ns].size() > 0 && ec.atomics[right_ns].size() > 0) {
+    if (ec.atomics(left_ns).size() > 0 && ec.atomics(right_ns).size() > 0) {
       for (size_t k = 1; k <= all->rank; k++) {
 
 	ec.indices[0] = left_ns;
@@ -124,44 +124,44 @@ void learn(mf& data, learner& base, example& ec) {
     int left_ns = (int) (*i)[0];
     int right_ns = (int) (*i)[1];
 
-    if (ec.atomics[left_ns].size() > 0 && ec.atomics[right_ns].size() > 0) {
+    if (ec.atomics(left_ns).size() > 0 && ec.atomics(right_ns).size() > 0) {
 
       // set example to left namespace only
       ec.indices[0] = left_ns;
 
       // store feature values in left namespace
-      copy_array(data.temp_features, ec.atomics[left_ns]);
+      copy_array(data.temp_features, ec.atomics(left_ns));
 
       for (size_t k = 1; k <= all->rank; k++) {
 
 	// multiply features in left namespace by r^k * x_r
-	for (feature* f = ec.atomics[left_ns].begin; f != ec.atomics[left_ns].end; f++)
+	for (feature* f = ec.atomics(left_ns).begin; f != ec.atomics(left_ns).end; f++)
 	  f->x *= data.sub_predictions[2*k];
 
 	// update l^k using base learner
 	base.update(ec, k);
 
 	// restore left namespace features (undoing multiply)
-	copy_array(ec.atomics[left_ns], data.temp_features);
+	copy_array(ec.atomics(left_ns), data.temp_features);
       }
 
       // set example to right namespace only
       ec.indices[0] = right_ns;
 
       // store feature values for right namespace
-      copy_array(data.temp_features, ec.atomics[right_ns]);
+      copy_array(data.temp_features, ec.atomics(right_ns));
 
       for (size_t k = 1; k <= all->rank; k++) {
 
 	// multiply features in right namespace by l^k * x_l
-	for (feature* f = ec.atomics[right_ns].begin; f != ec.atomics[right_ns].end; f++)
+	for (feature* f = ec.atomics(right_ns).begin; f != ec.atomics(right_ns).end; f++)
 	  f->x *= data.sub_predictions[2*k-1];
 
 	// update r^k using base learner
 	base.update(ec, k + all->rank);
 
 	// restore right namespace features
-	copy_array(ec.atomics[right_ns], data.temp_features);
+	copy_array(ec.atomics(right_ns), data.temp_features);
       }
     }
   }
@@ -0,0 +1,515 @@
+/*
+Copyright (c) by respective owners including Yahoo!, Microsoft, and
+individual contributors. All rights reserved.  Released under a BSD (revised)
+license as described in the file LICENSE.
+ */
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sstream>
+
+#include "reductions.h"
+#include "constant.h"
+#include "simple_label.h"
+#include "rand48.h"
+#include "gd.h"
+
+using namespace std;
+using namespace LEARNER;
+
+namespace MLP {
+  const float hidden_min_activation = -3;
+  const float hidden_max_activation = 3;
+  const uint32_t max_layers = 4;
+  //the gradient of a dense layer is summed over blocks of this many outputs by inputs.
+  const size_t block_rows = 16;
+  const size_t block_cols = 256;
+
+  struct mlp {
+    uint32_t layers; //hidden ones.
+    uint32_t width[max_layers+1]; //width[layers] is the output's, 1.
+    size_t unit_offset[max_layers+1]; //of layer l's units in an activation or delta vector.
+    size_t weight_offset[max_layers+1]; //of W_l, width[l] rows of width[l-1] weights and a bias, in a network.
+    size_t params; //per network.
+    size_t hidden_units;
+    size_t dense_units; //the deltas kept for a batch: those of the layers above the first.
+    bool relu;
+    bool dropout;
+    float rate; //adagrad's, for the dense layers.
+    uint64_t xsubi;
+    size_t increment; //of the base.
+    size_t stride; //of this learner; each multiple of it in ft_offset has its own dense layers.
+    size_t networks;
+
+    float* weights;
+    float* sum_sq; //adagrad's, per weight.
+    float* gradient; //of one network, during a flush.
+    size_t batch;
+    size_t* rows; //per network, examples held for its next update.
+    float* activations; //per network, batch rows of hidden_units.
+    float* deltas; //per network, batch rows of dense_units.
+
+    VW::prediction* first; //the first layer's predictions for the current example.
+    float* hidden; //activations before dropout.
+    float* mask; //0 for dropped units, and what kept ones are scaled by.
+    float* units;
+    float* delta; //d loss / d unit input, unweighted.
+
+    loss_function* squared_loss;
+    loss_function* save_loss;
+    void (*save_set_minmax) (shared_data*, float);
+    float save_min_label;
+    float save_max_label;
+
+    vw* all;
+  };
+
+  //the base learns the first layer as a regression on the units' inputs, as --nn does.
+  void enter_hidden(mlp& m)
+  {
+    vw& all = *m.all;
+    m.save_loss = all.loss;
+    m.save_set_minmax = all.set_minmax;
+    m.save_min_label = all.sd->min_label;
+    m.save_max_label = all.sd->max_label;
+    all.loss = m.squared_loss;
+    all.set_minmax = noop_mm;
+    all.sd->min_label = hidden_min_activation;
+    all.sd->max_label = hidden_max_activation;
+  }
+
+  void leave_hidden(mlp& m)
+  {
+    vw& all = *m.all;
+    all.loss = m.save_loss;
+    all.set_minmax = m.save_set_minmax;
+    all.sd->min_label = m.save_min_label;
+    all.sd->max_label = m.save_max_label;
+  }
+
+  inline float activation(mlp& m, float z)
+  {
+    if (m.relu)
+      return z > 0.f ? z : 0.f;
+    return tanhf(z);
+  }
+
+  //d activation / d z, from the activation.
+  inline float slope(mlp& m, float h)
+  {
+    if (m.relu)
+      return h > 0.f ? 1.f : 0.f;
+    return 1.f - h * h;
+  }
+
+  //once every reduction is set up, so that the number of networks is known.
+  void allocate(mlp& m)
+  {
+    if (m.weights != NULL)
+      return;
+    m.networks = m.all->l->increment / m.stride;
+    if (m.networks == 0)
+      m.networks = 1;
+    m.weights = (float*)calloc_or_die(m.networks * m.params, sizeof(float));
+    m.sum_sq = (float*)calloc_or_die(m.networks * m.params, sizeof(float));
+    m.gradient = (float*)calloc_or_die(m.params, sizeof(float));
+    m.rows = (size_t*)calloc_or_die(m.networks, sizeof(size_t));
+    m.activations = (float*)calloc_or_die(m.networks * m.batch * m.hidden_units, sizeof(float));
+    m.deltas = (float*)calloc_or_die(m.networks * m.batch * m.dense_units, sizeof(float));
+
+    for (size_t n = 0; n < m.networks; n++)
+      for (uint32_t l = 1; l <= m.layers; l++)
+	{
+	  size_t in = m.width[l-1];
+	  float* w = m.weights + n * m.params + m.weight_offset[l];
+	  float scale = 2.f * sqrtf(3.f / (float)in); //to keep the units' variance from layer to layer.
+	  for (size_t i = 0; i < m.width[l]; i++, w += in + 1)
+	    for (size_t j = 0; j < in; j++)
+	      w[j] = (float) (frand48 () - 0.5) * scale;
+	}
+  }
+
+  //units[] of the layers above the first from those of the first; returns the output.
+  float forward(mlp& m, float* w)
+  {
+    float* units = m.units;
+    for (uint32_t l = 1; l <= m.layers; l++)
+      {
+	size_t in = m.width[l-1];
+	size_t out = m.width[l];
+	const float* x = units + m.unit_offset[l-1];
+	const float* row = w + m.weight_offset[l];
+	if (l == m.layers)
+	  {
+	    float z = row[in];
+	    for (size_t j = 0; j < in; j++)
+	      z += row[j] * x[j];
+	    return z;
+	  }
+	size_t o = m.unit_offset[l];
+	for (size_t i = 0; i < out; i++, row += in + 1)
+	  {
+	    float z = row[in];
+	    for (size_t j = 0; j < in; j++)
+	      z += row[j] * x[j];
+	    m.hidden[o+i] = activation(m, z);
+	    units[o+i] = m.hidden[o+i] * m.mask[o+i];
+	  }
+      }
+    return 0.f;
+  }
+
+  void backward(mlp& m, float* w, float gradient)
+  {
+    float* delta = m.delta;
+    delta[m.unit_offset[m.layers]] = gradient;
+    for (uint32_t l = m.layers; l >= 1; l--)
+      {
+	size_t in = m.width[l-1];
+	size_t out = m.width[l];
+	const float* d = delta + m.unit_offset[l];
+	const float* row = w + m.weight_offset[l];
+	size_t o = m.unit_offset[l-1];
+	float* e = delta + o;
+	memset(e, 0, in * sizeof(float));
+	for (size_t i = 0; i < out; i++, row += in + 1)
+	  {
+	    float di = d[i];
+	    if (di == 0.f)
+	      continue;
+	    for (size_t j = 0; j < in; j++)
+	      e[j] += row[j] * di;
+	  }
+	for (size_t j = 0; j < in; j++)
+	  e[j] *= slope(m, m.hidden[o+j]) * m.mask[o+j];
+      }
+  }
+
+  //one adagrad step on network n's dense layers with the mean gradient of its held examples.
+  void flush(mlp& m, size_t n)
+  {
+    size_t count = m.rows[n];
+    if (count == 0)
+      return;
+    const float* A = m.activations + n * m.batch * m.hidden_units;
+    const float* D = m.deltas + n * m.batch * m.dense_units;
+    float* G = m.gradient;
+
+    for (uint32_t l = 1; l <= m.layers; l++)
+      {
+	size_t in = m.width[l-1];
+	size_t out = m.width[l];
+	size_t a_offset = m.unit_offset[l-1];
+	size_t d_offset = m.unit_offset[l] - m.width[0];
+	float* g_layer = G + m.weight_offset[l];
+
+	//G_l += D_l^T [A_{l-1} 1], a block of W_l at a time so that it stays in cache over the batch.
+	for (size_t i0 = 0; i0 < out; i0 += block_rows)
+	  {
+	    size_t i1 = min(out, i0 + block_rows);
+	    for (size_t j0 = 0; j0 < in; j0 += block_cols)
+	      {
+		size_t jn = min(in, j0 + block_cols) - j0;
+		for (size_t r = 0; r < count; r++)
+		  {
+		    const float* a = A + r * m.hidden_units + a_offset + j0;
+		    const float* d = D + r * m.dense_units + d_offset;
+		    for (size_t i = i0; i < i1; i++)
+		      {
+			float di = d[i];
+			if (di == 0.f)
+			  continue;
+			float* g = g_layer + i * (in + 1) + j0;
+			for (size_t j = 0; j < jn; j++)
+			  g[j] += di * a[j];
+		      }
+		  }
+	      }
+	  }
+	for (size_t r = 0; r < count; r++)
+	  {
+	    const float* d = D + r * m.dense_units + d_offset;
+	    for (size_t i = 0; i < out; i++)
+	      g_layer[i * (in + 1) + in] += d[i];
+	  }
+      }
+
+    float* w = m.weights + n * m.params;
+    float* s = m.sum_sq + n * m.params;
+    float eta = m.rate;
+    float scale = 1.f / (float)count;
+    size_t params = m.params;
+    for (size_t p = 0; p < params; p++)
+      {
+	float g = G[p] * scale;
+	s[p] += g * g;
+	w[p] -= eta * g / sqrtf(s[p] + 1e-12f);
+	G[p] = 0.f;
+      }
+    m.rows[n] = 0;
+  }
+
+  void flush_all(mlp& m)
+  {
+    for (size_t n = 0; n < m.networks; n++)
+      flush(m, n);
+  }
+
+  template <bool is_learn>
+  void predict_or_learn(mlp& m, learner& base, example& ec)
+  {
+    vw& all = *m.all;
+    label_data* ld = (label_data*)ec.ld;
+    allocate(m);
+
+    size_t n = ec.ft_offset / m.stride;
+    if (n >= m.networks)
+      {
+	cerr << "mlp: example offset " << ec.ft_offset << " is past the last of " << m.networks << " networks" << endl;
+	throw exception();
+      }
+    float* w = m.weights + n * m.params;
+    bool learning = is_learn && all.training && ld->label != FLT_MAX && ld->weight > 0
+      && (all.holdout_set_off || !ec.test_only);
+    uint32_t k = m.width[0];
+
+    for (uint32_t i = 0; i < k; ++i)
+      {
+	uint32_t biasindex = (uint32_t) constant * (all.wpp << all.reg.stride_shift) + i * (uint32_t)m.increment + ec.ft_offset;
+	weight* bias = &all.reg.weight_vector[biasindex & all.reg.weight_mask];
+
+	// avoid saddle point at 0
+	if (*bias == 0)
+	  {
+	    bias[0] = (float) (frand48 () - 0.5);
+
+	    if (m.dropout && all.normalized_updates)
+	      bias[all.normalized_idx] = 1e-4f;
+	  }
+      }
+
+    enter_hidden(m);
+    base.multipredict(ec, 0, k, m.first);
+    leave_hidden(m);
+
+    bool drop = learning && m.dropout;
+    for (size_t i = 0; i < m.hidden_units; ++i)
+      m.mask[i] = drop ? (merand48 (m.xsubi) < 0.5 ? 0.f : 2.f) : 1.f;
+    for (uint32_t i = 0; i < k; ++i)
+      {
+	m.hidden[i] = activation(m, m.first[i].value);
+	m.units[i] = m.hidden[i] * m.mask[i];
+      }
+
+    float output = forward(m, w);
+    float prediction = GD::finalize_prediction(all, output);
+
+    if (learning)
+      {
+	float gradient = all.loss->first_derivative(all.sd, prediction, ld->label);
+	if (fabs (gradient) > 0)
+	  {
+	    backward(m, w, gradient);
+
+	    size_t r = m.rows[n]++;
+	    memcpy(m.activations + (n * m.batch + r) * m.hidden_units, m.units, m.hidden_units * sizeof(float));
+	    float* d = m.deltas + (n * m.batch + r) * m.dense_units;
+	    for (size_t i = 0; i < m.dense_units; i++)
+	      d[i] = m.delta[k + i] * ld->weight;
+	    if (m.rows[n] == m.batch)
+	      flush(m, n);
+
+	    // the first layer's predictions still stand, so only the base's updates are left to do.
+	    float save_label = ld->label;
+	    enter_hidden(m);
+	    for (uint32_t i = 0; i < k; ++i)
+	      {
+		if (m.delta[i] == 0.f)
+		  continue;
+		ld->label = GD::finalize_prediction (all, m.first[i].value - 0.5f * m.delta[i]);
+		if (ld->label != m.first[i].value)
+		  {
+		    if (base.multipredicts())
+		      {
+			ec.partial_prediction = m.first[i].partial_prediction;
+			ld->prediction = m.first[i].value;
+			base.update(ec, i);
+		      }
+		    else
+		      base.learn(ec, i);
+		  }
+	      }
+	    leave_hidden(m);
+	    ld->label = save_label;
+	  }
+      }
+
+    ec.partial_prediction = output;
+    ld->prediction = prediction;
+    ec.loss = ld->label != FLT_MAX ? all.loss->getLoss(all.sd, prediction, ld->label) * ld->weight : 0.f;
+  }
+
+  void end_pass(mlp& m)
+  {
+    flush_all(m);
+  }
+
+  //the dense layers go ahead of the base's weights.
+  void save_load(mlp& m, io_buf& model_file, bool read, bool text)
+  {
+    allocate(m);
+    if (model_file.files.size() == 0)
+      return;
+    if (!read)
+      flush_all(m);
+
+    char buff[512];
+    for (size_t n = 0; n < m.networks; n++)
+      for (uint32_t l = 1; l <= m.layers; l++)
+	{
+	  uint32_t len = (uint32_t)((m.width[l-1] + 1) * sizeof(float));
+	  float* w = m.weights + n * m.params + m.weight_offset[l];
+	  float* s = m.sum_sq + n * m.params + m.weight_offset[l];
+	  for (size_t i = 0; i < m.width[l]; i++, w += m.width[l-1] + 1, s += m.width[l-1] + 1)
+	    {
+	      if (text && !read)
+		{
+		  uint32_t text_len = sprintf(buff, "mlp %d %d %d:", (int)n, (int)l, (int)i);
+		  bin_text_write_fixed(model_file, NULL, 0, buff, text_len, true);
+		  for (size_t j = 0; j <= m.width[l-1]; j++)
+		    {
+		      text_len = sprintf(buff, " %f", w[j]);
+		      bin_text_write_fixed(model_file, NULL, 0, buff, text_len, true);
+		    }
+		  bin_text_write_fixed(model_file, NULL, 0, "\n", 1, true);
+		  continue;
+		}
+	      if (bin_text_read_write_fixed(model_file, (char*)w, len, "", read, "", 0, false) != len
+		  || bin_text_read_write_fixed(model_file, (char*)s, len, "", read, "", 0, false) != len)
+		{
+		  cerr << "mlp: the model file ends in the middle of its dense layers" << endl;
+		  throw exception();
+		}
+	    }
+	}
+  }
+
+  void finish(mlp& m)
+  {
+    delete m.squared_loss;
+    free(m.weights);
+    free(m.sum_sq);
+    free(m.gradient);
+    free(m.rows);
+    free(m.activations);
+    free(m.deltas);
+    free(m.first);
+    free(m.hidden);
+    free(m.mask);
+    free(m.units);
+    free(m.delta);
+  }
+
+  learner* setup(vw& all, po::variables_map& vm)
+  {
+    mlp* m = (mlp*)calloc_or_die(1,sizeof(mlp));
+    m->all = &all;
+
+    po::options_description mlp_opts("MLP options");
+    mlp_opts.add_options()
+      ("mlp_activation", po::value<string>(), "activation of the hidden units: tanh (default) or relu")
+      ("mlp_batch", po::value<size_t>(), "examples per update of the dense layers (default 32)")
+      ("mlp_rate", po::value<float>(), "learning rate of the dense layers (default 0.05)")
+      ("mlp_dropout", "train the network with dropout");
+
+    vm = add_options(all, mlp_opts);
+
+    if (vm.count("nn") || all.bfgs)
+      {
+	cerr << "error: --mlp can't be combined with --nn or --bfgs" << endl;
+	throw exception();
+      }
+
+    string sizes = vm["mlp"].as<string>();
+    std::stringstream ss(sizes);
+    string size;
+    while (getline(ss, size, ','))
+      {
+	int width = atoi(size.c_str());
+	if (m->layers == max_layers || width <= 0)
+	  {
+	    cerr << "error: --mlp takes 1 to " << max_layers << " positive layer sizes, as in 64,32: " << sizes << endl;
+	    throw exception();
+	  }
+	m->width[m->layers++] = (uint32_t)width;
+      }
+    if (m->layers == 0)
+      {
+	cerr << "error: --mlp takes 1 to " << max_layers << " positive layer sizes, as in 64,32: " << sizes << endl;
+	throw exception();
+      }
+    m->width[m->layers] = 1;
+
+    string act = "tanh";
+    if (vm.count("mlp_activation"))
+      act = vm["mlp_activation"].as<string>();
+    if (act == "relu")
+      m->relu = true;
+    else if (act != "tanh")
+      {
+	cerr << "error: --mlp_activation is tanh or relu, not " << act << endl;
+	throw exception();
+      }
+
+    std::stringstream fo;
+    fo << " --mlp " << sizes << " --mlp_activation " << act;
+    all.file_options.append(fo.str());
+
+    m->batch = 32;
+    if (vm.count("mlp_batch"))
+      m->batch = vm["mlp_batch"].as<size_t>();
+    if (m->batch == 0)
+      m->batch = 1;
+
+    m->rate = 0.05f;
+    if (vm.count("mlp_rate"))
+      m->rate = vm["mlp_rate"].as<float>();
+
+    m->dropout = vm.count("mlp_dropout") > 0;
+    if (m->dropout && ! all.quiet)
+      std::cerr << "using dropout for mlp training" << std::endl;
+
+    for (uint32_t l = 1; l <= m->layers; l++)
+      {
+	m->unit_offset[l] = m->unit_offset[l-1] + m->width[l-1];
+	m->weight_offset[l] = m->params;
+	m->params += m->width[l] * (m->width[l-1] + 1);
+      }
+    m->hidden_units = m->unit_offset[m->layers];
+    m->dense_units = m->hidden_units + 1 - m->width[0];
+
+    m->first = (VW::prediction*)calloc_or_die(m->width[0], sizeof(VW::prediction));
+    m->hidden = (float*)calloc_or_die(m->hidden_units, sizeof(float));
+    m->mask = (float*)calloc_or_die(m->hidden_units, sizeof(float));
+    m->units = (float*)calloc_or_die(m->hidden_units, sizeof(float));
+    m->delta = (float*)calloc_or_die(m->hidden_units + 1, sizeof(float));
+
+    m->squared_loss = getLossFunction (0, "squared", 0);
+
+    m->xsubi = 0;
+    if (vm.count("random_seed"))
+      m->xsubi = vm["random_seed"].as<size_t>();
+
+    m->increment = all.l->increment;
+    learner* l = new learner(m, all.l, m->width[0]);
+    m->stride = l->increment;
+    l->set_learn<mlp, predict_or_learn<true> >();
+    l->set_predict<mlp, predict_or_learn<false> >();
+    l->set_save_load<mlp, save_load>();
+    l->set_finish<mlp, finish>();
+    l->set_end_pass<mlp, end_pass>();
+
+    return l;
+  }
+}
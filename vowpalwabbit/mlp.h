@@ -0,0 +1,20 @@
+/*
+Copyright (c) by respective owners including Yahoo!, Microsoft, and
+individual contributors. All rights reserved.  Released under a BSD
+license as described in the file LICENSE.
+ */
+// A feedforward network of up to four hidden layers (--mlp 64,32).  The first layer reads the
+// sparse features through the base learner as --nn's hidden layer does, and is learned per
+// example; the dense layers above it are kept here and learned in mini-batches.
+#ifndef MLP_H
+#define MLP_H
+
+#include "global_data.h"
+#include "parse_args.h"
+
+namespace MLP
+{
+  LEARNER::learner* setup(vw& all, po::variables_map& vm);
+}
+
+#endif
@@ -17,6 +17,7 @@ license as described in the file LICENSE.
 #ifndef _WIN32
 #include <netdb.h>
 #include <strings.h>
+#include <ifaddrs.h>
 #endif
 #include <stdlib.h>
 #include <string.h>
@@ -24,25 +25,32 @@ license as described in the file LICENSE.
 #include <string>
 #include <iostream>
 
+#include "shm_transport.h"
+
 using namespace std;
 
-int open_socket(const char* host)
+hostent* resolve(const char* host, short unsigned int& port)
 {
 #ifdef _WIN32
   const char* colon = strchr(host,':');
 #else
   const char* colon = index(host,':');
 #endif
-  short unsigned int port = 26542;
-  hostent* he;
+  port = 26542;
   if (colon != NULL)
     {
       port = atoi(colon+1);
       string hostname(host,colon-host);
-      he = gethostbyname(hostname.c_str());
+      return gethostbyname(hostname.c_str());
     }
   else
-    he = gethostbyname(host);
+    return gethostbyname(host);
+}
+
+int open_socket(const char* host)
+{
+  short unsigned int port;
+  hostent* he = resolve(host, port);
 
   if (he == NULL)
     {
@@ -81,3 +89,45 @@ int open_socket(const char* host)
     cerr << "write failed!" << endl;
   return sd;
 }
+
+#ifndef _WIN32
+bool is_local(const char* host)
+{
+  short unsigned int port;
+  hostent* he = resolve(host, port);
+  if (he == NULL || he->h_addrtype != AF_INET)
+    return false;
+  in_addr addr = *(in_addr*)(he->h_addr);
+  if ((ntohl(addr.s_addr) >> 24) == 127)
+    return true;
+
+  bool found = false;
+  ifaddrs* interfaces;
+  if (getifaddrs(&interfaces) != 0)
+    return false;
+  for (ifaddrs* i = interfaces; i != NULL && !found; i = i->ifa_next)
+    if (i->ifa_addr != NULL && i->ifa_addr->sa_family == AF_INET)
+      found = ((sockaddr_in*)i->ifa_addr)->sin_addr.s_addr == addr.s_addr;
+  freeifaddrs(interfaces);
+  return found;
+}
+#endif
+
+int open_local_socket(const char* host, const char* shm_path)
+{
+#ifndef _WIN32
+  if (shm_path != NULL && is_local(host))
+    {
+      int sd = SHM::connect_client(shm_path);
+      if (sd >= 0)
+	{
+	  char id = '\0';
+	  if (SHM::write(sd, &id, sizeof(id)) < (int)sizeof(id))
+	    cerr << "write failed!" << endl;
+	  return sd;
+	}
+      cerr << "no shared memory channel at " << shm_path << ", using tcp" << endl;
+    }
+#endif
+  return open_socket(host);
+}
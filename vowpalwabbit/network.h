@@ -7,5 +7,7 @@ license as described in the file LICENSE.
 #define NETWORK_H
 
 int open_socket(const char* host);
+//like open_socket, but a daemon on this machine listening on shm_path is reached over shared memory.
+int open_local_socket(const char* host, const char* shm_path);
 
 #endif
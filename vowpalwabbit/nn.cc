@@ -68,19 +68,20 @@ namespace NN {
     // TODO: output_layer audit
 
     memset (&n.output_layer, 0, sizeof (n.output_layer));
+    n.output_layer.audit_features = no_audit_features;
     n.output_layer.indices.push_back(nn_output_namespace);
     feature output = {1., nn_constant << all.reg.stride_shift};
 
     for (unsigned int i = 0; i < n.k; ++i)
       {
-        n.output_layer.atomics[nn_output_namespace].push_back(output);
+        n.output_layer.atomics(nn_output_namespace).push_back(output);
         ++n.output_layer.num_features;
         output.weight_index += (uint32_t)n.increment;
       }
 
     if (! n.inpass) 
       {
-        n.output_layer.atomics[nn_output_namespace].push_back(output);
+        n.output_layer.atomics(nn_output_namespace).push_back(output);
         ++n.output_layer.num_features;
       }
 
@@ -113,6 +114,7 @@ namespace NN {
 
     float* hidden_units = (float*) alloca (n.k * sizeof (float));
     bool* dropped_out = (bool*) alloca (n.k * sizeof (bool));
+    VW::prediction* hidden_predictions = (VW::prediction*) alloca (n.k * sizeof (VW::prediction));
   
     string outputString;
     stringstream outputStringStream(outputString);
@@ -137,16 +139,22 @@ namespace NN {
             if (n.dropout && n.all->normalized_updates)
               w[n.all->normalized_idx] = 1e-4f;
           }
+      }
 
-	base.predict(ec, i);
+    // the whole hidden layer in one walk over the features, when the base can.
+    base.multipredict(ec, 0, n.k, hidden_predictions);
+    double hidden_contraction = n.all->sd->contraction;
+    double hidden_gravity = n.all->sd->gravity;
 
-        hidden_units[i] = ld->prediction;
+    for (unsigned int i = 0; i < n.k; ++i)
+      {
+        hidden_units[i] = hidden_predictions[i].value;
 
         dropped_out[i] = (n.dropout && merand48 (n.xsubi) < 0.5);
 
         if (shouldOutput) {
           if (i > 0) outputStringStream << ' ';
-          outputStringStream << i << ':' << ec.partial_prediction << ',' << fasttanh (hidden_units[i]);
+          outputStringStream << i << ':' << hidden_predictions[i].partial_prediction << ',' << fasttanh (hidden_units[i]);
         }
       }
     //ld->label = save_label;
@@ -163,18 +171,18 @@ namespace NN {
 CONVERSE: // That's right, I'm using goto.  So sue me.
 
     n.output_layer.total_sum_feat_sq = 1;
-    n.output_layer.sum_feat_sq[nn_output_namespace] = 1;
+    n.output_layer.sum_feat_sq(nn_output_namespace) = 1;
 
     for (unsigned int i = 0; i < n.k; ++i)
       {
         float sigmah = 
           (dropped_out[i]) ? 0.0f : dropscale * fasttanh (hidden_units[i]);
-        n.output_layer.atomics[nn_output_namespace][i].x = sigmah;
+        n.output_layer.atomics(nn_output_namespace)[i].x = sigmah;
 
         n.output_layer.total_sum_feat_sq += sigmah * sigmah;
-        n.output_layer.sum_feat_sq[nn_output_namespace] += sigmah * sigmah;
+        n.output_layer.sum_feat_sq(nn_output_namespace) += sigmah * sigmah;
 
-        uint32_t nuindex = n.output_layer.atomics[nn_output_namespace][i].weight_index + (n.k * (uint32_t)n.increment) + ec.ft_offset;
+        uint32_t nuindex = n.output_layer.atomics(nn_output_namespace)[i].weight_index + (n.k * (uint32_t)n.increment) + ec.ft_offset;
         weight* w = &n.all->reg.weight_vector[nuindex & n.all->reg.weight_mask];
         
         // avoid saddle point at 0
@@ -194,19 +202,19 @@ CONVERSE: // That's right, I'm using goto.  So sue me.
       // in that case
 
       ec.indices.push_back (nn_output_namespace);
-      v_array<feature> save_nn_output_namespace = ec.atomics[nn_output_namespace];
-      ec.atomics[nn_output_namespace] = n.output_layer.atomics[nn_output_namespace];
-      ec.sum_feat_sq[nn_output_namespace] = n.output_layer.sum_feat_sq[nn_output_namespace];
-      ec.total_sum_feat_sq += n.output_layer.sum_feat_sq[nn_output_namespace];
+      v_array<feature> save_nn_output_namespace = ec.atomics(nn_output_namespace);
+      ec.atomics(nn_output_namespace) = n.output_layer.atomics(nn_output_namespace);
+      ec.sum_feat_sq(nn_output_namespace) = n.output_layer.sum_feat_sq(nn_output_namespace);
+      ec.total_sum_feat_sq += n.output_layer.sum_feat_sq(nn_output_namespace);
       if (is_learn)
 	base.learn(ec, n.k);
       else
 	base.predict(ec, n.k);
       n.output_layer.partial_prediction = ec.partial_prediction;
       n.output_layer.loss = ec.loss;
-      ec.total_sum_feat_sq -= n.output_layer.sum_feat_sq[nn_output_namespace];
-      ec.sum_feat_sq[nn_output_namespace] = 0;
-      ec.atomics[nn_output_namespace] = save_nn_output_namespace;
+      ec.total_sum_feat_sq -= n.output_layer.sum_feat_sq(nn_output_namespace);
+      ec.sum_feat_sq(nn_output_namespace) = 0;
+      ec.atomics(nn_output_namespace) = save_nn_output_namespace;
       ec.indices.pop ();
     }
     else {
@@ -243,18 +251,30 @@ CONVERSE: // That's right, I'm using goto.  So sue me.
         save_max_label = n.all->sd->max_label;
         n.all->sd->max_label = hidden_max_activation;
 
+        // the hidden predictions still stand unless the first dropout pass or a regularized output
+        // update changed the weights they were made with, so only the updates are left to do.
+        bool update_only = base.multipredicts() && ! converse
+          && n.all->sd->contraction == hidden_contraction && n.all->sd->gravity == hidden_gravity;
+
         for (unsigned int i = 0; i < n.k; ++i) {
           if (! dropped_out[i]) {
             float sigmah = 
-              n.output_layer.atomics[nn_output_namespace][i].x / dropscale;
+              n.output_layer.atomics(nn_output_namespace)[i].x / dropscale;
             float sigmahprime = dropscale * (1.0f - sigmah * sigmah);
-            uint32_t nuindex = n.output_layer.atomics[nn_output_namespace][i].weight_index + (n.k * (uint32_t)n.increment) + ec.ft_offset;
+            uint32_t nuindex = n.output_layer.atomics(nn_output_namespace)[i].weight_index + (n.k * (uint32_t)n.increment) + ec.ft_offset;
             float nu = n.all->reg.weight_vector[nuindex & n.all->reg.weight_mask];
             float gradhw = 0.5f * nu * gradient * sigmahprime;
 
             ld->label = GD::finalize_prediction (*(n.all), hidden_units[i] - gradhw);
-            if (ld->label != hidden_units[i]) 
-              base.learn(ec, i);
+            if (ld->label != hidden_units[i]) {
+              if (update_only) {
+                ec.partial_prediction = hidden_predictions[i].partial_prediction;
+                ld->prediction = hidden_units[i];
+                base.update(ec, i);
+              }
+              else
+                base.learn(ec, i);
+            }
           }
         }
 
@@ -301,7 +321,7 @@ CONVERSE: // That's right, I'm using goto.  So sue me.
   {
     delete n.squared_loss;
     free (n.output_layer.indices.begin);
-    free (n.output_layer.atomics[nn_output_namespace].begin);
+    dealloc_namespaces(n.output_layer);
   }
 
   learner* setup(vw& all, po::variables_map& vm)
@@ -12,6 +12,9 @@ license as described in the file LICENSE.
 #include "multiclass.h"
 #include "simple_label.h"
 #include "reductions.h"
+#include "vw.h"
+#include "hash.h"
+#include "rand48.h"
 
 using namespace std;
 using namespace LEARNER;
@@ -19,12 +22,119 @@ using namespace MULTICLASS;
 
 namespace OAA {
 
+  struct candidate {
+    uint32_t label;
+    float count;
+  };
+
   struct oaa{
     uint32_t k;
     bool shouldOutput;
     vw* all;
+    VW::prediction* pred; //per class.
+    float* labels; //per class, for multiupdate.
+
+    //With --oaa_candidates, each feature's hash bucket keeps the classes it was most often seen with
+    //(space saving counts), and testing scores only the classes kept under the example's features.
+    uint32_t per_bucket; //0 when every class is scored.
+    size_t bucket_mask;
+    candidate* index; //per_bucket entries per bucket.
+    uint32_t* seen; //per class, the stamp of the last example it was a candidate of.
+    uint32_t stamp;
+    v_array<uint32_t> candidates;
+
+    //With --oaa_negatives, learning updates the label and this many other classes: uniformly sampled
+    //ones, weighted to stand for all the others, after up to half of them from the example's candidates
+    //with --oaa_hard_negatives.  The prediction of such an example is the best of those classes only, so
+    //the progressive loss is optimistic; holdout examples are scored against every class.
+    uint32_t negatives;
+    bool hard_negatives;
+    v_array<float> importance; //per candidate, when learning.
   };
 
+  inline candidate* bucket(oaa& o, feature* f)
+  {//the weight a feature has, which doesn't depend on the stride, hashed again as its low bits are the room for the classes.
+    uint32_t w = (uint32_t)((f->weight_index & o.all->reg.weight_mask) >> o.all->reg.stride_shift);
+    return o.index + (uniform_hash(&w, sizeof(w), 0) & o.bucket_mask) * o.per_bucket;
+  }
+
+  void index_label(oaa& o, example& ec, uint32_t label)
+  {
+    for (unsigned char* i = ec.indices.begin; i != ec.indices.end; i++)
+      for (feature* f = ec.atomics(*i).begin; f != ec.atomics(*i).end; f++)
+	{
+	  candidate* b = bucket(o, f);
+	  candidate* least = b;
+	  uint32_t j = 0;
+	  for (; j < o.per_bucket && b[j].label != label; j++)
+	    if (b[j].count < least->count)
+	      least = b + j;
+	  if (j < o.per_bucket)
+	    b[j].count++;
+	  else
+	    {//evict the least seen class, which is counted as if it had been seen that often already.
+	      least->label = label;
+	      least->count++;
+	    }
+	}
+  }
+
+  void clear_candidates(oaa& o)
+  {
+    o.candidates.erase();
+    o.importance.erase();
+    if (++o.stamp == 0)
+      {
+	memset(o.seen, 0, o.k*sizeof(uint32_t));
+	o.stamp = 1;
+      }
+  }
+
+  inline void add_candidate(oaa& o, uint32_t label, float importance)
+  {
+    o.seen[label-1] = o.stamp;
+    o.candidates.push_back(label);
+    o.importance.push_back(importance);
+  }
+
+  //adds up to limit classes kept under the example's features.
+  void collect_candidates(oaa& o, example& ec, size_t limit)
+  {
+    size_t end = o.candidates.size() + limit;
+    for (unsigned char* i = ec.indices.begin; i != ec.indices.end; i++)
+      for (feature* f = ec.atomics(*i).begin; f != ec.atomics(*i).end; f++)
+	{
+	  candidate* b = bucket(o, f);
+	  for (uint32_t j = 0; j < o.per_bucket; j++)
+	    if (b[j].count > 0 && b[j].label <= o.k && o.seen[b[j].label-1] != o.stamp)
+	      {
+		if (o.candidates.size() == end)
+		  return;
+		add_candidate(o, b[j].label, 1.f);
+	      }
+	}
+  }
+
+  void sample_negatives(oaa& o, example& ec, uint32_t label)
+  {
+    clear_candidates(o);
+    add_candidate(o, label, 1.f);
+    if (o.hard_negatives)
+      collect_candidates(o, ec, o.negatives/2);
+    uint32_t drawn = (uint32_t)(o.negatives + 1 - o.candidates.size());
+    uint32_t rest = (uint32_t)(o.k - o.candidates.size());
+    float importance = (float)rest / (float)drawn;
+    while (drawn > 0)
+      {
+	uint32_t c = min((uint32_t)(frand48() * o.k) + 1, o.k);
+	if (o.seen[c-1] != o.stamp)
+	  {
+	    add_candidate(o, c, importance);
+	    drawn--;
+	  }
+      }
+  }
+
   template <bool is_learn>
   void predict_or_learn(oaa& o, learner& base, example& ec) {
     vw* all = o.all;
@@ -42,11 +152,66 @@ namespace OAA {
     label_data simple_temp;
     simple_temp.initial = 0.;
     simple_temp.weight = mc_label_data->weight;
+    simple_temp.label = is_learn ? -1.f : FLT_MAX;
     ec.ld = &simple_temp;
 
-    for (uint32_t i = 1; i <= o.k; i++)
+    bool testing = !is_learn || !all->training;
+    bool sampling = !testing && o.negatives > 0 && mc_label_data->label <= o.k && !ec.test_only;
+    o.candidates.erase();
+    if (testing && o.per_bucket > 0)
       {
+	clear_candidates(o);
+	collect_candidates(o, ec, o.k);
+      }
+    if (sampling)
+      sample_negatives(o, ec, mc_label_data->label);
+    if (o.candidates.size() > 0)
+      {//only these classes are scored.
+	for (uint32_t* c = o.candidates.begin; c != o.candidates.end; c++)
+	  {
+	    if (sampling)
+	      {
+		simple_temp.label = *c == mc_label_data->label ? 1.f : -1.f;
+		simple_temp.weight = mc_label_data->weight * o.importance[c - o.candidates.begin];
+		base.learn(ec, *c-1);
+	      }
+	    else
+	      base.predict(ec, *c-1);
+	    if (ec.partial_prediction > score || (ec.partial_prediction == score && *c < prediction))
+	      {
+		score = ec.partial_prediction;
+		prediction = *c;
+	      }
+	    if (o.shouldOutput) {
+	      if (c != o.candidates.begin) outputStringStream << ' ';
+	      outputStringStream << *c << ':' << ec.partial_prediction;
+	    }
+	  }
+	if (sampling && o.per_bucket > 0)
+	  index_label(o, ec, mc_label_data->label);
+	mc_label_data->prediction = prediction;
+	ec.ld = mc_label_data;
+	if (o.shouldOutput)
+	  all->print_text(all->raw_prediction, outputStringStream.str(), ec.tag);
+	return;
+      }
+
+    //all classes are predicted in one pass over the features, and then updated together.
+    bool one_pass = !is_learn || base.multipredicts();
+    if (one_pass)
+      {
+	base.multipredict(ec, 0, o.k, o.pred);
 	if (is_learn)
+	  {
+	    for (uint32_t i = 1; i <= o.k; i++)
+	      o.labels[i-1] = mc_label_data->label == i ? 1.f : -1.f;
+	    base.multiupdate(ec, 0, o.k, o.pred, o.labels);
+	  }
+      }
+
+    for (uint32_t i = 1; i <= o.k; i++)
+      {
+	if (is_learn && !one_pass)
 	  {
 	    if (mc_label_data->label == i)
 	      simple_temp.label = 1;
@@ -54,21 +219,24 @@ namespace OAA {
 	      simple_temp.label = -1;
 
 	    base.learn(ec, i-1);
+	    o.pred[i-1].partial_prediction = ec.partial_prediction;
 	  }
-	else
-	  base.predict(ec, i-1);
+	float partial_prediction = o.pred[i-1].partial_prediction;
 
-        if (ec.partial_prediction > score)
+        if (partial_prediction > score)
           {
-            score = ec.partial_prediction;
+            score = partial_prediction;
             prediction = i;
           }
 	
         if (o.shouldOutput) {
           if (i > 1) outputStringStream << ' ';
-          outputStringStream << i << ':' << ec.partial_prediction;
+          outputStringStream << i << ':' << partial_prediction;
         }
       }	
+    if (is_learn && o.per_bucket > 0 && all->training && mc_label_data->label <= o.k && !ec.test_only)
+      index_label(o, ec, mc_label_data->label);
+
     mc_label_data->prediction = prediction;
     ec.ld = mc_label_data;
     
@@ -82,26 +250,122 @@ namespace OAA {
     VW::finish_example(all, &ec);
   }
 
+  void save_load(oaa& o, io_buf& model_file, bool read, bool text)
+  {
+    if (o.per_bucket == 0 || model_file.files.size() == 0 || text)
+      return;
+    uint32_t shape[2] = {o.per_bucket, (uint32_t)(o.bucket_mask + 1)};
+    uint32_t buckets = 0;
+    size_t bucket_size = o.per_bucket*sizeof(candidate);
+    if (read)
+      {
+	uint32_t file_shape[2];
+	bin_read_fixed(model_file, (char*)file_shape, sizeof(file_shape), "");
+	if (file_shape[0] != shape[0] || file_shape[1] != shape[1])
+	  {
+	    cerr << "the model has no candidate index of " << o.per_bucket << " classes in " << shape[1] << " buckets" << endl;
+	    throw exception();
+	  }
+	bin_read_fixed(model_file, (char*)&buckets, sizeof(buckets), "");
+	for (uint32_t n = 0; n < buckets; n++)
+	  {
+	    uint32_t b;
+	    bin_read_fixed(model_file, (char*)&b, sizeof(b), "");
+	    if (b > o.bucket_mask)
+	      {
+		cerr << "bad model format!" << endl;
+		throw exception();
+	      }
+	    bin_read_fixed(model_file, (char*)(o.index + b*o.per_bucket), bucket_size, "");
+	  }
+      }
+    else
+      {//only the buckets some feature was seen in.
+	for (size_t b = 0; b <= o.bucket_mask; b++)
+	  if (o.index[b*o.per_bucket].count > 0)
+	    buckets++;
+	bin_write_fixed(model_file, (char*)shape, sizeof(shape));
+	bin_write_fixed(model_file, (char*)&buckets, sizeof(buckets));
+	for (uint32_t b = 0; b <= o.bucket_mask; b++)
+	  if (o.index[b*o.per_bucket].count > 0)
+	    {
+	      bin_write_fixed(model_file, (char*)&b, sizeof(b));
+	      bin_write_fixed(model_file, (char*)(o.index + b*o.per_bucket), (uint32_t)bucket_size);
+	    }
+      }
+  }
+
+  void finish(oaa& o)
+  {
+    free(o.pred);
+    free(o.labels);
+    free(o.index);
+    free(o.seen);
+    o.candidates.delete_v();
+    o.importance.delete_v();
+  }
+
   learner* setup(vw& all, po::variables_map& vm)
   {
     oaa* data = (oaa*)calloc_or_die(1, sizeof(oaa));
     //first parse for number of actions
 
+    po::options_description oaa_opts("OAA options");
+    oaa_opts.add_options()
+      ("oaa_candidates", po::value<size_t>(), "when testing, score only the classes most often seen with the example's features, up to this many per feature")
+      ("oaa_index_bits", po::value<size_t>()->default_value(18), "number of bits in the hash of features into buckets of candidate classes")
+      ("oaa_negatives", po::value<size_t>(), "when learning, update the label and only this many sampled other classes; the progressive loss then scores only those, while holdout examples score every class")
+      ("oaa_hard_negatives", "take up to half of the --oaa_negatives from the example's --oaa_candidates");
+
+    vm = add_options(all, oaa_opts);
+
     data->k = (uint32_t)vm["oaa"].as<size_t>();
     
     //append oaa with nb_actions to options_from_file so it is saved to regressor later
     std::stringstream ss;
     ss << " --oaa " << data->k;
+
+    if (vm.count("oaa_candidates"))
+      {
+	data->per_bucket = (uint32_t)vm["oaa_candidates"].as<size_t>();
+	size_t bits = vm["oaa_index_bits"].as<size_t>();
+	if (bits < 1 || bits > 31)
+	  {
+	    cerr << "--oaa_index_bits must be between 1 and 31" << endl;
+	    throw exception();
+	  }
+	data->bucket_mask = ((size_t)1 << bits) - 1;
+	ss << " --oaa_candidates " << data->per_bucket << " --oaa_index_bits " << bits;
+	data->index = (candidate*)calloc_or_die((data->bucket_mask + 1)*data->per_bucket, sizeof(candidate));
+      }
+    if (vm.count("oaa_negatives"))
+      {
+	if (2*vm["oaa_negatives"].as<size_t>() < data->k)
+	  data->negatives = (uint32_t)vm["oaa_negatives"].as<size_t>();
+	else
+	  cerr << "warning: --oaa_negatives " << vm["oaa_negatives"].as<size_t>() << " is at least half of the " << data->k
+	       << " classes, which saves little; learning updates every class" << endl;
+      }
+    data->hard_negatives = vm.count("oaa_hard_negatives") && data->per_bucket > 0 && data->negatives > 1;
+    if (vm.count("oaa_hard_negatives") && !data->hard_negatives)
+      cerr << "warning: --oaa_hard_negatives needs --oaa_candidates and at least 2 --oaa_negatives; ignoring it" << endl;
+    if (data->per_bucket > 0 || data->negatives > 0)
+      data->seen = (uint32_t*)calloc_or_die(data->k, sizeof(uint32_t));
     all.file_options.append(ss.str());
 
     data->shouldOutput = all.raw_prediction > 0;
     data->all = &all;
+    data->pred = (VW::prediction*)calloc_or_die(data->k, sizeof(VW::prediction));
+    data->labels = (float*)calloc_or_die(data->k, sizeof(float));
     all.p->lp = mc_label;
 
     learner* l = new learner(data, all.l, data->k);
     l->set_learn<oaa, predict_or_learn<true> >();
     l->set_predict<oaa, predict_or_learn<false> >();
     l->set_finish_example<oaa, finish_example>();
+    l->set_finish<oaa, finish>();
+    if (data->per_bucket > 0)
+      l->set_save_load<oaa, save_load>();
 
     return l;
   }
@@ -0,0 +1,450 @@
+/*
+Copyright (c) by respective owners including Yahoo!, Microsoft, and
+individual contributors. All rights reserved.  Released under a BSD (revised)
+license as described in the file LICENSE.
+ */
+#include <iostream>
+#include <string.h>
+#include <stdlib.h>
+#include <map>
+#include <vector>
+#include "param_client.h"
+#include "gd.h"
+#include "memory.h"
+
+using namespace std;
+
+namespace PS {
+  struct entry { //the wire format of a pull request, a push, and the final weights.
+    uint32_t index;
+    float value;
+  };
+
+  const int default_port = 26545;
+
+  void send_all(socket_t sock, const char* buf, size_t len)
+  {
+    while (len > 0)
+      {
+	int sent = send(sock, buf, (int)len, 0);
+	if (sent <= 0)
+	  {
+	    cerr << "lost a parameter server!" << endl;
+	    throw exception();
+	  }
+	buf += sent;
+	len -= sent;
+      }
+  }
+
+  void recv_all(socket_t sock, char* buf, size_t len)
+  {
+    while (len > 0)
+      {
+	int got = recv(sock, buf, (int)len, 0);
+	if (got <= 0)
+	  {
+	    cerr << "lost a parameter server!" << endl;
+	    throw exception();
+	  }
+	buf += got;
+	len -= got;
+      }
+  }
+
+  template<class T> void append(v_array<char>& message, const T& t)
+  {
+    push_many(message, (const char*)&t, sizeof(T));
+  }
+
+  void init(vw& all, string servers, size_t batch, size_t staleness, size_t cache_bits)
+  {
+    param_client& ps = *all.ps;
+    ps.batch = batch;
+    ps.staleness = staleness;
+    ps.cache_bits = cache_bits;
+    ps.last_example = (size_t)-1;
+    while (servers != "")
+      {
+	size_t comma = servers.find(',');
+	string location = servers.substr(0, comma);
+	servers = comma == string::npos ? "" : servers.substr(comma + 1);
+	int port = default_port;
+	size_t colon = location.find(':');
+	if (colon != string::npos)
+	  {
+	    port = atoi(location.substr(colon + 1).c_str());
+	    location = location.substr(0, colon);
+	  }
+	struct hostent* host = gethostbyname(location.c_str());
+	if (host == NULL)
+	  {
+	    cerr << "can't resolve hostname: " << location << endl;
+	    throw exception();
+	  }
+	socket_t sock = sock_connect(*(uint32_t*)host->h_addr, htons(port));
+	int on = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char*)&on, sizeof(on));
+	send_all(sock, (char*)&all.node, sizeof(all.node));
+	send_all(sock, (char*)&all.total, sizeof(all.total));
+	send_all(sock, (char*)&ps.staleness, sizeof(ps.staleness));
+	int ok;
+	recv_all(sock, (char*)&ok, sizeof(ok));
+	if (!ok)
+	  {
+	    cerr << "parameter server " << location << " refused node " << all.node << " of " << all.total << endl;
+	    throw exception();
+	  }
+	ps.servers.push_back(sock);
+      }
+    if (ps.servers.size() == 0)
+      {
+	cerr << "--ps_servers needs at least one server" << endl;
+	throw exception();
+      }
+    ps.wanted = (v_array<uint32_t>*)calloc_or_die(ps.servers.size(), sizeof(v_array<uint32_t>));
+    ps.evicted = (v_array<char>*)calloc_or_die(ps.servers.size(), sizeof(v_array<char>));
+    ps.seeds = (v_array<char>*)calloc_or_die(ps.servers.size(), sizeof(v_array<char>));
+    ps.messages = (v_array<char>*)calloc_or_die(ps.servers.size(), sizeof(v_array<char>));
+  }
+
+  void attach(vw& all)
+  {
+    param_client& ps = *all.ps;
+    size_t length = (all.reg.weight_mask + 1) >> all.reg.stride_shift;
+    if (ps.fresh == NULL)
+      {
+	ps.owner = (uint32_t*)calloc_or_die(length, sizeof(uint32_t));
+	for (size_t i = 0; i < length; i++)
+	  ps.owner[i] = (uint32_t)i;
+	ps.fresh = (uint32_t*)calloc_or_die((length + 31) / 32, sizeof(uint32_t));
+	ps.synced = (float*)calloc_or_die(length, sizeof(float));
+      }
+    ps.weights = all.reg.weight_vector;
+    ps.stride_shift = all.reg.stride_shift;
+    ps.cache_mask = (uint32_t)(length - 1);
+    ps.global_mask = (((size_t)1 << all.num_bits) << all.reg.stride_shift) - 1;
+  }
+
+  inline void want(vw& all, param_client& ps, uint32_t i)
+  {
+    uint32_t slot = i & ps.cache_mask;
+    bool fresh = (ps.fresh[slot >> 5] & (1u << (slot & 31))) != 0;
+    if (fresh && ps.owner[slot] == i)
+      return;
+    if (ps.owner[slot] != i)
+      {
+	weight* w = ps.weights + ((size_t)slot << ps.stride_shift);
+	if (fresh && *w != ps.synced[slot])
+	  {
+	    entry e = {ps.owner[slot], *w - ps.synced[slot]};
+	    append(ps.evicted[e.index % ps.servers.size()], e);
+	  }
+	//if the evicted weight is used by this example too, the two share the slot like a hash collision.
+	ps.owner[slot] = i;
+	//the learning rate state the evicted weight had goes with it, as GD::save_load starts it.
+	memset(w + 1, 0, (((size_t)1 << ps.stride_shift) - 1) * sizeof(weight));
+	if (all.adaptive && all.initial_t > 0)
+	  w[1] = all.initial_t;
+	*w = ps.synced[slot] = all.initial_weight;
+      }
+    ps.fresh[slot >> 5] |= 1u << (slot & 31);
+    ps.wanted[i % ps.servers.size()].push_back(i);
+  }
+
+  //GD::foreach_feature's walk, by weight number in the whole vector rather than by slot in the cache.
+  inline void want(vw& all, param_client& ps, feature* begin, feature* end, uint32_t offset)
+  {
+    for (feature* f = begin; f != end; f++)
+      want(all, ps, (uint32_t)(((f->weight_index + offset) & ps.global_mask) >> ps.stride_shift));
+  }
+
+  void want(vw& all, param_client& ps, example& ec)
+  {
+    uint32_t offset = ec.ft_offset;
+    for (unsigned char* i = ec.indices.begin; i != ec.indices.end; i++)
+      want(all, ps, ec.atomics(*i).begin, ec.atomics(*i).end, offset);
+    for (vector<string>::iterator i = all.pairs.begin(); i != all.pairs.end(); i++)
+      for (feature* f = ec.atomics((int)(*i)[0]).begin; f != ec.atomics((int)(*i)[0]).end; f++)
+	want(all, ps, ec.atomics((int)(*i)[1]).begin, ec.atomics((int)(*i)[1]).end, quadratic_constant * (f->weight_index + offset));
+    for (vector<string>::iterator i = all.triples.begin(); i != all.triples.end(); i++)
+      for (feature* f1 = ec.atomics((int)(*i)[0]).begin; f1 != ec.atomics((int)(*i)[0]).end; f1++)
+	for (feature* f2 = ec.atomics((int)(*i)[1]).begin; f2 != ec.atomics((int)(*i)[1]).end; f2++)
+	  want(all, ps, ec.atomics((int)(*i)[2]).begin, ec.atomics((int)(*i)[2]).end,
+	       cubic_constant2 * (cubic_constant * (f1->weight_index + offset) + f2->weight_index + offset));
+  }
+
+  void refresh(vw& all, example& ec)
+  {
+    param_client& ps = *all.ps;
+    if (ec.example_counter != ps.last_example)
+      {
+	ps.last_example = ec.example_counter;
+	if (++ps.examples > ps.batch)
+	  {
+	    clock(all);
+	    ps.examples = 1;
+	  }
+      }
+
+    want(all, ps, ec);
+
+    //ask every shard before waiting on any of them.
+    size_t shards = ps.servers.size();
+    for (size_t s = 0; s < shards; s++)
+      {
+	v_array<uint32_t>& w = ps.wanted[s];
+	v_array<char>& m = ps.messages[s];
+	m.clear();
+	if (ps.evicted[s].size() > 0)
+	  { //ahead of any pull, which may be of an evicted weight.
+	    append(m, 'u');
+	    append(m, (uint32_t)(ps.evicted[s].size() / sizeof(entry)));
+	    push_many(m, ps.evicted[s].begin, ps.evicted[s].size());
+	    ps.evicted[s].clear();
+	  }
+	if (w.size() > 0)
+	  {
+	    append(m, 'p');
+	    append(m, (uint32_t)w.size());
+	    for (uint32_t* i = w.begin; i != w.end; i++)
+	      {
+		entry e = {*i, ps.weights[(size_t)(*i & ps.cache_mask) << ps.stride_shift]};
+		append(m, e);
+	      }
+	  }
+	if (m.size() > 0)
+	  send_all(ps.servers[s], m.begin, m.size());
+      }
+    for (size_t s = 0; s < shards; s++)
+      {
+	v_array<uint32_t>& w = ps.wanted[s];
+	if (w.size() == 0)
+	  continue;
+	ps.values.clear();
+	if ((size_t)(ps.values.end_array - ps.values.begin) < w.size())
+	  ps.values.resize(w.size());
+	recv_all(ps.servers[s], (char*)ps.values.begin, w.size()*sizeof(float));
+	for (size_t k = 0; k < w.size(); k++)
+	  {
+	    uint32_t slot = w[k] & ps.cache_mask;
+	    if (ps.owner[slot] != w[k])
+	      continue; //evicted by a later feature of the same example.
+	    ps.weights[(size_t)slot << ps.stride_shift] = ps.synced[slot] = ps.values[k];
+	    ps.pulled.push_back(slot);
+	  }
+	w.clear();
+      }
+  }
+
+  void clock(vw& all)
+  {
+    param_client& ps = *all.ps;
+    size_t shards = ps.servers.size();
+    for (size_t s = 0; s < shards; s++)
+      {
+	ps.messages[s].clear();
+	append(ps.messages[s], 'u');
+	append(ps.messages[s], (uint32_t)0);
+      }
+    //only weights pulled this clock can have been learned.
+    for (uint32_t* i = ps.pulled.begin; i != ps.pulled.end; i++)
+      {
+	float& w = ps.weights[(size_t)*i << ps.stride_shift];
+	float delta = w - ps.synced[*i];
+	if (delta != 0.f)
+	  {
+	    entry e = {ps.owner[*i], delta};
+	    append(ps.messages[e.index % shards], e);
+	    ps.synced[*i] = w; //a slot pulled twice is pushed once.
+	  }
+	ps.fresh[*i >> 5] = 0; //its neighbours' bits too, but they were all pulled as well.
+      }
+    ps.pulled.clear();
+    for (size_t s = 0; s < shards; s++)
+      {
+	v_array<char>& m = ps.messages[s];
+	*(uint32_t*)(m.begin + 1) = (uint32_t)((m.size() - 1 - sizeof(uint32_t)) / sizeof(entry));
+	append(m, 'c');
+	send_all(ps.servers[s], m.begin, m.size());
+      }
+    ps.examples = 0;
+  }
+
+  void finish_training(vw& all)
+  {
+    param_client& ps = *all.ps;
+    clock(all);
+    ps.done = true;
+    bool whole = !partial(all);
+    char done[2] = {'d', 'a'};
+    for (size_t s = 0; s < ps.servers.size(); s++)
+      send_all(ps.servers[s], done, whole ? 2 : 1);
+    if (!whole)
+      return; //save_weights streams a model from the servers.
+    for (size_t s = 0; s < ps.servers.size(); s++)
+      {
+	uint64_t count;
+	recv_all(ps.servers[s], (char*)&count, sizeof(count));
+	const size_t block = 1 << 16;
+	entry* entries = (entry*)calloc_or_die(block, sizeof(entry));
+	while (count > 0)
+	  {
+	    size_t n = (size_t)min(count, (uint64_t)block);
+	    recv_all(ps.servers[s], (char*)entries, n*sizeof(entry));
+	    for (size_t k = 0; k < n; k++)
+	      ps.weights[(size_t)entries[k].index << ps.stride_shift] = entries[k].value;
+	    count -= n;
+	  }
+	::free(entries);
+      }
+  }
+
+  const size_t seed_block = 1 << 16; //entries per pull of an -i model's weights.
+
+  //pulls shard s's seeds, whose values are the model's; a weight stored already keeps its own.
+  void send_seeds(param_client& ps, size_t s)
+  {
+    v_array<char>& m = ps.messages[s];
+    uint32_t count = (uint32_t)(ps.seeds[s].size() / sizeof(entry));
+    m.clear();
+    append(m, 'p');
+    append(m, count);
+    push_many(m, ps.seeds[s].begin, ps.seeds[s].size());
+    send_all(ps.servers[s], m.begin, m.size());
+    ps.values.clear();
+    if ((size_t)(ps.values.end_array - ps.values.begin) < count)
+      ps.values.resize(count);
+    recv_all(ps.servers[s], (char*)ps.values.begin, count*sizeof(float));
+    ps.seeds[s].clear();
+  }
+
+  void seed(vw& all, uint32_t index, float value)
+  {
+    param_client& ps = *all.ps;
+    size_t s = index % ps.servers.size();
+    entry e = {index, value};
+    append(ps.seeds[s], e);
+    if (ps.seeds[s].size() >= seed_block * sizeof(entry))
+      send_seeds(ps, s);
+  }
+
+  void finish_seeding(vw& all)
+  {
+    param_client& ps = *all.ps;
+    for (size_t s = 0; s < ps.servers.size(); s++)
+      if (ps.seeds[s].size() > 0)
+	send_seeds(ps, s);
+  }
+
+  struct shard_reader { //a shard's stored weights, which come by increasing index, a block at a time.
+    socket_t sock;
+    uint64_t left; //not received yet.
+    vector<entry> block;
+    size_t at;
+  };
+
+  //the shard's next weight, or NULL once they are all taken.
+  entry* next(shard_reader& r)
+  {
+    if (r.at == r.block.size())
+      {
+	if (r.left == 0)
+	  return NULL;
+	r.block.resize((size_t)min(r.left, (uint64_t)seed_block));
+	recv_all(r.sock, (char*)&r.block[0], r.block.size()*sizeof(entry));
+	r.left -= r.block.size();
+	r.at = 0;
+      }
+    return &r.block[r.at];
+  }
+
+  void save_weights(vw& all, io_buf& model_file, bool text)
+  {
+    param_client& ps = *all.ps;
+    //the final weights, or with --save_per_pass the ones pushed so far.
+    char op = ps.done ? 'a' : 's';
+    size_t shards = ps.servers.size();
+    vector<shard_reader> readers(shards);
+    for (size_t s = 0; s < shards; s++)
+      {
+	readers[s].sock = ps.servers[s];
+	readers[s].at = 0;
+	send_all(ps.servers[s], &op, 1);
+	recv_all(ps.servers[s], (char*)&readers[s].left, sizeof(readers[s].left));
+      }
+
+    map<uint32_t, float> named; //with --invert_hash, the weights that have names.
+    if (all.print_invert)
+      for (map<string, size_t>::iterator it = all.name_index_map.begin(); it != all.name_index_map.end(); ++it)
+	named[(uint32_t)it->second] = 0.;
+
+    //shards hold different weights, so merging them writes the weights in order as save_load_regressor does.
+    while (true)
+      {
+	entry* least = NULL;
+	for (size_t s = 0; s < shards; s++)
+	  {
+	    entry* e = next(readers[s]);
+	    if (e != NULL && (least == NULL || e->index < least->index))
+	      least = e;
+	  }
+	if (least == NULL)
+	  break;
+	readers[least->index % shards].at++;
+	if (least->value == 0.)
+	  continue;
+	if (all.print_invert)
+	  {
+	    map<uint32_t, float>::iterator n = named.find(least->index);
+	    if (n != named.end())
+	      n->second = least->value;
+	    continue;
+	  }
+	char buff[512];
+	int text_len = sprintf(buff, "%d", least->index);
+	bin_text_write_fixed(model_file, (char*)&least->index, sizeof(least->index), buff, text_len, text);
+	text_len = sprintf(buff, ":%f\n", least->value);
+	bin_text_write_fixed(model_file, (char*)&least->value, sizeof(least->value), buff, text_len, text);
+      }
+
+    if (all.print_invert)
+      for (map<string, size_t>::iterator it = all.name_index_map.begin(); it != all.name_index_map.end(); ++it)
+	{
+	  float v = named[(uint32_t)it->second];
+	  if (v != 0.)
+	    {
+	      char buff[512];
+	      int text_len = sprintf(buff, "%s", it->first.c_str());
+	      bin_text_write_fixed(model_file, (char*)it->first.c_str(), sizeof(*it->first.c_str()), buff, text_len, true);
+	      text_len = sprintf(buff, ":%f\n", v);
+	      bin_text_write_fixed(model_file, (char*)&v, sizeof(v), buff, text_len, true);
+	    }
+	}
+  }
+
+  void free(vw& all)
+  {
+    param_client& ps = *all.ps;
+    for (size_t s = 0; s < ps.servers.size(); s++)
+      {
+	CLOSESOCK(ps.servers[s]);
+	ps.wanted[s].delete_v();
+	ps.evicted[s].delete_v();
+	ps.seeds[s].delete_v();
+	ps.messages[s].delete_v();
+      }
+    ps.servers.delete_v();
+    ::free(ps.wanted);
+    ::free(ps.evicted);
+    ::free(ps.seeds);
+    ::free(ps.messages);
+    ps.pulled.delete_v();
+    ps.values.delete_v();
+    ::free(ps.owner);
+    ::free(ps.fresh);
+    ::free(ps.synced);
+    ::free(all.ps);
+    all.ps = NULL;
+  }
+}
@@ -0,0 +1,64 @@
+/*
+Copyright (c) by respective owners including Yahoo!, Microsoft, and
+individual contributors. All rights reserved.  Released under a BSD
+license as described in the file LICENSE.
+ */
+// The workers' side of training against parameter servers (--ps_servers), each holding a shard of
+// the weights; see cluster/param_server.cc.  Before learning from an example a worker pulls the
+// weights it uses that it hasn't pulled yet in the current clock, and at the end of each clock it
+// pushes what it changed them by.  A worker keeps only a cache of 2^--ps_cache_bits weights: weight
+// number i lives in slot i modulo the cache size, and a weight pulled into a slot another one holds
+// first pushes that one's changes.  With a cache smaller than the whole vector, models are read into
+// and written from the servers rather than the weights.
+#ifndef PARAM_CLIENT_H
+#define PARAM_CLIENT_H
+#include "global_data.h"
+#include "io_buf.h"
+
+namespace PS {
+  struct param_client {
+    v_array<socket_t> servers; //shard s holds the weights whose number is s modulo the shard count.
+    size_t batch; //examples per clock.
+    size_t staleness; //clocks a worker may be ahead of the slowest one.
+    size_t examples; //seen in the current clock.
+    size_t last_example; //example_counter of the last one, as reductions learn each several times.
+    size_t cache_bits; //the cache holds 2^cache_bits weights, or all of them if -b is no more.
+    bool done; //after the last pass.
+    weight* weights;
+    size_t stride_shift;
+    uint32_t cache_mask; //slots - 1.
+    size_t global_mask; //the weight_mask of the whole -b vector.
+    uint32_t* owner; //per slot, the weight number it holds.
+    uint32_t* fresh; //one bit per slot, set when it is pulled during the current clock.
+    float* synced; //per slot, its weight as last pulled.
+    v_array<uint32_t> pulled; //slots pulled during the current clock.
+    v_array<uint32_t>* wanted; //per shard, weight numbers the current example still needs.
+    v_array<char>* evicted; //per shard, pushes of weights the current example evicted.
+    v_array<char>* seeds; //per shard, weights of an -i model not sent yet.
+    v_array<char>* messages; //per shard.
+    v_array<float> values;
+  };
+
+  //connects to the comma separated host[:port] list of servers.
+  void init(vw& all, std::string servers, size_t batch, size_t staleness, size_t cache_bits);
+  //once the weights are allocated; they hold just the cache.
+  void attach(vw& all);
+  //pulls what ec needs, first ending the clock if a batch is done.
+  void refresh(vw& all, example& ec);
+  //pushes this clock's changes and starts the next.
+  void clock(vw& all);
+  //after the last pass: with a whole vector, waits for all workers to finish and takes the servers' weights.
+  void finish_training(vw& all);
+
+  //whether the cache is smaller than the whole vector.
+  inline bool partial(vw& all) { return all.ps != NULL && all.ps->cache_bits < all.num_bits; }
+  //save_load_regressor of a partial cache.  An -i model's weights are stored on the servers unless a
+  //worker got there first; a model written gets the servers' weights, once all workers are done after
+  //the last pass.
+  void seed(vw& all, uint32_t index, float value);
+  void finish_seeding(vw& all);
+  void save_weights(vw& all, io_buf& model_file, bool text);
+  void free(vw& all);
+}
+
+#endif
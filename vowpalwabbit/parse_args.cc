@@ -16,6 +16,7 @@ license as described in the file LICENSE.
 #include "network.h"
 #include "global_data.h"
 #include "nn.h"
+#include "mlp.h"
 #include "cbify.h"
 #include "oaa.h"
 #include "rand48.h"
@@ -27,6 +28,7 @@ license as described in the file LICENSE.
 #include "cb.h"
 #include "cb_algs.h"
 #include "scorer.h"
+#include "param_client.h"
 #include "searn.h"
 #include "bfgs.h"
 #include "lda_core.h"
@@ -41,6 +43,7 @@ license as described in the file LICENSE.
 #include "lrq.h"
 #include "autolink.h"
 #include "memory.h"
+#include "accumulate.h"
 
 using namespace std;
 //
@@ -642,7 +645,8 @@ void parse_base_algorithm(vw& all, po::variables_map& vm)
     ("rank", po::value<uint32_t>(&(all.rank)), "rank for matrix factorization.")
     ("noop","do no learning")
     ("print","print examples")
-    ("sendto", po::value< vector<string> >(), "send examples to <host>");
+    ("sendto", po::value< vector<string> >(), "send examples to <host>")
+    ("shm_socket", po::value< string >(), "unix socket path for a shared memory channel between --daemon and local --sendto clients");
 
   vm = add_options(all, base_opt);
 
@@ -694,6 +698,7 @@ void parse_scorer_reductions(vw& all, po::variables_map& vm)
 
   score_mod_opt.add_options()
     ("nn", po::value<size_t>(), "Use sigmoidal feedforward network with <k> hidden units")
+    ("mlp", po::value<string>(), "Use feedforward network with comma separated hidden layer sizes, as in 64,32")
     ("new_mf", "use new, reduction-based matrix factorization")
     ("autolink", po::value<size_t>(), "create link function with polynomial d")
     ("lrq", po::value<vector<string> > (), "use low rank quadratic features")
@@ -703,6 +708,9 @@ void parse_scorer_reductions(vw& all, po::variables_map& vm)
 
   if(vm.count("nn"))
     all.l = NN::setup(all, vm);
+
+  if(vm.count("mlp"))
+    all.l = MLP::setup(all, vm);
   
   if (vm.count("new_mf") && all.rank > 0)
     all.l = MF::setup(all, vm);
@@ -899,6 +907,21 @@ vw* parse_args(int argc, char *argv[])
     ("unique_id", po::value<size_t>(&(all->unique_id)),"unique id used for cluster parallel jobs")
     ("total", po::value<size_t>(&(all->total)),"total number of nodes used in cluster parallel job")
     ("node", po::value<size_t>(&(all->node)),"node number in cluster parallel job")
+    ("rack", po::value<string>(&(all->socks.rack)), "label of this node's rack; the spanning tree keeps allreduce traffic within racks where it can")
+    ("span_timeout", po::value<size_t>(&(all->socks.timeout)), "fail an allreduce that waits on other nodes for more than <n> seconds (default: wait for ever)")
+    ("span_retries", po::value<size_t>(&(all->socks.retries)), "when an allreduce fails, ask the span server for a new spanning tree and retry, up to <n> times")
+    ("local_allreduce", "sum with the other nodes on this machine through shared memory first, so only one of them takes part in the network allreduce; for all nodes of a job or none")
+    ("allreduce", po::value<string>(), "allreduce algorithm: tree (default) or ring, which is bandwidth optimal for large models on many nodes")
+    ("sparse_allreduce", "at the end of each pass average only the weights some node changed during it")
+    ("allreduce_fp16", "with --sparse_allreduce, send weight changes as half floats, carrying the rounding error to the next pass")
+    ("allreduce_stats", "print how many weights each averaging sent and how long it took")
+    ("overlap_allreduce", "average the weights at the end of a pass while learning the next one, then add what was learned meanwhile to the average")
+    ("average_every", po::value<size_t>(), "also average the weights in the background every <n> examples during a pass")
+    ("average_seconds", po::value<size_t>(), "also average the weights in the background every <n> seconds during a pass")
+    ("ps_servers", po::value<string>(), "instead of allreduce, train against parameter servers at host[:port],... that each hold a shard of the weights")
+    ("ps_batch", po::value<size_t>()->default_value(10), "with --ps_servers, push weight changes every <n> examples; the servers add up the nodes' changes, so large batches add up nearly independent models")
+    ("ps_staleness", po::value<size_t>()->default_value(2), "with --ps_servers, batches a node may run ahead of the slowest one")
+    ("ps_cache_bits", po::value<size_t>()->default_value(22), "with --ps_servers, hold at most 2^<c> of the weights on a node, a weight evicting the one in its slot")
     ;
 
   po::options_description other_opt("Other options");
@@ -923,6 +946,59 @@ vw* parse_args(int argc, char *argv[])
   
   if (vm.count("active_learning") && !all->active_simulation)
     all->active = true;
+
+  if (vm.count("allreduce"))
+    {
+      string algorithm = vm["allreduce"].as<string>();
+      if (algorithm == "ring")
+	all->socks.ring = true;
+      else if (algorithm != "tree")
+	{
+	  cerr << "unknown allreduce algorithm: " << algorithm << endl;
+	  throw exception();
+	}
+    }
+
+  if (all->socks.rack.size() > 255)
+    {
+      cerr << "--rack labels are at most 255 characters" << endl;
+      throw exception();
+    }
+
+  if (vm.count("local_allreduce"))
+    {
+#ifdef _WIN32
+      cerr << "--local_allreduce is not supported on Windows" << endl;
+      throw exception();
+#endif
+      if (all->socks.retries > 0)
+	{
+	  cerr << "--local_allreduce can't be combined with --span_retries" << endl;
+	  throw exception();
+	}
+      all->socks.local = true;
+    }
+
+  all->allreduce_stats = vm.count("allreduce_stats") > 0;
+
+  if (vm.count("sparse_allreduce") && all->span_server != "")
+    {
+      all->sparse = (sparse_sync*)calloc_or_die(1, sizeof(sparse_sync));
+      all->sparse->fp16 = vm.count("allreduce_fp16") > 0;
+    }
+  else if (vm.count("allreduce_fp16"))
+    cerr << "warning: --allreduce_fp16 has no effect without --sparse_allreduce and --span_server" << endl;
+
+  if (vm.count("ps_servers"))
+    {
+      if (all->span_server != "")
+	{
+	  cerr << "--ps_servers can't be combined with --span_server" << endl;
+	  throw exception();
+	}
+      all->ps = (PS::param_client*)calloc_or_die(1, sizeof(PS::param_client));
+      PS::init(*all, vm["ps_servers"].as<string>(), vm["ps_batch"].as<size_t>(), vm["ps_staleness"].as<size_t>(), vm["ps_cache_bits"].as<size_t>());
+    }
   
   all->sd->weighted_unlabeled_examples = all->sd->t;
   all->initial_t = (float)all->sd->t;
@@ -954,6 +1030,11 @@ vw* parse_args(int argc, char *argv[])
 
   parse_base_algorithm(*all, vm);
 
+  if (all->ps != NULL && (vm.count("bfgs") || vm.count("conjugate_gradient") || vm.count("lda") || all->rank > 0 || all->reg_mode))
+    {
+      cerr << "--ps_servers only works with gradient descent, without --l1 or --l2" << endl;
+      throw exception();
+    }
   if (!all->quiet)
     {
       cerr << "Num weight bits = " << all->num_bits << endl;
@@ -972,6 +1053,17 @@ vw* parse_args(int argc, char *argv[])
 
   parse_scorer_reductions(*all, vm);
 
+  if (all->ps != NULL && (vm.count("nn") || vm.count("mlp") || vm.count("lrq")))
+    {//they read weights outside of the examples gd pulls.
+      cerr << "--ps_servers can't be combined with --nn, --mlp or --lrq" << endl;
+      throw exception();
+    }
+  if (PS::partial(*all) && (vm.count("feature_mask") || all->save_resume))
+    {//an evicted weight would lose its mask or learning rate state.
+      cerr << "--feature_mask and --save_resume need --ps_cache_bits of at least -b" << endl;
+      throw exception();
+    }
+
   bool got_cs = false;
   
   parse_score_users(*all, vm, got_cs);
@@ -1087,6 +1179,10 @@ namespace VW {
     delete all.l;
     if (all.reg.weight_vector != NULL)
       free(all.reg.weight_vector);
+    if (all.sparse != NULL)
+      sparse_sync_free(all);
+    if (all.ps != NULL)
+      PS::free(all);
     free_parser(all);
     finalize_source(all.p);
     all.p->parse_name.erase();
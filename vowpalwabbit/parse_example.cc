@@ -130,8 +130,8 @@ public:
 	word_hash = channel_hash + anon++;
       if(v == 0) return; //dont add 0 valued features to list of features
       feature f = {v,(uint32_t)word_hash * weights_per_problem};
-      ae->sum_feat_sq[index] += v*v;
-      ae->atomics[index].push_back(f);
+      ae->sum_feat_sq(index) += v*v;
+      ae->atomics(index).push_back(f);
       if(audit){
 	v_array<char> feature_v;
 	push_many(feature_v, feature_name.begin, feature_name.end - feature_name.begin);
@@ -140,7 +140,7 @@ public:
 	ae->audit_features[index].push_back(ad);
       }
       if ((affix_features[index] > 0) && (feature_name.end != feature_name.begin)) {
-        if (ae->atomics[affix_namespace].size() == 0)
+        if (ae->atomics(affix_namespace).size() == 0)
           ae->indices.push_back(affix_namespace);
         uint32_t affix = affix_features[index];
         while (affix > 0) {
@@ -155,8 +155,8 @@ public:
           }
           word_hash = p->hasher(affix_name,(uint32_t)channel_hash) * (affix_constant + (affix & 0xF) * quadratic_constant);
           feature f2 = { v, (uint32_t) word_hash * weights_per_problem };
-          ae->sum_feat_sq[affix_namespace] += v*v;
-          ae->atomics[affix_namespace].push_back(f2);
+          ae->sum_feat_sq(affix_namespace) += v*v;
+          ae->atomics(affix_namespace).push_back(f2);
           if (audit) {
             v_array<char> affix_v;
             if (index != ' ') affix_v.push_back(index);
@@ -173,7 +173,7 @@ public:
         }
       }
       if (spelling_features[index]) {
-        if (ae->atomics[spelling_namespace].size() == 0)
+        if (ae->atomics(spelling_namespace).size() == 0)
           ae->indices.push_back(spelling_namespace);
         //v_array<char> spelling;
         spelling.erase();
@@ -190,8 +190,8 @@ public:
         substring spelling_ss = { spelling.begin, spelling.end };
         size_t word_hash = hashstring(spelling_ss, (uint32_t)channel_hash);
         feature f2 = { v, (uint32_t) word_hash * weights_per_problem };
-        ae->sum_feat_sq[spelling_namespace] += v*v;
-        ae->atomics[spelling_namespace].push_back(f2);
+        ae->sum_feat_sq(spelling_namespace) += v*v;
+        ae->atomics(spelling_namespace).push_back(f2);
         if (audit) {
           v_array<char> spelling_v;
           if (index != ' ') { spelling_v.push_back(index); spelling_v.push_back('_'); }
@@ -233,7 +233,7 @@ public:
     }else{
       // NameSpaceInfo --> 'String' NameSpaceInfoValue
       index = (unsigned char)(*reading_head);
-      if(ae->atomics[index].begin == ae->atomics[index].end)
+      if(ae->atomics(index).begin == ae->atomics(index).end)
 	new_index = true;
       substring name = read_name();
       if(audit){
@@ -269,7 +269,7 @@ public:
     if(*reading_head == ' ' || *reading_head == '\t' || reading_head == endLine || *reading_head == '|' || *reading_head == '\r' ){
       // NameSpace --> ListFeatures
       index = (unsigned char)' ';
-      if(ae->atomics[index].begin == ae->atomics[index].end)
+      if(ae->atomics(index).begin == ae->atomics(index).end)
 	new_index = true;
       if(audit)
 	{
@@ -289,7 +289,7 @@ public:
       // syntax error
       cout << "malformed example !\n'|' , String, space or EOL expected after : \"" << std::string(beginLine, reading_head - beginLine).c_str()<< "\"" << endl;
     }
-    if(new_index && ae->atomics[index].begin != ae->atomics[index].end)
+    if(new_index && ae->atomics(index).begin != ae->atomics(index).end)
       ae->indices.push_back(index);
   }
   
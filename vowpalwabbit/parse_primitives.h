@@ -113,6 +113,7 @@ struct parser {
   size_t finished_count;//the number of finished examples;
   int label_sock;
   int bound_sock;
+  int shm_sock;//unix socket handing out shared memory channels, -1 if unused.
   int max_fd;
 
   v_array<substring> parse_name;
@@ -21,6 +21,7 @@ using namespace std;
 #include "memory.h"
 #include "rand48.h"
 #include "global_data.h"
+#include "param_client.h"
 
 /* Define the last version where files are backward compatible. */
 #define LAST_COMPATIBLE_VERSION "6.1.3"
@@ -34,6 +35,8 @@ void initialize_regressor(vw& all)
   }
 
   size_t length = ((size_t)1) << all.num_bits;
+  if (all.ps != NULL && all.ps->cache_bits < all.num_bits)
+    length = ((size_t)1) << all.ps->cache_bits;
   all.reg.weight_mask = (length << all.reg.stride_shift) - 1;
   all.reg.weight_vector = (weight *)calloc_or_die(length << all.reg.stride_shift, sizeof(weight));
   if (all.reg.weight_vector == NULL)
@@ -10,6 +10,7 @@ license as described in the file LICENSE.
 #include <sys/wait.h>
 #include <unistd.h>
 #include <netinet/tcp.h>
+#include <fcntl.h>
 #endif
 
 #include <signal.h>
@@ -57,6 +58,7 @@ namespace po = boost::program_options;
 #include "simple_label.h"
 #include "vw.h"
 #include "memory.h"
+#include "shm_transport.h"
 
 using namespace std;
 
@@ -159,6 +161,7 @@ parser* new_parser()
   ret->ring_size = 1 << 8;
   ret->done = false;
   ret->used_index = 0;
+  ret->shm_sock = -1;
 
   return ret;
 }
@@ -225,6 +228,46 @@ bool member(v_array<int> ids, int id)
   return false;
 }
 
+int accept_client(vw& all)
+{
+#ifndef _WIN32
+  if (all.p->shm_sock >= 0)
+    {// both listening sockets are nonblocking, so a child losing the race to another child just waits again.
+      while (true)
+	{
+	  fd_set fds;
+	  FD_ZERO(&fds);
+	  FD_SET(all.p->bound_sock, &fds);
+	  FD_SET(all.p->shm_sock, &fds);
+	  int max_sock = max(all.p->bound_sock, all.p->shm_sock);
+	  if (select(max_sock + 1, &fds, NULL, NULL, NULL) < 0)
+	    {
+	      if (errno == EINTR)
+		continue;
+	      return -1;
+	    }
+	  if (FD_ISSET(all.p->shm_sock, &fds))
+	    {
+	      int f = SHM::accept_client(all.p->shm_sock);
+	      if (f >= 0)
+		return f;
+	    }
+	  if (FD_ISSET(all.p->bound_sock, &fds))
+	    {
+	      int f = (int)accept(all.p->bound_sock, NULL, NULL);
+	      if (f >= 0)
+		return f;
+	      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED)
+		return -1;
+	    }
+	}
+    }
+#endif
+  sockaddr_in client_address;
+  socklen_t size = sizeof(client_address);
+  return (int)accept(all.p->bound_sock,(sockaddr*)&client_address,&size);
+}
+
 void reset_source(vw& all, size_t numbits)
 {
   io_buf* input = all.p->input;
@@ -260,9 +303,7 @@ void reset_source(vw& all, size_t numbits)
 	  all.final_prediction_sink.erase();
 	  all.p->input->files.erase();
 	  
-	  sockaddr_in client_address;
-	  socklen_t size = sizeof(client_address);
-	  int f = (int)accept(all.p->bound_sock,(sockaddr*)&client_address,&size);
+	  int f = accept_client(all);
 	  if (f < 0)
 	    {
 	      cerr << "bad client socket!" << endl;
@@ -461,6 +502,18 @@ void enable_sources(vw& all, po::variables_map& vm, bool quiet, size_t passes)
 	  port_file.close();
 	}
 
+#ifndef _WIN32
+      // local clients may skip TCP and talk over shared memory instead
+      if (all.daemon && !all.active && vm.count("shm_socket"))
+	{
+	  all.p->shm_sock = SHM::listen_socket(vm["shm_socket"].as<string>().c_str());
+	  if (all.p->shm_sock < 0)
+	    throw exception();
+	  fcntl(all.p->shm_sock, F_SETFL, O_NONBLOCK);
+	  fcntl(all.p->bound_sock, F_SETFL, O_NONBLOCK);
+	}
+#endif
+
       // background process
       if (!all.active && daemon(1,1))
 	{
@@ -554,12 +607,10 @@ void enable_sources(vw& all, po::variables_map& vm, bool quiet, size_t passes)
 #ifndef _WIN32
 	child:
 #endif
-      sockaddr_in client_address;
-      socklen_t size = sizeof(client_address);
       all.p->max_fd = 0;
       if (!all.quiet)
 	cerr << "calling accept" << endl;
-      int f = (int)accept(all.p->bound_sock,(sockaddr*)&client_address,&size);
+      int f = accept_client(all);
       if (f < 0)
 	{
 	  cerr << "bad client socket!" << endl;
@@ -705,12 +756,12 @@ void addgrams(vw& all, size_t ngram, size_t skip_gram, v_array<feature>& atomics
 void generateGrams(vw& all, example* &ex) {
   for(unsigned char* index = ex->indices.begin; index < ex->indices.end; index++)
     {
-      size_t length = ex->atomics[*index].size();
+      size_t length = ex->atomics(*index).size();
       for (size_t n = 1; n < all.ngram[*index]; n++)
 	{
 	  all.p->gram_mask.erase();
 	  all.p->gram_mask.push_back((size_t)0);
-	  addgrams(all, n, all.skips[*index], ex->atomics[*index], 
+	  addgrams(all, n, all.skips[*index], ex->atomics(*index), 
 		   ex->audit_features[*index], 
 		   length, all.p->gram_mask, 0);
 	}
@@ -758,6 +809,8 @@ void end_pass_example(vw& all, example* ae)
   all.p->in_pass_counter = 0;
 }
 
+void setup_features(vw& all, example* ae);
+
 void setup_example(vw& all, example* ae)
 {
   ae->partial_prediction = 0.;
@@ -773,6 +826,11 @@ void setup_example(vw& all, example* ae)
   all.sd->t += all.p->lp.get_weight(ae->ld);
   ae->example_t = (float)all.sd->t;
 
+  setup_features(all, ae);
+}
+
+void setup_features(vw& all, example* ae)
+{//namespace filtering, ngrams, constant, stride and feature counts; touches no parser state.
   if (all.ignore_some)
     {
       if (all.audit || all.hash_inv)
@@ -783,7 +841,7 @@ void setup_example(vw& all, example* ae)
       for (unsigned char* i = ae->indices.begin; i != ae->indices.end; i++)
 	if (all.ignore[*i])
 	  {//delete namespace
-	    ae->atomics[*i].erase();
+	    ae->atomics(*i).erase();
 	    memmove(i,i+1,(ae->indices.end - (i+1))*sizeof(*i));
 	    ae->indices.end--;
 	    i--;
@@ -797,7 +855,7 @@ void setup_example(vw& all, example* ae)
     //add constant feature
     ae->indices.push_back(constant_namespace);
     feature temp = {1,(uint32_t) (constant * all.wpp)};
-    ae->atomics[constant_namespace].push_back(temp);
+    ae->atomics(constant_namespace).push_back(temp);
     ae->total_sum_feat_sq++;
   }
   
@@ -805,7 +863,7 @@ void setup_example(vw& all, example* ae)
     {
       uint32_t stride_shift = all.reg.stride_shift;
       for (unsigned char* i = ae->indices.begin; i != ae->indices.end; i++)
-	for(feature* j = ae->atomics[*i].begin; j != ae->atomics[*i].end; j++)
+	for(feature* j = ae->atomics(*i).begin; j != ae->atomics(*i).end; j++)
 	  j->weight_index = (j->weight_index << stride_shift);
       if (all.audit || all.hash_inv)
 	for (unsigned char* i = ae->indices.begin; i != ae->indices.end; i++)
@@ -815,44 +873,44 @@ void setup_example(vw& all, example* ae)
   
   for (unsigned char* i = ae->indices.begin; i != ae->indices.end; i++) 
     {
-      ae->num_features += ae->atomics[*i].end - ae->atomics[*i].begin;
-      ae->total_sum_feat_sq += ae->sum_feat_sq[*i];
+      ae->num_features += ae->atomics(*i).end - ae->atomics(*i).begin;
+      ae->total_sum_feat_sq += ae->sum_feat_sq(*i);
     }
 
   if (all.rank == 0) {
     for (vector<string>::iterator i = all.pairs.begin(); i != all.pairs.end();i++)
       {
 	ae->num_features 
-	  += (ae->atomics[(int)(*i)[0]].end - ae->atomics[(int)(*i)[0]].begin)
-	  *(ae->atomics[(int)(*i)[1]].end - ae->atomics[(int)(*i)[1]].begin);
-	ae->total_sum_feat_sq += ae->sum_feat_sq[(int)(*i)[0]]*ae->sum_feat_sq[(int)(*i)[1]];
+	  += (ae->atomics((int)(*i)[0]).end - ae->atomics((int)(*i)[0]).begin)
+	  *(ae->atomics((int)(*i)[1]).end - ae->atomics((int)(*i)[1]).begin);
+	ae->total_sum_feat_sq += ae->sum_feat_sq((int)(*i)[0])*ae->sum_feat_sq((int)(*i)[1]);
       }
 
     for (vector<string>::iterator i = all.triples.begin(); i != all.triples.end();i++)
       {
 	ae->num_features 
-	  += (ae->atomics[(int)(*i)[0]].end - ae->atomics[(int)(*i)[0]].begin)
-            *(ae->atomics[(int)(*i)[1]].end - ae->atomics[(int)(*i)[1]].begin)
-            *(ae->atomics[(int)(*i)[2]].end - ae->atomics[(int)(*i)[2]].begin);
-	ae->total_sum_feat_sq += ae->sum_feat_sq[(int)(*i)[0]] * ae->sum_feat_sq[(int)(*i)[1]] * ae->sum_feat_sq[(int)(*i)[2]];
+	  += (ae->atomics((int)(*i)[0]).end - ae->atomics((int)(*i)[0]).begin)
+            *(ae->atomics((int)(*i)[1]).end - ae->atomics((int)(*i)[1]).begin)
+            *(ae->atomics((int)(*i)[2]).end - ae->atomics((int)(*i)[2]).begin);
+	ae->total_sum_feat_sq += ae->sum_feat_sq((int)(*i)[0]) * ae->sum_feat_sq((int)(*i)[1]) * ae->sum_feat_sq((int)(*i)[2]);
       }
 
   } else {
     for (vector<string>::iterator i = all.pairs.begin(); i != all.pairs.end();i++)
       {
 	ae->num_features
-	  += (ae->atomics[(int)(*i)[0]].end - ae->atomics[(int)(*i)[0]].begin) * all.rank;
+	  += (ae->atomics((int)(*i)[0]).end - ae->atomics((int)(*i)[0]).begin) * all.rank;
 	ae->num_features
-	  += (ae->atomics[(int)(*i)[1]].end - ae->atomics[(int)(*i)[1]].begin) * all.rank;
+	  += (ae->atomics((int)(*i)[1]).end - ae->atomics((int)(*i)[1]).begin) * all.rank;
       }
     for (vector<string>::iterator i = all.triples.begin(); i != all.triples.end();i++)
       {
 	ae->num_features
-	  += (ae->atomics[(int)(*i)[0]].end - ae->atomics[(int)(*i)[0]].begin) * all.rank;
+	  += (ae->atomics((int)(*i)[0]).end - ae->atomics((int)(*i)[0]).begin) * all.rank;
 	ae->num_features
-	  += (ae->atomics[(int)(*i)[1]].end - ae->atomics[(int)(*i)[1]].begin) * all.rank;
+	  += (ae->atomics((int)(*i)[1]).end - ae->atomics((int)(*i)[1]).begin) * all.rank;
 	ae->num_features
-	  += (ae->atomics[(int)(*i)[2]].end - ae->atomics[(int)(*i)[2]].begin) * all.rank;
+	  += (ae->atomics((int)(*i)[2]).end - ae->atomics((int)(*i)[2]).begin) * all.rank;
       }
   }
 }
@@ -881,7 +939,7 @@ namespace VW{
     uint32_t cns = constant_namespace;
     ec->indices.push_back(cns);
     feature temp = {1,(uint32_t) constant};
-    ec->atomics[cns].push_back(temp);
+    ec->atomics(cns).push_back(temp);
     ec->total_sum_feat_sq++;
     ec->num_features++;
   }
@@ -904,8 +962,8 @@ namespace VW{
 	ret->indices.push_back(index);
 	for (size_t j = 0; j < vf[i].second.size(); j++)
 	  {	    
-	    ret->sum_feat_sq[index] += vf[i].second[j].x * vf[i].second[j].x;
-	    ret->atomics[index].push_back(vf[i].second[j]);
+	    ret->sum_feat_sq(index) += vf[i].second[j].x * vf[i].second[j].x;
+	    ret->atomics(index).push_back(vf[i].second[j]);
 	  }
       }
 	parse_atomic_example(all,ret,false);
@@ -924,8 +982,8 @@ namespace VW{
 	ret->indices.push_back(index);
 	for (size_t j = 0; j < features[i].len; j++)
 	  {	    
-	    ret->sum_feat_sq[index] += features[i].fs[j].x * features[i].fs[j].x;
-	    ret->atomics[index].push_back(features[i].fs[j]);
+	    ret->sum_feat_sq(index) += features[i].fs[j].x * features[i].fs[j].x;
+	    ret->atomics(index).push_back(features[i].fs[j]);
 	  }
       }
     parse_atomic_example(all,ret,false); // all.p->parsed_examples++;
@@ -943,11 +1001,11 @@ namespace VW{
     for (unsigned char* i = ec->indices.begin; i != ec->indices.end; i++)
       {
 		fs_ptr[fs_count].name = *i;
-		fs_ptr[fs_count].len = ec->atomics[*i].size();
+		fs_ptr[fs_count].len = ec->atomics(*i).size();
 		fs_ptr[fs_count].fs = new feature[fs_ptr[fs_count].len];
 	
 		int f_count = 0;
-		for (feature *f = ec->atomics[*i].begin; f != ec->atomics[*i].end; f++)
+		for (feature *f = ec->atomics(*i).begin; f != ec->atomics(*i).end; f++)
 		  {
 			feature t = *f;
 			t.weight_index >>= all.reg.stride_shift;
@@ -992,17 +1050,17 @@ namespace VW{
 		  temp->alloced=false;
 		}
 	    }
-	  ec.audit_features[*i].erase();
+	  ec.audit_features[*i].clear();
 	}
     
     for (unsigned char* i = ec.indices.begin; i != ec.indices.end; i++) 
       {  
-	ec.atomics[*i].erase();
-	ec.sum_feat_sq[*i]=0;
+	ec.atomics(*i).clear();
+	ec.sum_feat_sq(*i)=0;
       }
     
-    ec.indices.erase();
-    ec.tag.erase();
+    ec.indices.clear();
+    ec.tag.clear();
     ec.sorted = false;
     ec.end_pass = false;
   }
@@ -1024,6 +1082,74 @@ namespace VW{
       condition_variable_signal_all(&all.p->example_available);
     mutex_unlock(&all.p->examples_lock);
   }
+
+  example* alloc_batch(vw& all, size_t count)
+  {
+    if (all.p->lp.parse_label != simple_label.parse_label)
+      {
+	cerr << "batch prediction needs a learner with simple labels" << endl;
+	throw exception();
+      }
+    example* ecs = (example*)calloc_or_die(count, sizeof(example));
+    for (size_t k = 0; k < count; k++)
+      {
+	ecs[k].ld = calloc_or_die(1, all.p->lp.label_size);
+	ecs[k].audit_features = alloc_audit_features(all.audit || all.hash_inv);
+	ecs[k].in_use = true;
+      }
+    return ecs;
+  }
+
+  void dealloc_batch(vw& all, example* ecs, size_t count)
+  {
+    for (size_t k = 0; k < count; k++)
+      dealloc_example(all.p->lp.delete_label, ecs[k]);
+    free(ecs);
+  }
+
+  void predict_batch(vw& all, example* ecs, primitive_feature_space** features, size_t* lens, size_t count, float* predictions)
+  {
+    for (size_t k = 0; k < count; k++)
+      {
+	example* ec = ecs + k;
+	empty_example(all, *ec);
+	all.p->lp.default_label(ec->ld);
+	ec->partial_prediction = 0.;
+	ec->num_features = 0;
+	ec->total_sum_feat_sq = 0;
+	ec->loss = 0.;
+
+	for (size_t i = 0; i < lens[k]; i++)
+	  {
+	    primitive_feature_space& space = features[k][i];
+	    uint32_t index = space.name;
+	    unsigned char* seen = ec->indices.begin;
+	    while (seen != ec->indices.end && *seen != index)
+	      seen++;
+	    if (seen == ec->indices.end) //a repeated name adds to the same namespace.
+	      ec->indices.push_back(index);
+	    v_array<feature>& atomics = ec->atomics(index);
+	    if ((size_t)(atomics.end_array - atomics.end) < space.len)
+	      atomics.resize(atomics.size() + space.len);
+	    float sum_sq = 0.;
+	    for (size_t j = 0; j < space.len; j++)
+	      {
+		sum_sq += space.fs[j].x * space.fs[j].x;
+		*atomics.end++ = space.fs[j];
+	      }
+	    ec->sum_feat_sq(index) += sum_sq;
+	  }
+
+	if (all.p->sort_features)
+	  unique_sort_features(all.audit, all.parse_mask, ec);
+	setup_features(all, ec);
+	ec->test_only = true;
+	ec->example_t = (float)all.sd->t;
+
+	all.l->predict(*ec);
+	predictions[k] = ((label_data*)ec->ld)->prediction;
+      }
+  }
 }
 
 #ifdef _WIN32
@@ -1118,6 +1244,7 @@ void initialize_examples(vw& all)
   for (size_t i = 0; i < all.p->ring_size; i++)
     {
       all.p->examples[i].ld = calloc_or_die(1,all.p->lp.label_size);
+      all.p->examples[i].audit_features = alloc_audit_features(all.audit || all.hash_inv);
       all.p->examples[i].in_use = false;
     }
 }
@@ -19,6 +19,22 @@ namespace Scorer {
       base.predict(ec);
   }
 
+  //learns from a prediction made earlier by multipredict, as learn would have.
+  void update(scorer& s, learner& base, example& ec)
+  {
+    label_data* ld = (label_data*)ec.ld;
+    s.all->set_minmax(s.all->sd, ld->label);
+    if ((s.all->holdout_set_off || !ec.test_only) && ld->weight > 0)
+      base.update(ec);
+  }
+
+  void multipredict(scorer& s, learner& base, example& ec, size_t count, size_t, VW::prediction* pred)
+  {
+    label_data* ld = (label_data*)ec.ld;
+    s.all->set_minmax(s.all->sd, ld->label);
+    base.multipredict(ec, 0, count, pred);
+  }
+
   learner* setup(vw& all, po::variables_map& vm)
   {
     scorer* s = (scorer*)calloc_or_die(1, sizeof(scorer));
@@ -27,6 +43,9 @@ namespace Scorer {
     learner* l = new learner(s, all.l);
     l->set_learn<scorer, predict_or_learn<true> >();
     l->set_predict<scorer, predict_or_learn<false> >();
+    l->set_update<scorer, update>();
+    if (all.l->multipredicts())
+      l->set_multipredict<scorer, multipredict>();
 
     return l;
   }
@@ -202,8 +202,8 @@ namespace Searn
     uint32_t hash = seed;
 
     for (unsigned char* i=ec.indices.begin; i != ec.indices.end; i++)
-      hash = uniform_hash((unsigned char*) ec.atomics[*i].begin,
-                          sizeof(feature) * (ec.atomics[*i].end - ec.atomics[*i].begin),
+      hash = uniform_hash((unsigned char*) ec.atomics(*i).begin,
+                          sizeof(feature) * (ec.atomics(*i).end - ec.atomics(*i).begin),
                           hash );
 
     hash = uniform_hash( (unsigned char*) &ec.ft_offset,
@@ -288,7 +288,7 @@ namespace Searn
       cdbg << "v0 = " << v0 << " additional_offset = " << additional_offset << " h[] = " << h[hinfo.length-t] << endl;
       // add the basic history features
       feature temp = {history_value, (uint32_t) ( (v0*wpp) & all.reg.weight_mask )};
-      ec->atomics[history_namespace].push_back(temp);
+      ec->atomics(history_namespace).push_back(temp);
 
       if (all.audit) {
         audit_data a_feature = { NULL, NULL, (uint32_t)((v0*wpp) & all.reg.weight_mask), history_value, true };
@@ -306,7 +306,7 @@ namespace Searn
         v1 = (v0 * cubic_constant + (h[hinfo.length-t+1]+1) * (additional_offset+1)) * history_constant;
 
         feature temp = {history_value, (uint32_t) ( (v1*wpp) & all.reg.weight_mask )};
-        ec->atomics[history_namespace].push_back(temp);
+        ec->atomics(history_namespace).push_back(temp);
 
         if (all.audit) {
           audit_data a_feature = { NULL, NULL, (uint32_t)((v1*wpp) & all.reg.weight_mask), history_value, true };
@@ -327,7 +327,7 @@ namespace Searn
     if (hinfo.features > 0) {
       for (unsigned char* i = ec->indices.begin; i != ec->indices.end; i++) {
         int feature_index = 0;
-        for (feature* f = ec->atomics[*i].begin; f != ec->atomics[*i].end; f++) {
+        for (feature* f = ec->atomics(*i).begin; f != ec->atomics(*i).end; f++) {
 
           if (all.audit) {
             if (feature_index >= (int)ec->audit_features[*i].size() ) {
@@ -346,7 +346,7 @@ namespace Searn
 
             // add the history/feature pair
             feature temp = {history_value, (uint32_t) ( ((v0 + v)*wpp) & all.reg.weight_mask )};
-            ec->atomics[history_namespace].push_back(temp);
+            ec->atomics(history_namespace).push_back(temp);
 
             if (all.audit) {
               audit_data a_feature = { NULL, NULL, (uint32_t)(((v+v0)*wpp) & all.reg.weight_mask), history_value, true };
@@ -365,7 +365,7 @@ namespace Searn
               v1 = (v0 * cubic_constant + (h[hinfo.length-t+1]+1) * (additional_offset+1)) * history_constant;
 
               feature temp = {history_value, (uint32_t) ( ((v + v1)*wpp) & all.reg.weight_mask )};
-              ec->atomics[history_namespace].push_back(temp);
+              ec->atomics(history_namespace).push_back(temp);
 
               if (all.audit) {
                 audit_data a_feature = { NULL, NULL, (uint32_t)(((v+v1)*wpp) & all.reg.weight_mask), history_value, true };
@@ -385,9 +385,9 @@ namespace Searn
     }
 
     ec->indices.push_back(history_namespace);
-    ec->sum_feat_sq[history_namespace] += ec->atomics[history_namespace].size() * history_value;
-    ec->total_sum_feat_sq += ec->sum_feat_sq[history_namespace];
-    ec->num_features += ec->atomics[history_namespace].size();
+    ec->sum_feat_sq(history_namespace) += ec->atomics(history_namespace).size() * history_value;
+    ec->total_sum_feat_sq += ec->sum_feat_sq(history_namespace);
+    ec->num_features += ec->atomics(history_namespace).size();
   }
 
   void remove_history_from_example(vw&all, history_info &hinfo, example* ec)
@@ -404,10 +404,10 @@ namespace Searn
       return;
     }
 
-    ec->num_features -= ec->atomics[history_namespace].size();
-    ec->total_sum_feat_sq -= ec->sum_feat_sq[history_namespace] * history_value;
-    ec->sum_feat_sq[history_namespace] = 0;
-    ec->atomics[history_namespace].erase();
+    ec->num_features -= ec->atomics(history_namespace).size();
+    ec->total_sum_feat_sq -= ec->sum_feat_sq(history_namespace) * history_value;
+    ec->sum_feat_sq(history_namespace) = 0;
+    ec->atomics(history_namespace).erase();
     if (all.audit) {
       if (ec->audit_features[history_namespace].begin != ec->audit_features[history_namespace].end) {
         for (audit_data *f = ec->audit_features[history_namespace].begin; f != ec->audit_features[history_namespace].end; f++) {
@@ -1878,21 +1878,21 @@ void print_update(vw& all, searn& srn)
 
         if ((n + offset >= 0) && (n + offset < (int32_t)srn.priv->ec_seq.size())) { // we're okay on position
           example*you = srn.priv->ec_seq[n+offset];
-          size_t  you_size = you->atomics[old_ns].size();
+          size_t  you_size = you->atomics(old_ns).size();
 
           if (you_size > 0) {
-            if (me->atomics[neighbor_namespace].size() == 0)
+            if (me->atomics(neighbor_namespace).size() == 0)
               me->indices.push_back(neighbor_namespace);
 
-            me->atomics[neighbor_namespace].resize(me->atomics[neighbor_namespace].size() + you_size + 1);
-            for (feature*f = you->atomics[old_ns].begin; f != you->atomics[old_ns].end; ++f) {
+            me->atomics(neighbor_namespace).resize(me->atomics(neighbor_namespace).size() + you_size + 1);
+            for (feature*f = you->atomics(old_ns).begin; f != you->atomics(old_ns).end; ++f) {
               feature f2 = { (*f).x, (uint32_t)( ((*f).weight_index * neighbor_constant + enc_offset) & srn.priv->all->reg.weight_mask ) };
-              me->atomics[neighbor_namespace].push_back(f2);
+              me->atomics(neighbor_namespace).push_back(f2);
               cdbg << "_";
             }
 
             if (all->audit && (all->current_pass==0)) {
-              assert(you->atomics[old_ns].size() == you->audit_features[old_ns].size());
+              assert(you->atomics(old_ns).size() == you->audit_features[old_ns].size());
               for (audit_data*f = you->audit_features[old_ns].begin; f != you->audit_features[old_ns].end; ++f) {
                 uint32_t wi = (uint32_t)((*f).weight_index * neighbor_constant + enc_offset) & srn.priv->all->reg.weight_mask;
                 audit_data f2 = { NULL, NULL, wi, f->x, true };
@@ -1914,19 +1914,19 @@ void print_update(vw& all, searn& srn)
 
             }
             //cdbg << "copying " << you_size << " features" << endl;
-            me->sum_feat_sq[neighbor_namespace] += you->sum_feat_sq[old_ns];
-            me->total_sum_feat_sq += you->sum_feat_sq[old_ns];
+            me->sum_feat_sq(neighbor_namespace) += you->sum_feat_sq(old_ns);
+            me->total_sum_feat_sq += you->sum_feat_sq(old_ns);
             me->num_features += you_size;
           }
         } else if ((n + offset == -1) || (n + offset == (int32_t)srn.priv->ec_seq.size())) { // handle <s> and </s>
           size_t bias  = constant * ((n + offset < 0) ? 2 : 3);
           uint32_t fid = ((uint32_t)(( bias * neighbor_constant + enc_offset))) & srn.priv->all->reg.weight_mask;
 
-          if (me->atomics[neighbor_namespace].size() == 0)
+          if (me->atomics(neighbor_namespace).size() == 0)
             me->indices.push_back(neighbor_namespace);
 
           feature f = { 1., fid };
-          me->atomics[neighbor_namespace].push_back(f);
+          me->atomics(neighbor_namespace).push_back(f);
           cdbg << ".";
 
           if (all->audit && (all->current_pass==0)) {
@@ -1945,12 +1945,12 @@ void print_update(vw& all, searn& srn)
             cdbg << "+" << "{" << me->audit_features[neighbor_namespace].size() << "}";
           }
 
-          me->sum_feat_sq[neighbor_namespace] += 1.;
+          me->sum_feat_sq(neighbor_namespace) += 1.;
           me->total_sum_feat_sq += 1.;
           me->num_features += 1;
         }
       }
-      cdbg << "audit=" << me->audit_features[neighbor_namespace].size() << ", atomics=" << me->atomics[neighbor_namespace].size() << endl;
+      cdbg << "audit=" << me->audit_features[neighbor_namespace].size() << ", atomics=" << me->atomics(neighbor_namespace).size() << endl;
       cdbg << "add n'=" << me->num_features << endl;
     }
   }
@@ -1971,8 +1971,8 @@ void print_update(vw& all, searn& srn)
 
         if ((n + offset >= 0) && (n + offset < (int32_t)srn.priv->ec_seq.size())) { // we're okay on position
           example*you = srn.priv->ec_seq[n+offset];
-          total_size += you->atomics[old_ns].size();
-          total_sfs  += you->sum_feat_sq[old_ns];
+          total_size += you->atomics(old_ns).size();
+          total_sfs  += you->sum_feat_sq(old_ns);
         } else if ((n + offset == -1) || (n + offset == (int32_t)srn.priv->ec_seq.size())) {
           total_size += 1;
           total_sfs += 1;
@@ -1980,18 +1980,18 @@ void print_update(vw& all, searn& srn)
       }
 
       if (total_size > 0) {
-        if (me->atomics[neighbor_namespace].size() == total_size) {
+        if (me->atomics(neighbor_namespace).size() == total_size) {
           char last_idx = me->indices.pop();
           if (last_idx != (char)neighbor_namespace) {
             cerr << "error: some namespace was added after the neighbor namespace" << endl;
             throw exception();
           }
-          cdbg << "erasing new ns '" << (char)neighbor_namespace << "' of size " << me->atomics[neighbor_namespace].size() << endl;
-          me->atomics[neighbor_namespace].erase();
+          cdbg << "erasing new ns '" << (char)neighbor_namespace << "' of size " << me->atomics(neighbor_namespace).size() << endl;
+          me->atomics(neighbor_namespace).erase();
         } else {
-          cerr << "warning: neighbor namespace seems to be the wrong size? (total_size=" << total_size << " but ns.size=" << me->atomics[neighbor_namespace].size() << ")" << endl;
+          cerr << "warning: neighbor namespace seems to be the wrong size? (total_size=" << total_size << " but ns.size=" << me->atomics(neighbor_namespace).size() << ")" << endl;
           assert(false);
-          me->atomics[neighbor_namespace].end -= total_size;
+          me->atomics(neighbor_namespace).end -= total_size;
           cdbg << "erasing " << total_size << " features" << endl;
         }
 
@@ -2007,7 +2007,7 @@ void print_update(vw& all, searn& srn)
           me->audit_features[neighbor_namespace].end -= total_size;
         }
 
-        me->sum_feat_sq[neighbor_namespace] -= total_sfs;
+        me->sum_feat_sq(neighbor_namespace) -= total_sfs;
         me->total_sum_feat_sq -= total_sfs;
         me->num_features -= total_size;
       } else {
@@ -2716,8 +2716,10 @@ void print_update(vw& all, searn& srn)
     // set up copied examples if we need them
     if (! srn->priv->examples_dont_change) {
       size_t label_size = srn->priv->is_ldf ? sizeof(COST_SENSITIVE::label) : sizeof(MULTICLASS::mc_label);
-      for (size_t n=0; n<MAX_BRANCHING_FACTOR; n++)
+      for (size_t n=0; n<MAX_BRANCHING_FACTOR; n++) {
         srn->priv->learn_example_copy[n].ld = calloc_or_die(1, label_size);
+        srn->priv->learn_example_copy[n].audit_features = alloc_audit_features(all.audit);
+      }
     }
 
     if (!srn->priv->allow_current_policy) // if we're not dagger
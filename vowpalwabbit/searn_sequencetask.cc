@@ -324,7 +324,7 @@ namespace SequenceTask_DemoLDF {  // this is just to debug/show off how to do LD
   // this is totally bogus for the example -- you'd never actually do this!
   void update_example_indicies(bool audit, example* ec, uint32_t mult_amount, uint32_t plus_amount) {
     for (unsigned char* i = ec->indices.begin; i != ec->indices.end; i++)
-      for (feature* f = ec->atomics[*i].begin; f != ec->atomics[*i].end; ++f)
+      for (feature* f = ec->atomics(*i).begin; f != ec->atomics(*i).end; ++f)
         f->weight_index = (f->weight_index * mult_amount) + plus_amount;
     if (audit)
       for (unsigned char* i = ec->indices.begin; i != ec->indices.end; i++) 
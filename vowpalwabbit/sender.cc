@@ -20,6 +20,7 @@
 #include "simple_label.h"
 #include "network.h"
 #include "reductions.h"
+#include "shm_transport.h"
 
 using namespace std;
 using namespace LEARNER;
@@ -34,9 +35,9 @@ namespace SENDER {
     size_t received_index;
   };
 
-  void open_sockets(sender& s, string host)
+  void open_sockets(sender& s, string host, const char* shm_path)
 {
-  s.sd = open_socket(host.c_str());
+  s.sd = open_local_socket(host.c_str(), shm_path);
   s.buf = new io_buf();
   s.buf->files.push_back(s.sd);
 }
@@ -49,7 +50,7 @@ namespace SENDER {
   for (unsigned char* i = ec.indices.begin; i != ec.indices.end; i++) {
     if (*i == constant_namespace)
       continue;
-    output_features(*b, *i, ec.atomics[*i].begin, ec.atomics[*i].end, mask);
+    output_features(*b, *i, ec.atomics(*i).begin, ec.atomics(*i).end, mask);
   }
   b->flush();
 }
@@ -90,7 +91,10 @@ void end_examples(sender& s)
   //close our outputs to signal finishing.
   while (s.received_index != s.sent_index)
     receive_result(s);
-  shutdown(s.buf->files[0],SHUT_WR);
+  if (SHM::is_channel(s.buf->files[0]))
+    SHM::shutdown_write(s.buf->files[0]);
+  else
+    shutdown(s.buf->files[0],SHUT_WR);
 }
 
   void finish(sender& s) 
@@ -108,7 +112,8 @@ void end_examples(sender& s)
   if (vm.count("sendto"))
     {      
       vector<string> hosts = vm["sendto"].as< vector<string> >();
-      open_sockets(*s, hosts[0]);
+      string shm_path = vm.count("shm_socket") ? vm["shm_socket"].as<string>() : "";
+      open_sockets(*s, hosts[0], shm_path.empty() ? NULL : shm_path.c_str());
     }
 
   s->all = &all;
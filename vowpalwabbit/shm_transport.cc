@@ -0,0 +1,419 @@
+/*
+Copyright (c) by respective owners including Yahoo!, Microsoft, and
+individual contributors. All rights reserved.  Released under a BSD (revised)
+license as described in the file LICENSE.
+ */
+#include "shm_transport.h"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <iostream>
+
+using namespace std;
+
+namespace SHM {
+  // One direction of a connection.  head and tail count bytes ever
+  // written and read; they live on separate cache lines so producer and
+  // consumer do not false-share.  The futex words are bumped after every
+  // transfer and only slept on when the ring is empty (consumer) or full
+  // (producer).
+  struct ring {
+    volatile uint64_t head;
+    char pad0[56];
+    volatile uint64_t tail;
+    char pad1[56];
+    volatile uint32_t data_seq;
+    volatile uint32_t space_seq;
+    volatile uint32_t consumer_waiting;
+    volatile uint32_t producer_waiting;
+    volatile uint32_t closed;
+    char pad2[44];
+  };
+
+  struct channel {
+    char* base;
+    size_t map_size;
+    ring* in;
+    char* in_data;
+    ring* out;
+    char* out_data;
+  };
+
+  const size_t ring_stride = sizeof(ring) + ring_bytes;
+  const size_t max_channels = 1024;
+  const size_t spin_count = 256;
+
+  // Indexed by the unix socket fd of the connection.  Slots are only
+  // written when a connection opens or closes, so lookups need no lock.
+  channel* channels[max_channels];
+
+  inline channel* lookup(int f)
+  {
+    if (f < 0 || (size_t)f >= max_channels)
+      return NULL;
+    return channels[f];
+  }
+
+  bool is_channel(int f) { return lookup(f) != NULL; }
+
+  void futex_wait(volatile uint32_t* addr, uint32_t val)
+  {
+    timespec timeout = {1, 0}; //wake periodically to notice a dead peer.
+    syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAIT, val, &timeout, NULL, 0);
+  }
+
+  void futex_wake(volatile uint32_t* addr)
+  {
+    syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+  }
+
+  bool peer_gone(int f)
+  {
+    pollfd p = {f, POLLRDHUP, 0};
+    return poll(&p, 1, 0) > 0 && (p.revents & (POLLRDHUP | POLLHUP | POLLERR));
+  }
+
+  void map_rings(channel& c, bool daemon_side)
+  {
+    ring* requests = (ring*)c.base;
+    ring* responses = (ring*)(c.base + ring_stride);
+    if (daemon_side)
+      {
+	c.in = requests;
+	c.out = responses;
+      }
+    else
+      {
+	c.in = responses;
+	c.out = requests;
+      }
+    c.in_data = (char*)(c.in + 1);
+    c.out_data = (char*)(c.out + 1);
+  }
+
+  channel* map_channel(int memfd, size_t map_size, bool daemon_side)
+  {
+    void* base = mmap(NULL, map_size, PROT_READ|PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (base == MAP_FAILED)
+      {
+	perror("shm mmap failed");
+	return NULL;
+      }
+    channel* c = new channel;
+    c->base = (char*)base;
+    c->map_size = map_size;
+    map_rings(*c, daemon_side);
+    return c;
+  }
+
+  bool register_channel(int f, channel* c)
+  {
+    if (f < 0 || (size_t)f >= max_channels)
+      {
+	cerr << "shm: descriptor " << f << " too large for a shm channel" << endl;
+	munmap(c->base, c->map_size);
+	delete c;
+	return false;
+      }
+    __sync_synchronize();
+    channels[f] = c;
+    return true;
+  }
+
+  int listen_socket(const char* path)
+  {
+    sockaddr_un address;
+    if (strlen(path) >= sizeof(address.sun_path))
+      {
+	cerr << "shm socket path too long: " << path << endl;
+	return -1;
+      }
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0)
+      {
+	perror("can't open shm socket");
+	return -1;
+      }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    unlink(path);
+    if (bind(sock, (sockaddr*)&address, sizeof(address)) < 0 || listen(sock, 16) < 0)
+      {
+	perror("can't bind shm socket");
+	::close(sock);
+	return -1;
+      }
+    return sock;
+  }
+
+  int create_memfd(size_t size)
+  {
+#ifdef SYS_memfd_create
+    int memfd = (int)syscall(SYS_memfd_create, "vw_shm", 0);
+#else
+    int memfd = -1;
+    errno = ENOSYS;
+#endif
+    if (memfd < 0)
+      {
+	perror("memfd_create failed");
+	return -1;
+      }
+    if (ftruncate(memfd, size) < 0)
+      {
+	perror("ftruncate of shm rings failed");
+	::close(memfd);
+	return -1;
+      }
+    return memfd;
+  }
+
+  int accept_client(int listen_sock)
+  {
+    int f = accept(listen_sock, NULL, NULL);
+    if (f < 0)
+      return -1;
+
+    size_t map_size = 2 * ring_stride;
+    int memfd = create_memfd(map_size);
+    channel* c = memfd < 0 ? NULL : map_channel(memfd, map_size, true);
+    if (c == NULL)
+      {
+	if (memfd >= 0)
+	  ::close(memfd);
+	::close(f);
+	return -1;
+      }
+
+    // pass the memfd to the client along with the mapping size.
+    uint64_t size = map_size;
+    iovec iov = {&size, sizeof(size)};
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+
+    ssize_t sent = sendmsg(f, &msg, 0);
+    ::close(memfd);
+    if (sent != (ssize_t)sizeof(size) || !register_channel(f, c))
+      {
+	if (sent != (ssize_t)sizeof(size))
+	  {
+	    cerr << "shm handshake failed" << endl;
+	    munmap(c->base, c->map_size);
+	    delete c;
+	  }
+	::close(f);
+	return -1;
+      }
+    return f;
+  }
+
+  int connect_client(const char* path)
+  {
+    sockaddr_un address;
+    if (strlen(path) >= sizeof(address.sun_path))
+      return -1;
+    int f = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (f < 0)
+      return -1;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    if (connect(f, (sockaddr*)&address, sizeof(address)) < 0)
+      {
+	::close(f);
+	return -1;
+      }
+
+    uint64_t size = 0;
+    iovec iov = {&size, sizeof(size)};
+    char control[CMSG_SPACE(sizeof(int))];
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    int memfd = -1;
+    if (recvmsg(f, &msg, 0) == (ssize_t)sizeof(size))
+      {
+	cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+	  memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+      }
+    if (memfd < 0 || size != 2 * ring_stride)
+      {
+	cerr << "shm handshake failed, falling back" << endl;
+	if (memfd >= 0)
+	  ::close(memfd);
+	::close(f);
+	return -1;
+      }
+
+    channel* c = map_channel(memfd, size, false);
+    ::close(memfd);
+    if (c == NULL || !register_channel(f, c))
+      {
+	::close(f);
+	return -1;
+      }
+    return f;
+  }
+
+  ssize_t read(int f, void* buf, size_t nbytes)
+  {
+    channel* c = lookup(f);
+    ring* r = c->in;
+    size_t spins = 0;
+    while (true)
+      {
+	uint64_t tail = r->tail;
+	uint64_t avail = r->head - tail;
+	__sync_synchronize();
+	if (avail > 0)
+	  {
+	    size_t count = (size_t)(avail < nbytes ? avail : nbytes);
+	    size_t start = (size_t)(tail % ring_bytes);
+	    size_t first = ring_bytes - start < count ? ring_bytes - start : count;
+	    memcpy(buf, c->in_data + start, first);
+	    memcpy((char*)buf + first, c->in_data, count - first);
+	    __sync_synchronize();
+	    r->tail = tail + count;
+	    __sync_fetch_and_add(&r->space_seq, 1);
+	    if (r->producer_waiting)
+	      futex_wake(&r->space_seq);
+	    return count;
+	  }
+	if (r->closed)
+	  {
+	    //the writer may have appended its last bytes after head was loaded above.
+	    __sync_synchronize();
+	    if (r->head != r->tail)
+	      continue;
+	    return 0;
+	  }
+	if (spins++ < spin_count)
+	  continue;
+
+	uint32_t seq = r->data_seq;
+	r->consumer_waiting = 1;
+	__sync_synchronize();
+	if (r->head == r->tail && !r->closed)
+	  {
+	    futex_wait(&r->data_seq, seq);
+	    if (r->head == r->tail && !r->closed && peer_gone(f))
+	      r->closed = 1;
+	  }
+	r->consumer_waiting = 0;
+      }
+  }
+
+  ssize_t write(int f, const void* buf, size_t nbytes)
+  {
+    channel* c = lookup(f);
+    ring* r = c->out;
+    const char* p = (const char*)buf;
+    size_t done = 0;
+    size_t spins = 0;
+    while (done < nbytes)
+      {
+	uint64_t head = r->head;
+	uint64_t room = ring_bytes - (head - r->tail);
+	__sync_synchronize();
+	if (room > 0)
+	  {
+	    size_t count = nbytes - done < room ? nbytes - done : (size_t)room;
+	    size_t start = (size_t)(head % ring_bytes);
+	    size_t first = ring_bytes - start < count ? ring_bytes - start : count;
+	    memcpy(c->out_data + start, p + done, first);
+	    memcpy(c->out_data, p + done + first, count - first);
+	    __sync_synchronize();
+	    r->head = head + count;
+	    __sync_fetch_and_add(&r->data_seq, 1);
+	    if (r->consumer_waiting)
+	      futex_wake(&r->data_seq);
+	    done += count;
+	    spins = 0;
+	    continue;
+	  }
+	if (spins++ < spin_count)
+	  continue;
+
+	uint32_t seq = r->space_seq;
+	r->producer_waiting = 1;
+	__sync_synchronize();
+	if (r->head - r->tail == ring_bytes)
+	  {
+	    futex_wait(&r->space_seq, seq);
+	    if (r->head - r->tail == ring_bytes && peer_gone(f))
+	      {
+		r->producer_waiting = 0;
+		errno = EPIPE;
+		return done > 0 ? (ssize_t)done : -1;
+	      }
+	  }
+	r->producer_waiting = 0;
+      }
+    return done;
+  }
+
+  void shutdown_write(int f)
+  {
+    channel* c = lookup(f);
+    if (c == NULL || c->out->closed)
+      return;
+    __sync_synchronize();
+    c->out->closed = 1;
+    __sync_fetch_and_add(&c->out->data_seq, 1);
+    futex_wake(&c->out->data_seq);
+  }
+
+  void close(int f)
+  {
+    channel* c = lookup(f);
+    if (c == NULL)
+      return;
+    shutdown_write(f);
+    channels[f] = NULL;
+    __sync_synchronize();
+    munmap(c->base, c->map_size);
+    delete c;
+  }
+}
+
+#else //no memfd or futex: every client goes over TCP.
+
+namespace SHM {
+  int listen_socket(const char* path) { return -1; }
+  int accept_client(int listen_sock) { return -1; }
+  int connect_client(const char* path) { return -1; }
+  bool is_channel(int f) { return false; }
+  ssize_t read(int f, void* buf, size_t nbytes) { return -1; }
+  ssize_t write(int f, const void* buf, size_t nbytes) { return -1; }
+  void shutdown_write(int f) {}
+  void close(int f) {}
+}
+
+#endif
@@ -0,0 +1,47 @@
+/*
+Copyright (c) by respective owners including Yahoo!, Microsoft, and
+individual contributors. All rights reserved.  Released under a BSD (revised)
+license as described in the file LICENSE.
+ */
+// A shared memory transport for clients running on the same host as a
+// daemon.  The daemon listens on a unix domain socket; each connecting
+// client receives a memfd holding a request ring (client -> daemon) and a
+// response ring (daemon -> client), each with a futex doorbell.  The
+// rings are plain byte streams, so they carry exactly what would have gone
+// over TCP: the cache encoding of examples in, binary_print_result
+// records out.
+//
+// A connection is named by the file descriptor of its unix socket, and
+// io_buf::read/write/close_file_or_socket dispatch on is_channel(), so
+// the rest of the parser treats a shm client like any other socket.
+
+#ifndef SHM_TRANSPORT_H
+#define SHM_TRANSPORT_H
+
+#include <stddef.h>
+#ifdef _WIN32
+#ifndef ssize_t
+#define ssize_t size_t
+#endif
+#else
+#include <sys/types.h>
+#endif
+
+namespace SHM {
+  const size_t ring_bytes = 1 << 20; //capacity of each direction.
+
+  //daemon side: bind a unix domain socket at path, -1 on failure.
+  int listen_socket(const char* path);
+  //daemon side: accept a client and hand it a fresh ring pair, -1 if no client was waiting.
+  int accept_client(int listen_sock);
+  //client side: connect to a daemon, -1 if the path is unusable (so the caller can fall back to TCP).
+  int connect_client(const char* path);
+
+  bool is_channel(int f);
+  ssize_t read(int f, void* buf, size_t nbytes);
+  ssize_t write(int f, const void* buf, size_t nbytes);
+  void shutdown_write(int f); //signal end of stream to the peer.
+  void close(int f);
+}
+
+#endif
@@ -46,19 +46,19 @@ void unique_sort_features(bool audit, uint32_t parse_mask, example* ae)
   ae->sorted=true;
   for (unsigned char* b = ae->indices.begin; b != ae->indices.end; b++)
     {
-      v_array<feature> features = ae->atomics[*b];
+      v_array<feature> features = ae->atomics(*b);
 
       for (size_t i = 0; i < features.size(); i++)
 	features[i].weight_index &= parse_mask;
       qsort(features.begin, features.size(), sizeof(feature), 
 	    order_features);
-      unique_features(ae->atomics[*b]);
+      unique_features(ae->atomics(*b));
       
       if (audit)
 	{
 	  v_array<audit_data> afeatures = ae->audit_features[*b];
 
-	  for (size_t i = 0; i < ae->atomics[*b].size(); i++)
+	  for (size_t i = 0; i < ae->atomics(*b).size(); i++)
 	    afeatures[i].weight_index &= parse_mask;
 	  
 	  qsort(afeatures.begin, afeatures.size(), sizeof(audit_data), 
@@ -33,7 +33,7 @@ template<class T> class v_array{
   v_array() { begin= NULL; end = NULL; end_array=NULL; erase_count = 0;}
   T& operator[](size_t i) { return begin[i]; }
   T& get(size_t i) { return begin[i]; }
-  size_t size(){return end-begin;}
+  size_t size() const {return end-begin;}
   void resize(size_t length, bool zero_everything=false)
     {
       if ((size_t)(end_array-begin) != length)
@@ -59,6 +59,7 @@ template<class T> class v_array{
       }
     end = begin;
   }
+  void clear() { end = begin; } //like erase, but never gives memory back; for buffers recycled per example.
   void delete_v()
   {
     if (begin != NULL)
@@ -15,7 +15,7 @@ namespace VW {
 
 /*    Caveats:
     (1) Some commandline parameters do not make sense as a library.
-    (2) The code is not yet reentrant.
+    (2) The code is not yet reentrant, except for predict(vw&, const example&) below.
    */
   vw* initialize(string s);
 
@@ -46,6 +46,30 @@ namespace VW {
 
   //The more complex way to create an example.
 
+  /* Batch scoring.  The examples come from alloc_batch and belong to the caller, so they never
+     pass through the parser ring and take none of its locks.  predict_batch fills ecs[k] from the
+     lens[k] feature spaces at features[k] and writes its prediction to predictions[k]; examples are
+     reused across calls, so their feature storage is only grown, never reallocated per call.  Feature
+     spaces with the same name add to one namespace.  Learners with simple labels only; alloc_batch
+     throws for others.
+   */
+  example* alloc_batch(vw& all, size_t count);
+  void predict_batch(vw& all, example* ecs, primitive_feature_space** features, size_t* lens, size_t count, float* predictions);
+  void dealloc_batch(vw& all, example* ecs, size_t count);
+
+  /* Reentrant prediction.  Unlike vw::learn and learner::predict, this reads the example and the
+     weights and writes only the returned value, so many threads may score concurrently against one
+     loaded model while nothing is learning.  ec must already be set up (read_example, import_example
+     or predict_batch), and may come from a per-thread parser instance.  The gradient descent learner
+     is evaluated, including pairs, triples and --l1 truncation, and the model may have no reduction
+     above it but the scorer; it throws for --oaa, --nn, --binary and the like.
+   */
+  struct prediction {
+    float partial_prediction; //raw linear score.
+    float value; //after contraction and clipping to the label range.
+  };
+  prediction predict(vw& all, const example& ec);
+
   //after you create and fill feature_spaces, get an example with everything filled in.
   example* import_example(vw& all, primitive_feature_space* features, size_t len);
   example* import_example(vw& all, vector< feature_space > ec_info);
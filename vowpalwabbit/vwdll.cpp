@@ -62,6 +62,25 @@ extern "C"
 		return static_cast<VW_EXAMPLE>(VW::import_example(*pointer, f, len));
 	}
 	
+	VW_DLL_MEMBER VW_BATCH VW_CALLING_CONV VW_AllocBatch(VW_HANDLE handle, size_t count)
+	{
+		vw * pointer = static_cast<vw*>(handle);
+		return static_cast<VW_BATCH>(VW::alloc_batch(*pointer, count));
+	}
+
+	VW_DLL_MEMBER void VW_CALLING_CONV VW_PredictBatch(VW_HANDLE handle, VW_BATCH batch, VW_FEATURE_SPACE* features, size_t* lens, size_t count, float* predictions)
+	{
+		vw * pointer = static_cast<vw*>(handle);
+		VW::primitive_feature_space ** f = reinterpret_cast<VW::primitive_feature_space**>( features );
+		VW::predict_batch(*pointer, static_cast<example*>(batch), f, lens, count, predictions);
+	}
+
+	VW_DLL_MEMBER void VW_CALLING_CONV VW_FreeBatch(VW_HANDLE handle, VW_BATCH batch, size_t count)
+	{
+		vw * pointer = static_cast<vw*>(handle);
+		VW::dealloc_batch(*pointer, static_cast<example*>(batch), count);
+	}
+
 	VW_DLL_MEMBER VW_FEATURE_SPACE VW_CALLING_CONV VW_ExportExample(VW_HANDLE handle, VW_EXAMPLE e, size_t * plen)
 	{
 		vw* pointer = static_cast<vw*>(handle);
@@ -6,6 +6,7 @@ license as described in the file LICENSE.
 #ifndef VWDLL_H
 #define VWDLL_H
 
+#ifdef _WIN32
 #define VW_CALLING_CONV __stdcall
 
 #ifdef VWDLL_EXPORTS
@@ -13,6 +14,11 @@ license as described in the file LICENSE.
 #else
 #define VW_DLL_MEMBER __declspec(dllimport)
 #endif
+#else
+//elsewhere vwdll.cpp is compiled into the program, as library/batch_predict does.
+#define VW_CALLING_CONV
+#define VW_DLL_MEMBER
+#endif
 
 #ifdef __cplusplus
 extern "C"
@@ -24,6 +30,7 @@ extern "C"
 	typedef void * VW_LABEL;
 	typedef void * VW_FEATURE_SPACE;
 	typedef void * VW_FLAT_EXAMPLE;
+	typedef void * VW_BATCH;
  
 	const VW_HANDLE INVALID_VW_HANDLE = NULL;
 	const VW_HANDLE INVALID_VW_EXAMPLE = NULL;
@@ -35,6 +42,10 @@ extern "C"
 
 	VW_DLL_MEMBER VW_EXAMPLE VW_CALLING_CONV VW_ImportExample(VW_HANDLE handle, VW_FEATURE_SPACE * features, size_t len);
 
+	VW_DLL_MEMBER VW_BATCH VW_CALLING_CONV VW_AllocBatch(VW_HANDLE handle, size_t count);
+	VW_DLL_MEMBER void VW_CALLING_CONV VW_PredictBatch(VW_HANDLE handle, VW_BATCH batch, VW_FEATURE_SPACE * features, size_t * lens, size_t count, float * predictions);
+	VW_DLL_MEMBER void VW_CALLING_CONV VW_FreeBatch(VW_HANDLE handle, VW_BATCH batch, size_t count);
+
 	VW_DLL_MEMBER VW_FEATURE_SPACE VW_CALLING_CONV VW_ExportExample(VW_HANDLE handle, VW_EXAMPLE e, size_t* plen);
 	VW_DLL_MEMBER void VW_CALLING_CONV VW_ReleaseFeatureSpace(VW_FEATURE_SPACE * features, size_t len);
 
@@ -25,15 +25,15 @@ namespace WAP {
   {
     for (unsigned char* i = ec.indices.begin; i != ec.indices.end; i++) 
       {
-        size_t original_length = ec.atomics[*i].size();
+        size_t original_length = ec.atomics(*i).size();
         for (uint32_t j = 0; j < original_length; j++)
           {
-            feature* f = &ec.atomics[*i][j];
+            feature* f = &ec.atomics(*i)[j];
             feature temp = {- f->x, f->weight_index + offset2};
             f->weight_index += offset1;
-            ec.atomics[*i].push_back(temp);
+            ec.atomics(*i).push_back(temp);
           }
-        ec.sum_feat_sq[*i] *= 2;
+        ec.sum_feat_sq(*i) *= 2;
       }
     if (all.audit || all.hash_inv)
       {
@@ -67,11 +67,11 @@ namespace WAP {
   {
     for (unsigned char* i = ec.indices.begin; i != ec.indices.end; i++) 
       {
-        ec.atomics[*i].end = ec.atomics[*i].begin+ec.atomics[*i].size()/2;
-        feature* end = ec.atomics[*i].end;
-        for (feature* f = ec.atomics[*i].begin; f!= end; f++)
+        ec.atomics(*i).end = ec.atomics(*i).begin+ec.atomics(*i).size()/2;
+        feature* end = ec.atomics(*i).end;
+        for (feature* f = ec.atomics(*i).begin; f!= end; f++)
           f->weight_index -= offset1;
-        ec.sum_feat_sq[*i] /= 2;
+        ec.sum_feat_sq(*i) /= 2;
       }
     if (all.audit || all.hash_inv)
       {